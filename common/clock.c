@@ -0,0 +1,43 @@
+/**
+ * clock.c
+ *
+ * Monotonic clock used for measuring throughput, busy and waiting times.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <time.h>
+#include "main.h"
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return Current time in nanoseconds since some unspecified starting point
+ */
+long long clockNowNanos()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Sleep until the monotonic clock reaches a point in time.
+ *
+ * Returns right away if that time has passed already.
+ *
+ * @param nanos Time to wake up at, as returned by clockNowNanos()
+ */
+void clockSleepUntilNanos(long long nanos)
+{
+	struct timespec until;
+
+	until.tv_sec = nanos / 1000000000LL;
+	until.tv_nsec = nanos % 1000000000LL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0) {
+		// Interrupted by signal, keep sleeping
+	}
+}
@@ -0,0 +1,250 @@
+/**
+ * common.h
+ *
+ * Declarations and definitions of the modules shared by onebuf_readers_writer and
+ * swapbufs_consumers_producers. Included by the main.h of each, and the shared modules include
+ * that main.h in turn, so compile them with the program directory in the include path (-I.).
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+
+//
+// Configurable constants. All of them may be overridden at compile time, like those of main.h
+//
+
+// Backing of large allocations (see memory.c): any combination of MEMORY_HUGE_PAGES,
+// MEMORY_PREFAULT and MEMORY_LOCK, or 0 for plain lazily faulted pages
+#ifndef MEMORY_FLAGS
+#define MEMORY_FLAGS 0
+#endif
+
+// Size of a huge page, allocations smaller than that never use huge pages
+#ifndef MEMORY_HUGE_PAGE_SIZE
+#define MEMORY_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+// Count semaphore waits, blocking times, items etc. (see stats.c). 0 compiles counting away
+#ifndef STATS
+#define STATS 1
+#endif
+
+// Period of stats dumps to stderr in milliseconds, 0 to dump only on SIGUSR1
+#ifndef STATS_DUMP_PERIOD_MS
+#define STATS_DUMP_PERIOD_MS 5000
+#endif
+
+//
+// Clock functions
+//
+long long clockNowNanos();
+
+void clockSleepUntilNanos(long long nanos);
+
+//
+// Memory functions
+//
+
+// Allocation flags
+#define MEMORY_HUGE_PAGES 1
+#define MEMORY_PREFAULT 2
+#define MEMORY_LOCK 4
+
+// How an allocation is actually backed, after any fallbacks. THP_REQUESTED is regular pages
+// that transparent huge pages may back later on
+enum {
+	MEMORY_BACKING_PAGES,
+	MEMORY_BACKING_HUGETLB,
+	MEMORY_BACKING_THP,
+	MEMORY_BACKING_THP_REQUESTED
+};
+
+void *memoryAlloc(const char *name, size_t size);
+
+void memoryFree(void *memory);
+
+int memoryGetBacking(void *memory);
+
+const char *memoryBackingName(int backing);
+
+void memorySetFlags(int flags);
+
+int memoryGetFlags();
+
+//
+// Stats functions
+//
+
+// Max number of threads, semaphores and counters kept in a stats segment
+#ifndef STATS_MAX_THREADS
+#define STATS_MAX_THREADS 256
+#endif
+#define STATS_MAX_SEMS 4
+#define STATS_MAX_COUNTERS 8
+#define STATS_NAME_SIZE 32
+
+// Marks a valid stats segment
+#define STATS_MAGIC 0x53544154
+
+// Counters of a single thread, written only by that thread. Aligned to a cache line so threads
+// don't invalidate each other's counters
+typedef struct StatsThreadCounters {
+	char threadName[STATS_NAME_SIZE];
+	int isActive;
+	unsigned long long semWaitCount[STATS_MAX_SEMS];
+	unsigned long long semWakeupCount[STATS_MAX_SEMS];
+	unsigned long long semBlockedNanos[STATS_MAX_SEMS];
+	unsigned long long counters[STATS_MAX_COUNTERS];
+} __attribute__((aligned(64))) StatsThreadCounters;
+
+// Stats of a whole process, possibly placed in shared memory
+typedef struct StatsSegment {
+	int magic;
+	int pid;
+	long long startNanos;
+	int semCount;
+	int counterCount;
+	char semNames[STATS_MAX_SEMS][STATS_NAME_SIZE];
+	char counterNames[STATS_MAX_COUNTERS][STATS_NAME_SIZE];
+	int counterPer[STATS_MAX_COUNTERS];
+	int threadCount;
+	int droppedThreadCount;
+	int exitedThreadCount;
+	StatsThreadCounters exitedThreads;
+	StatsThreadCounters threads[STATS_MAX_THREADS];
+} StatsSegment;
+
+void statsInit(const char *programName, const char *semNames[], int semCount,
+		const char *counterNames[], const int counterPer[], int counterCount);
+
+// statsInit() with the STATS_SEM_NAMES and STATS_COUNTER_NAMES of the program (see main.h)
+void statsInitDefault(const char *programName);
+
+void statsRegisterThread(const char *threadName);
+
+void statsUnregisterThread();
+
+// Count into another slot, e.g. that of a coroutine about to run. Returns the previous one
+StatsThreadCounters *statsSwapCounters(StatsThreadCounters *counters);
+
+void statsSemWait(sem_t *sem, int semId);
+
+void statsMutexLock(pthread_mutex_t *mutex, int semId);
+
+void statsCondWait(pthread_cond_t *cond, pthread_mutex_t *mutex, int semId);
+
+void statsFdWait(int fd, int semId);
+
+// Count a semaphore wait the caller did on its own, blocked since startNanos (0 if it didn't block)
+void statsSemWaited(int semId, long long startNanos);
+
+void statsCount(int counterId, long long n);
+
+void statsSetEnabled(int enabled);
+
+void statsPrint(const StatsSegment *segment, FILE *out);
+
+void statsDump(FILE *out);
+
+void statsStartDumper(long periodMillis);
+
+void statsDestroy();
+
+const StatsSegment *statsAttach(const char *segmentName);
+
+// Instrumented operations used by the protocols, plain ones if STATS is 0
+#if STATS
+#define STATS_SEM_WAIT(sem, semId) statsSemWait(sem, semId)
+#define STATS_MUTEX_LOCK(mutex, semId) statsMutexLock(mutex, semId)
+#define STATS_COND_WAIT(cond, mutex, semId) statsCondWait(cond, mutex, semId)
+#define STATS_FD_WAIT(fd, semId) statsFdWait(fd, semId)
+#define STATS_SEM_WAITED(semId, startNanos) statsSemWaited(semId, startNanos)
+#define STATS_COUNT(counterId, n) statsCount(counterId, n)
+#else
+#define STATS_SEM_WAIT(sem, semId) do { } while (sem_wait(sem) != 0)
+#define STATS_MUTEX_LOCK(mutex, semId) pthread_mutex_lock(mutex)
+#define STATS_COND_WAIT(cond, mutex, semId) pthread_cond_wait(cond, mutex)
+#define STATS_FD_WAIT(fd, semId) statsFdWait(fd, semId)
+#define STATS_SEM_WAITED(semId, startNanos) do { (void) (startNanos); } while (0)
+#define STATS_COUNT(counterId, n) do { (void) (n); } while (0)
+#endif
+
+//
+// Histogram functions
+//
+
+// High dynamic range histogram of non-negative values, e.g. latencies in nanoseconds. Values are
+// counted in buckets at most 2^-(significantBits - 1) of their value wide, so percentiles are off by
+// no more than that (0.1% for 11 significant bits) no matter how wide the range of values is.
+typedef struct Histogram {
+	int significantBits;
+	long long maxValue;
+	int bucketCount;
+	long long *counts;
+	long long totalCount;
+	long long minValue;
+	long long maxRecordedValue;
+	double sum;
+	double sumOfSquares;
+} Histogram;
+
+void histogramInit(Histogram *histogram, long long maxValue, int significantBits);
+
+void histogramRecord(Histogram *histogram, long long value);
+
+void histogramMerge(Histogram *histogram, const Histogram *other);
+
+long long histogramValueAtPercentile(const Histogram *histogram, double percentile);
+
+double histogramMean(const Histogram *histogram);
+
+void histogramPrint(const Histogram *histogram, FILE *out, double valueScale);
+
+void histogramDestroy(Histogram *histogram);
+
+//
+// Latency functions
+//
+
+// Real-time priority of low latency threads, 1 (lowest) to 99
+#ifndef LATENCY_FIFO_PRIORITY
+#define LATENCY_FIFO_PRIORITY 10
+#endif
+
+// Low latency mode of the main programs: LATENCY_MLOCKALL applies to the process,
+// LATENCY_SCHED_FIFO to producers/writers and consumers/readers, and LATENCY_BUSY_POLL to
+// consumers/readers only, e.g. -DLATENCY_FLAGS=7 for all of them. 0 to block as usual
+#ifndef LATENCY_FLAGS
+#define LATENCY_FLAGS 0
+#endif
+
+// Number of polls after which a busy-polling thread yields the CPU
+#ifndef LATENCY_SPINS_PER_YIELD
+#define LATENCY_SPINS_PER_YIELD 1024
+#endif
+
+// Low latency flags
+#define LATENCY_SCHED_FIFO 1
+#define LATENCY_MLOCKALL 2
+#define LATENCY_BUSY_POLL 4
+
+// Lock process memory if asked for. Returns flags in effect, warning about those not permitted
+int latencyInit(int flags);
+
+// Run calling thread with SCHED_FIFO and/or busy-poll its waits. Returns flags in effect
+int latencyEnterThread(int flags);
+
+// Wait on a semaphore, busy-polling it if the calling thread is in busy-poll mode
+void latencySemWait(sem_t *sem, int semId);
+
+void latencyDestroy();
+
+
+#endif  /* COMMON_H */
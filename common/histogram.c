@@ -0,0 +1,249 @@
+/**
+ * histogram.c
+ *
+ * High dynamic range histogram, for latency distributions spanning nanoseconds to seconds.
+ *
+ * Values below 2^significantBits are counted exactly. Above that, each power of two range is
+ * split in 2^(significantBits - 1) equally wide buckets, so a bucket is never wider than
+ * 2^-(significantBits - 1) of the values it counts. Recording is a few shifts and an increment,
+ * and memory doesn't grow with the number of values recorded.
+ *
+ * histogramPrint() writes the percentile distribution in the text format of HdrHistogram, so
+ * it may be plotted with the HdrHistogram plotter or compared with other HdrHistogram outputs.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include "main.h"
+
+// Number of percentile ticks reported per halving of the distance to 100%
+#define HISTOGRAM_TICKS_PER_HALF_DISTANCE 5
+
+/**
+ * @param value Positive value
+ * @return Index of the most significant bit set in value
+ */
+static int histogramMostSignificantBit(long long value)
+{
+	return 63 - __builtin_clzll((unsigned long long) value);
+}
+
+/**
+ * @param histogram Histogram
+ * @param value Value, at most maxValue
+ * @return Bucket counting value
+ */
+static int histogramBucketOf(const Histogram *histogram, long long value)
+{
+	int shift;
+
+	if (value < (1LL << histogram->significantBits)) {
+		return (int) value;
+	}
+
+	// Keep significantBits bits of the value, the highest one being always set
+	shift = histogramMostSignificantBit(value) - (histogram->significantBits - 1);
+
+	return (1 << histogram->significantBits) + (shift - 1) * (1 << (histogram->significantBits - 1))
+			+ (int) ((value >> shift) - (1LL << (histogram->significantBits - 1)));
+}
+
+/**
+ * @param histogram Histogram
+ * @param bucket Bucket
+ * @return Highest value counted in bucket
+ */
+static long long histogramBucketHighestValue(const Histogram *histogram, int bucket)
+{
+	int halfCount = 1 << (histogram->significantBits - 1);
+	int shift;
+
+	if (bucket < (1 << histogram->significantBits)) {
+		return bucket;
+	}
+
+	shift = (bucket - (1 << histogram->significantBits)) / halfCount + 1;
+
+	return ((((long long) (bucket - (1 << histogram->significantBits)) % halfCount + halfCount) + 1) << shift) - 1;
+}
+
+/**
+ * Initialize an empty histogram.
+ *
+ * @param histogram Histogram to initialize
+ * @param maxValue Largest value ever recorded, larger ones are recorded as maxValue
+ * @param significantBits Bits of precision kept for each value, e.g. 11 for 0.1% precision
+ */
+void histogramInit(Histogram *histogram, long long maxValue, int significantBits)
+{
+	histogram->significantBits = significantBits;
+	histogram->maxValue = maxValue;
+	histogram->bucketCount = histogramBucketOf(histogram, maxValue) + 1;
+	histogram->counts = calloc(histogram->bucketCount, sizeof(long long));
+	histogram->totalCount = 0;
+	histogram->minValue = maxValue;
+	histogram->maxRecordedValue = 0;
+	histogram->sum = 0;
+	histogram->sumOfSquares = 0;
+}
+
+/**
+ * Count a value. Not thread-safe, so each thread should record into its own histogram and
+ * merge them once done.
+ *
+ * @param histogram Histogram
+ * @param value Value, negative ones are recorded as 0 and ones over maxValue as maxValue
+ */
+void histogramRecord(Histogram *histogram, long long value)
+{
+	if (value < 0) {
+		value = 0;
+	} else if (value > histogram->maxValue) {
+		value = histogram->maxValue;
+	}
+
+	histogram->counts[histogramBucketOf(histogram, value)]++;
+	histogram->totalCount++;
+	histogram->sum += value;
+	histogram->sumOfSquares += (double) value * value;
+
+	if (value < histogram->minValue) {
+		histogram->minValue = value;
+	}
+	if (value > histogram->maxRecordedValue) {
+		histogram->maxRecordedValue = value;
+	}
+}
+
+/**
+ * Add the counts of another histogram of the same range and precision.
+ *
+ * @param histogram Histogram to add counts to
+ * @param other Histogram to add
+ */
+void histogramMerge(Histogram *histogram, const Histogram *other)
+{
+	int bucket;
+
+	for (bucket = 0; bucket < histogram->bucketCount; bucket++) {
+		histogram->counts[bucket] += other->counts[bucket];
+	}
+
+	histogram->totalCount += other->totalCount;
+	histogram->sum += other->sum;
+	histogram->sumOfSquares += other->sumOfSquares;
+
+	if (other->minValue < histogram->minValue) {
+		histogram->minValue = other->minValue;
+	}
+	if (other->maxRecordedValue > histogram->maxRecordedValue) {
+		histogram->maxRecordedValue = other->maxRecordedValue;
+	}
+}
+
+/**
+ * @param histogram Histogram
+ * @param percentile Percentile in [0, 100]
+ * @return Value at or under which percentile % of the values recorded lie, 0 if none recorded
+ */
+long long histogramValueAtPercentile(const Histogram *histogram, double percentile)
+{
+	long long targetCount = (long long) ceil(percentile / 100 * histogram->totalCount);
+	long long count = 0;
+	int bucket;
+
+	if (targetCount < 1) {
+		targetCount = 1;
+	}
+
+	for (bucket = 0; bucket < histogram->bucketCount; bucket++) {
+		count += histogram->counts[bucket];
+		if (count >= targetCount) {
+			// Never report more than what has actually been recorded
+			return (histogramBucketHighestValue(histogram, bucket) < histogram->maxRecordedValue)
+					? histogramBucketHighestValue(histogram, bucket) : histogram->maxRecordedValue;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @param histogram Histogram
+ * @return Mean of values recorded, 0 if none recorded
+ */
+double histogramMean(const Histogram *histogram)
+{
+	return histogram->totalCount ? histogram->sum / histogram->totalCount : 0;
+}
+
+/**
+ * Print the percentile distribution, in the text format of HdrHistogram.
+ *
+ * Percentiles are reported at HISTOGRAM_TICKS_PER_HALF_DISTANCE ticks every time the distance
+ * to 100% halves, i.e. denser towards the tail.
+ *
+ * @param histogram Histogram
+ * @param out Stream to print to
+ * @param valueScale Recorded values are divided by valueScale, e.g. 1000 for nanoseconds to microseconds
+ */
+void histogramPrint(const Histogram *histogram, FILE *out, double valueScale)
+{
+	double percentile = 0;
+	double mean = histogramMean(histogram);
+	double variance;
+	long long count = 0;
+	int bucket = 0;
+	int halfCount = 1 << (histogram->significantBits - 1);
+
+	fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+	while (histogram->totalCount > 0) {
+		// Find the bucket holding the percentile
+		while ((bucket < histogram->bucketCount)
+				&& ((count < percentile / 100 * histogram->totalCount) || (count == 0))) {
+			count += histogram->counts[bucket++];
+		}
+
+		if (count >= histogram->totalCount) {
+			break;
+		}
+
+		fprintf(out, "%12.3f %2.12f %10lld %14.2f\n",
+				histogramBucketHighestValue(histogram, bucket - 1) / valueScale,
+				(double) count / histogram->totalCount, count,
+				1 / (1 - (double) count / histogram->totalCount));
+
+		// Move on to the next tick, or past the values counted so far
+		do {
+			percentile += 100.0 / (HISTOGRAM_TICKS_PER_HALF_DISTANCE
+					* pow(2, floor(log2(100 / (100 - percentile))) + 1));
+		} while (percentile / 100 * histogram->totalCount <= count);
+	}
+
+	fprintf(out, "%12.3f %2.12f %10lld\n", histogram->maxRecordedValue / valueScale, 1.0, histogram->totalCount);
+
+	variance = histogram->totalCount ? histogram->sumOfSquares / histogram->totalCount - mean * mean : 0;
+
+	fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / valueScale,
+			sqrt(variance > 0 ? variance : 0) / valueScale);
+	fprintf(out, "#[Max     = %12.3f, Total count    = %12lld]\n", histogram->maxRecordedValue / valueScale,
+			histogram->totalCount);
+
+	// Power of two ranges, the first one holding 2^significantBits values
+	fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+			1 + (histogram->bucketCount - (1 << histogram->significantBits) + halfCount - 1) / halfCount,
+			1 << histogram->significantBits);
+}
+
+/**
+ * Release histogram memory.
+ *
+ * @param histogram Histogram
+ */
+void histogramDestroy(Histogram *histogram)
+{
+	free(histogram->counts);
+}
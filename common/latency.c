@@ -0,0 +1,171 @@
+/**
+ * latency.c
+ *
+ * Low latency mode: real-time scheduling, locked memory and busy-polling waits.
+ *
+ * A thread blocked in sem_wait() sleeps in the kernel, so whatever is handed off to it (a buffer
+ * to consume, an item to read) waits for the thread to be woken up and scheduled again, which
+ * takes microseconds when the CPU is idle and much longer when it isn't. In low latency mode:
+ *
+ * 1. LATENCY_SCHED_FIFO: selected threads run with SCHED_FIFO priority LATENCY_FIFO_PRIORITY, so
+ *    they preempt ordinary threads as soon as they're runnable
+ * 2. LATENCY_MLOCKALL: the process locks all its memory, present and future, so handoffs never
+ *    stall on page faults
+ * 3. LATENCY_BUSY_POLL: selected threads poll their semaphores with sem_trywait() (i.e. a load
+ *    and a compare-and-swap in user space) instead of sleeping in sem_wait()
+ *
+ * The first two need privileges (CAP_SYS_NICE or RLIMIT_RTPRIO, CAP_IPC_LOCK or a large enough
+ * RLIMIT_MEMLOCK). Whatever is not permitted is left out with a warning, printed once, and the
+ * rest goes on.
+ *
+ * Busy-polling threads call sched_yield() every LATENCY_SPINS_PER_YIELD polls, so threads of the
+ * same priority sharing their CPU, such as the producer or writer they're waiting for, still get
+ * to run. Busy-polling only applies to waits of protocols going through latencySemWait().
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "main.h"
+
+// Tell the CPU we're spinning, so it doesn't starve its sibling hyperthread meanwhile
+#if defined(__x86_64__) || defined(__i386__)
+#define LATENCY_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define LATENCY_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define LATENCY_CPU_RELAX() do { } while (0)
+#endif
+
+//
+// Global (shared) variables
+//
+
+// Has latencyInit() locked the memory of the process?
+static int sharedIsMemoryLocked;
+
+// Flags whose failure warning has been printed already
+static int sharedWarnedFlags;
+
+// Does the calling thread busy-poll semaphores?
+static __thread int localIsBusyPolling;
+
+/**
+ * Print a warning about a low latency flag not being permitted, once per flag.
+ *
+ * @param flag Flag left out
+ * @param what What has been left out
+ * @param error Error number of the failure
+ */
+static void latencyWarn(int flag, const char *what, int error)
+{
+	if (!(__sync_fetch_and_or(&sharedWarnedFlags, flag) & flag)) {
+		fprintf(stderr, "Warning: could not %s (%s), going on without it\n", what, strerror(error));
+	}
+}
+
+/**
+ * Set up low latency mode for the process.
+ *
+ * Only LATENCY_MLOCKALL is acted upon here, the other flags are per thread (see
+ * latencyEnterThread()).
+ *
+ * @param flags Any combination of LATENCY_SCHED_FIFO, LATENCY_MLOCKALL and LATENCY_BUSY_POLL
+ * @return Flags actually in effect
+ */
+int latencyInit(int flags)
+{
+	if (flags & LATENCY_MLOCKALL) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+			sharedIsMemoryLocked = 1;
+		} else {
+			latencyWarn(LATENCY_MLOCKALL, "lock memory, check RLIMIT_MEMLOCK", errno);
+			flags &= ~LATENCY_MLOCKALL;
+		}
+	}
+
+	return flags;
+}
+
+/**
+ * Enter low latency mode on the calling thread.
+ *
+ * @param flags LATENCY_SCHED_FIFO to run with real-time priority, LATENCY_BUSY_POLL to
+ *        busy-poll semaphores waited on with latencySemWait(). Other flags are ignored
+ * @return Flags actually in effect for the calling thread
+ */
+int latencyEnterThread(int flags)
+{
+	struct sched_param param;
+	int error;
+
+	flags &= LATENCY_SCHED_FIFO | LATENCY_BUSY_POLL;
+
+	if (flags & LATENCY_SCHED_FIFO) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = LATENCY_FIFO_PRIORITY;
+
+		if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+			latencyWarn(LATENCY_SCHED_FIFO, "run with SCHED_FIFO, check RLIMIT_RTPRIO", error);
+			flags &= ~LATENCY_SCHED_FIFO;
+		}
+	}
+
+	localIsBusyPolling = (flags & LATENCY_BUSY_POLL) != 0;
+
+	return flags;
+}
+
+/**
+ * Wait on a semaphore, busy-polling it if the calling thread is in busy-poll mode.
+ *
+ * Either way the wait is counted in stats.c, busy-polling counting as blocked time.
+ *
+ * @param sem Semaphore to wait on
+ * @param semId Id of semaphore in the semNames given to statsInit()
+ */
+void latencySemWait(sem_t *sem, int semId)
+{
+	int spinCount = 0;
+	long long startNanos;
+
+	if (!localIsBusyPolling) {
+		STATS_SEM_WAIT(sem, semId);
+		return;
+	}
+
+	if (sem_trywait(sem) == 0) {
+		// Semaphore was free, no polling took place
+		STATS_SEM_WAITED(semId, 0);
+		return;
+	}
+
+	startNanos = STATS ? clockNowNanos() : 0;
+	while (sem_trywait(sem) != 0) {
+		if (++spinCount < LATENCY_SPINS_PER_YIELD) {
+			LATENCY_CPU_RELAX();
+		} else {
+			spinCount = 0;
+			sched_yield();
+		}
+	}
+
+	STATS_SEM_WAITED(semId, startNanos);
+}
+
+/**
+ * Leave low latency mode for the process, unlocking its memory.
+ */
+void latencyDestroy()
+{
+	if (sharedIsMemoryLocked) {
+		munlockall();
+		sharedIsMemoryLocked = 0;
+	}
+}
@@ -0,0 +1,327 @@
+/**
+ * memory.c
+ *
+ * Allocation of large, long-lived storage (buffers, item arrays) with control over its backing.
+ *
+ * Once buffers span thousands of 4 KB pages, the first write to every page takes a page fault
+ * and every access may miss the TLB, both showing up in latency tails. Depending on the flags
+ * set with memorySetFlags() (MEMORY_FLAGS at compile time), allocations:
+ *
+ * 1. MEMORY_HUGE_PAGES: are backed by explicit huge pages (MAP_HUGETLB). If none are reserved
+ *    (see /proc/sys/vm/nr_hugepages), they fall back to huge page aligned regular memory that
+ *    transparent huge pages may back (madvise(MADV_HUGEPAGE)). Only applies to allocations of at
+ *    least MEMORY_HUGE_PAGE_SIZE bytes.
+ * 2. MEMORY_PREFAULT: are faulted in at allocation time (MAP_POPULATE), so no page fault ever
+ *    happens while producing or consuming.
+ * 3. MEMORY_LOCK: are locked in RAM (mlock), so they are never swapped out. Without the privilege
+ *    or enough RLIMIT_MEMLOCK this only prints a warning.
+ *
+ * Allocations are page aligned and zero filled. Every allocation gets a mapping of its own, kept
+ * in a small table so that memoryFree() knows how it was mapped.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "main.h"
+
+// Max number of live allocations, e.g. one per buffer
+#ifndef MEMORY_MAX_REGIONS
+#define MEMORY_MAX_REGIONS 4096
+#endif
+
+// A live allocation
+typedef struct MemoryRegion {
+	// Start of usable memory, NULL if the table entry is free
+	void *address;
+
+	// Size of the mapping starting at address
+	size_t mappedSize;
+
+	// How the allocation is actually backed (MEMORY_BACKING_*)
+	int backing;
+} MemoryRegion;
+
+//
+// Global (shared) variables
+//
+
+// Flags applied to new allocations
+static int sharedMemoryFlags = MEMORY_FLAGS;
+
+// Live allocations
+static MemoryRegion sharedMemoryRegions[MEMORY_MAX_REGIONS];
+
+// Mutex protecting the table of live allocations
+static pthread_mutex_t sharedMemoryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Has the mlock() failure warning been printed already?
+static int sharedIsLockWarningPrinted;
+
+/**
+ * Round size up to a multiple of alignment, a power of 2.
+ */
+static size_t memoryRoundUp(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Fault in all pages of a mapping, for writing.
+ */
+static void memoryPrefault(char *address, size_t size)
+{
+	size_t offset;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(address, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+
+	// Older kernel, touch every page. Memory is still zero filled, so write zeros
+	for (offset = 0; offset < size; offset += sysconf(_SC_PAGESIZE)) {
+		((volatile char *) address)[offset] = 0;
+	}
+}
+
+/**
+ * Map huge page aligned regular memory, for transparent huge pages to back.
+ *
+ * mmap() only guarantees page alignment, so map an extra huge page and trim the ends.
+ *
+ * @param mappedSize Size to map, a multiple of MEMORY_HUGE_PAGE_SIZE
+ * @param mmapFlags Extra mmap() flags
+ * @return Mapped memory or MAP_FAILED
+ */
+static void *memoryMapAligned(size_t mappedSize, int mmapFlags)
+{
+	char *address;
+	char *alignedAddress;
+
+	address = mmap(NULL, mappedSize + MEMORY_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (address == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	alignedAddress = (char *) memoryRoundUp((size_t) address, MEMORY_HUGE_PAGE_SIZE);
+	if (alignedAddress > address) {
+		munmap(address, alignedAddress - address);
+	}
+	munmap(alignedAddress + mappedSize, address + MEMORY_HUGE_PAGE_SIZE - alignedAddress);
+
+	// Ask for transparent huge pages before touching anything, so faults get huge pages
+	madvise(alignedAddress, mappedSize, MADV_HUGEPAGE);
+
+	if (mmapFlags & MAP_POPULATE) {
+		// MAP_POPULATE has no effect after mmap(), so fault everything in now
+		memoryPrefault(alignedAddress, mappedSize);
+	}
+
+	return alignedAddress;
+}
+
+/**
+ * Allocate zero filled memory according to the current flags.
+ *
+ * @param name Name of the allocation, used in warnings
+ * @param size Number of bytes to allocate
+ * @return Allocated memory, NULL if out of memory
+ */
+void *memoryAlloc(const char *name, size_t size)
+{
+	int i;
+	int flags = memoryGetFlags();
+	int mmapFlags = (flags & MEMORY_PREFAULT) ? MAP_POPULATE : 0;
+	int backing = MEMORY_BACKING_PAGES;
+	size_t mappedSize = memoryRoundUp(size, sysconf(_SC_PAGESIZE));
+	void *address = MAP_FAILED;
+
+	if ((flags & MEMORY_HUGE_PAGES) && (size >= MEMORY_HUGE_PAGE_SIZE)) {
+		mappedSize = memoryRoundUp(size, MEMORY_HUGE_PAGE_SIZE);
+
+		// Explicit huge pages are all-or-nothing, so try them first
+		address = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | mmapFlags, -1, 0);
+		if (address != MAP_FAILED) {
+			backing = MEMORY_BACKING_HUGETLB;
+		} else {
+			// Whether transparent huge pages back it is only known once touched (memoryGetBacking())
+			address = memoryMapAligned(mappedSize, mmapFlags);
+			backing = MEMORY_BACKING_THP_REQUESTED;
+		}
+	}
+
+	if (address == MAP_FAILED) {
+		address = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | mmapFlags, -1, 0);
+		backing = MEMORY_BACKING_PAGES;
+	}
+
+	if (address == MAP_FAILED) {
+		fprintf(stderr, "Could not allocate %zu bytes for %s: %s\n", size, name, strerror(errno));
+		return NULL;
+	}
+
+	if ((flags & MEMORY_LOCK) && (mlock(address, mappedSize) != 0) && !sharedIsLockWarningPrinted) {
+		sharedIsLockWarningPrinted = 1;
+		fprintf(stderr, "Warning: could not lock %s in memory (%s), check RLIMIT_MEMLOCK\n",
+				name, strerror(errno));
+	}
+
+	TRACE("Allocated %zu bytes for %s, backed by %s\n", mappedSize, name, memoryBackingName(backing));
+
+	pthread_mutex_lock(&sharedMemoryMutex);
+	for (i = 0; i < MEMORY_MAX_REGIONS; i++) {
+		if (!sharedMemoryRegions[i].address) {
+			sharedMemoryRegions[i].address = address;
+			sharedMemoryRegions[i].mappedSize = mappedSize;
+			sharedMemoryRegions[i].backing = backing;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sharedMemoryMutex);
+
+	if (i == MEMORY_MAX_REGIONS) {
+		fprintf(stderr, "Too many allocations, could not allocate %s\n", name);
+		munmap(address, mappedSize);
+		return NULL;
+	}
+
+	return address;
+}
+
+/**
+ * Release memory allocated by memoryAlloc().
+ *
+ * @param memory Allocated memory, may be NULL
+ */
+void memoryFree(void *memory)
+{
+	int i;
+
+	if (!memory) {
+		return;
+	}
+
+	pthread_mutex_lock(&sharedMemoryMutex);
+	for (i = 0; i < MEMORY_MAX_REGIONS; i++) {
+		if (sharedMemoryRegions[i].address == memory) {
+			munmap(memory, sharedMemoryRegions[i].mappedSize);
+			sharedMemoryRegions[i].address = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sharedMemoryMutex);
+}
+
+/**
+ * How many bytes of a range are backed by transparent huge pages right now?
+ *
+ * Sums AnonHugePages of the mappings overlapping the range in /proc/self/smaps. Mappings are
+ * counted whole, which is close enough for ranges that span their own mapping.
+ *
+ * @param address Start of range
+ * @param size Size of range
+ * @return Bytes backed by transparent huge pages, 0 if unknown
+ */
+static size_t memoryGetHugePageBytes(void *address, size_t size)
+{
+	char line[256];
+	unsigned long start;
+	unsigned long end;
+	unsigned long hugeKilobytes;
+	int isOverlapping = 0;
+	size_t hugeBytes = 0;
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+
+	if (!smaps) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			// Header line of the next mapping
+			isOverlapping = (start < (unsigned long) address + size) && (end > (unsigned long) address);
+		} else if (isOverlapping && (sscanf(line, "AnonHugePages: %lu kB", &hugeKilobytes) == 1)) {
+			hugeBytes += hugeKilobytes * 1024;
+		}
+	}
+
+	fclose(smaps);
+
+	return hugeBytes;
+}
+
+/**
+ * How is some allocated memory backed?
+ *
+ * Transparent huge pages are reported only if some of the memory is actually backed by them,
+ * which depends on the system settings and may take until khugepaged gets to it.
+ *
+ * @param memory Memory allocated by memoryAlloc()
+ * @return One of MEMORY_BACKING_*
+ */
+int memoryGetBacking(void *memory)
+{
+	int i;
+	int backing = MEMORY_BACKING_PAGES;
+	size_t mappedSize = 0;
+
+	pthread_mutex_lock(&sharedMemoryMutex);
+	for (i = 0; i < MEMORY_MAX_REGIONS; i++) {
+		if (sharedMemoryRegions[i].address == memory) {
+			backing = sharedMemoryRegions[i].backing;
+			mappedSize = sharedMemoryRegions[i].mappedSize;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sharedMemoryMutex);
+
+	if ((backing == MEMORY_BACKING_THP_REQUESTED) && (memoryGetHugePageBytes(memory, mappedSize) > 0)) {
+		backing = MEMORY_BACKING_THP;
+	}
+
+	return backing;
+}
+
+/**
+ * @param backing One of MEMORY_BACKING_*
+ * @return Printable name of backing
+ */
+const char *memoryBackingName(int backing)
+{
+	switch (backing) {
+	case MEMORY_BACKING_HUGETLB:
+		return "explicit huge pages";
+	case MEMORY_BACKING_THP:
+		return "transparent huge pages";
+	case MEMORY_BACKING_THP_REQUESTED:
+		return "THP requested";
+	default:
+		return "regular pages";
+	}
+}
+
+/**
+ * Set flags applied to subsequent allocations.
+ *
+ * @param flags Any combination of MEMORY_HUGE_PAGES, MEMORY_PREFAULT and MEMORY_LOCK
+ */
+void memorySetFlags(int flags)
+{
+	__atomic_store_n(&sharedMemoryFlags, flags, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return Flags applied to new allocations
+ */
+int memoryGetFlags()
+{
+	return __atomic_load_n(&sharedMemoryFlags, __ATOMIC_RELAXED);
+}
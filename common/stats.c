@@ -0,0 +1,729 @@
+/**
+ * stats.c
+ *
+ * Low-overhead contention statistics for the synchronization protocols.
+ *
+ * Every thread gets its own slot of counters in a stats segment which only that thread writes
+ * to, so counting needs neither locks nor atomic read-modify-write instructions. Whoever reads
+ * the statistics (periodic dump, SIGUSR1 dump, or the stats_view tool attached to the segment
+ * from another process) sums up all slots while threads keep counting, so totals may lag
+ * behind by a few increments but never block anybody.
+ *
+ * When a thread exits its counters are added up into those of exited threads and its slot is
+ * freed for threads created later on, so programs creating threads run after run don't run out
+ * of slots.
+ *
+ * Semaphore waits are first attempted with sem_trywait(). Only waits that actually block are
+ * timed and counted as wake-ups, so the uncontended path costs no clock reads.
+ *
+ * The stats segment is a POSIX shared memory object named after the program and its pid. It
+ * describes its own semaphore and counter names, so the same tool can read any program's stats.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "main.h"
+
+//
+// Global (shared) variables
+//
+
+// Stats segment of this process, NULL until statsInit() is called
+static StatsSegment *sharedStatsSegment;
+
+// Name of shared memory object backing sharedStatsSegment, empty if it's plain heap memory
+static char sharedStatsSegmentName[64];
+
+// Whether counting is currently on. Lets benchmarks measure the instrumentation overhead
+static int sharedStatsEnabled;
+
+// Signaling semaphore telling the dumper thread to dump statistics right away
+static sem_t sharedSemDump;
+
+// Set by SIGINT/SIGTERM, telling the dumper thread to dump one last time and exit
+static volatile sig_atomic_t sharedStatsExitRequested;
+
+// Key whose destructor frees the counters slot of an exiting thread
+static pthread_key_t sharedStatsKey;
+static pthread_once_t sharedStatsKeyOnce = PTHREAD_ONCE_INIT;
+
+// Stand-in slot of threads that found no free slot. Never written to nor summed up
+static StatsThreadCounters sharedUncountedCounters;
+
+// Counters slot of each thread, NULL until the thread registers
+static __thread StatsThreadCounters *localCounters;
+
+// Increment a counter only ever written by the current thread
+#define STATS_BUMP(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+// Read a counter some other thread may be writing to
+#define STATS_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/**
+ * Create the stats segment of this process.
+ *
+ * @param programName Program name, used for naming the shared memory segment
+ * @param semNames Names of instrumented semaphores, indexed by the semId given to statsSemWait()
+ * @param semCount Number of semNames
+ * @param counterNames Names of counters, indexed by the counterId given to statsCount()
+ * @param counterPer For each counter, id of the counter it's meant to be divided by when
+ *        printed (e.g. items per swap), or -1
+ * @param counterCount Number of counterNames
+ */
+void statsInit(const char *programName, const char *semNames[], int semCount,
+		const char *counterNames[], const int counterPer[], int counterCount)
+{
+	int fd;
+	int i;
+	StatsSegment *segment = MAP_FAILED;
+
+	snprintf(sharedStatsSegmentName, sizeof(sharedStatsSegmentName), "/%s-stats-%d",
+			programName, (int) getpid());
+
+	// Try placing the segment in shared memory so other processes can read it live
+	fd = shm_open(sharedStatsSegmentName, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd != -1) {
+		if (ftruncate(fd, sizeof(StatsSegment)) == 0) {
+			segment = mmap(NULL, sizeof(StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+
+	if (segment == MAP_FAILED) {
+		fprintf(stderr, "Could not create shared stats segment %s, keeping stats private\n",
+				sharedStatsSegmentName);
+
+		shm_unlink(sharedStatsSegmentName);
+		sharedStatsSegmentName[0] = '\0';
+		segment = calloc(1, sizeof(StatsSegment));
+	} else {
+		memset(segment, 0, sizeof(StatsSegment));
+		fprintf(stderr, "Stats segment: %s\n", sharedStatsSegmentName);
+	}
+
+	segment->magic = STATS_MAGIC;
+	segment->pid = (int) getpid();
+	segment->startNanos = clockNowNanos();
+	segment->semCount = (semCount < STATS_MAX_SEMS) ? semCount : STATS_MAX_SEMS;
+	segment->counterCount = (counterCount < STATS_MAX_COUNTERS) ? counterCount : STATS_MAX_COUNTERS;
+
+	for (i = 0; i < segment->semCount; i++) {
+		strncpy(segment->semNames[i], semNames[i], STATS_NAME_SIZE - 1);
+	}
+
+	for (i = 0; i < segment->counterCount; i++) {
+		strncpy(segment->counterNames[i], counterNames[i], STATS_NAME_SIZE - 1);
+		segment->counterPer[i] = counterPer[i];
+	}
+
+	sharedStatsSegment = segment;
+	sharedStatsEnabled = 1;
+}
+
+/**
+ * Create the stats segment of this process, naming semaphores and counters after the
+ * STATS_SEM_* and STATS_COUNTER_* ids used by the protocols of the program (see its main.h).
+ *
+ * @param programName Program name, used for naming the shared memory segment
+ */
+void statsInitDefault(const char *programName)
+{
+	const char *semNames[STATS_SEM_COUNT] = STATS_SEM_NAMES;
+	const char *counterNames[STATS_COUNTER_COUNT] = STATS_COUNTER_NAMES;
+	const int counterPer[STATS_COUNTER_COUNT] = STATS_COUNTER_PER;
+
+	statsInit(programName, semNames, STATS_SEM_COUNT, counterNames, counterPer, STATS_COUNTER_COUNT);
+}
+
+/**
+ * Free the counters slot of a thread, adding its counters up into those of exited threads.
+ *
+ * The slot is marked busy (-1) meanwhile, so it's neither summed up by readers nor taken by
+ * registering threads.
+ *
+ * @param counters Counters slot of the thread
+ */
+static void statsReleaseCounters(StatsThreadCounters *counters)
+{
+	StatsThreadCounters *exited = &sharedStatsSegment->exitedThreads;
+	int i;
+
+	__atomic_store_n(&counters->isActive, -1, __ATOMIC_RELEASE);
+
+	// Several threads may exit at once, so add up atomically
+	for (i = 0; i < STATS_MAX_SEMS; i++) {
+		__sync_fetch_and_add(&exited->semWaitCount[i], counters->semWaitCount[i]);
+		__sync_fetch_and_add(&exited->semWakeupCount[i], counters->semWakeupCount[i]);
+		__sync_fetch_and_add(&exited->semBlockedNanos[i], counters->semBlockedNanos[i]);
+	}
+	for (i = 0; i < STATS_MAX_COUNTERS; i++) {
+		__sync_fetch_and_add(&exited->counters[i], counters->counters[i]);
+	}
+	__sync_fetch_and_add(&sharedStatsSegment->exitedThreadCount, 1);
+
+	memset(counters, 0, sizeof(StatsThreadCounters));
+	__atomic_store_n(&counters->isActive, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Destructor of sharedStatsKey, run by every exiting thread that registered.
+ *
+ * @param counters Counters slot of the exiting thread
+ */
+static void statsThreadExit(void *counters)
+{
+	if (counters == localCounters) {
+		localCounters = NULL;
+	}
+
+	statsReleaseCounters(counters);
+}
+
+/**
+ * Create sharedStatsKey, once per process.
+ */
+static void statsCreateKey()
+{
+	pthread_key_create(&sharedStatsKey, statsThreadExit);
+}
+
+/**
+ * Give the calling thread a counters slot of its own, freed once it exits.
+ *
+ * Threads calling statsSemWait() or statsCount() without registering are registered
+ * automatically under an anonymous name.
+ *
+ * @param threadName Name of registering thread
+ */
+void statsRegisterThread(const char *threadName)
+{
+	StatsThreadCounters *counters;
+	int threadCount;
+	int slotId;
+
+	if (!sharedStatsSegment || localCounters) {
+		return;
+	}
+
+	// Take the first free slot
+	for (slotId = 0; slotId < STATS_MAX_THREADS; slotId++) {
+		counters = &sharedStatsSegment->threads[slotId];
+		if (__sync_bool_compare_and_swap(&counters->isActive, 0, -1)) {
+			break;
+		}
+	}
+
+	if (slotId == STATS_MAX_THREADS) {
+		// Out of slots, this thread will not be counted
+		__sync_fetch_and_add(&sharedStatsSegment->droppedThreadCount, 1);
+		localCounters = &sharedUncountedCounters;
+		return;
+	}
+
+	// Let readers know how many slots to go through
+	threadCount = STATS_READ(sharedStatsSegment->threadCount);
+	while ((threadCount <= slotId)
+			&& !__atomic_compare_exchange_n(&sharedStatsSegment->threadCount, &threadCount, slotId + 1,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// Somebody else took a slot meanwhile, try again
+	}
+
+	strncpy(counters->threadName, threadName, STATS_NAME_SIZE - 1);
+	__atomic_store_n(&counters->isActive, 1, __ATOMIC_RELEASE);
+
+	localCounters = counters;
+
+	// Coroutines register on the threads running them (see statsSwapCounters()), so only the
+	// first slot registered on a thread is its own, to be freed when it exits
+	pthread_once(&sharedStatsKeyOnce, statsCreateKey);
+	if (!pthread_getspecific(sharedStatsKey)) {
+		pthread_setspecific(sharedStatsKey, counters);
+	}
+}
+
+/**
+ * Free the counters slot of the calling thread (or coroutine) before it exits. Its counters are
+ * still included in totals.
+ */
+void statsUnregisterThread()
+{
+	if (localCounters && (localCounters != &sharedUncountedCounters)) {
+		if (pthread_getspecific(sharedStatsKey) == localCounters) {
+			pthread_setspecific(sharedStatsKey, NULL);
+		}
+
+		statsReleaseCounters(localCounters);
+	}
+
+	localCounters = NULL;
+}
+
+/**
+ * Switch the calling thread to counting into the slot of something else it runs, such as a
+ * coroutine, which may run on a different thread every time it's resumed.
+ *
+ * @param counters Slot to count into, as returned when switching away from it. NULL to have a
+ *        slot registered on first count, which statsUnregisterThread() frees
+ * @return Slot counted into so far
+ */
+StatsThreadCounters *statsSwapCounters(StatsThreadCounters *counters)
+{
+	StatsThreadCounters *previous = localCounters;
+
+	localCounters = counters;
+
+	return previous;
+}
+
+/**
+ * Find counters slot of the calling thread, registering it if needed.
+ *
+ * @return Counters slot, or NULL if the thread is not counted
+ */
+static StatsThreadCounters *statsThreadCounters()
+{
+	if (!localCounters && sharedStatsSegment) {
+		statsRegisterThread("[anonymous]");
+	}
+
+	return (localCounters != &sharedUncountedCounters) ? localCounters : NULL;
+}
+
+/**
+ * Wait on a semaphore, counting the wait and measuring how long it blocked.
+ *
+ * Unlike plain sem_wait(), waits interrupted by a signal (e.g. the SIGUSR1 dump) are resumed.
+ *
+ * @param sem Semaphore to wait on
+ * @param semId Id of semaphore in the semNames given to statsInit()
+ */
+void statsSemWait(sem_t *sem, int semId)
+{
+	StatsThreadCounters *counters;
+	long long startNanos;
+
+	if (!sharedStatsEnabled || !(counters = statsThreadCounters())) {
+		while (sem_wait(sem) != 0) {
+			// Interrupted by signal, keep waiting
+		}
+		return;
+	}
+
+	STATS_BUMP(counters->semWaitCount[semId], 1);
+
+	if (sem_trywait(sem) == 0) {
+		// Semaphore was free, no blocking took place
+		return;
+	}
+
+	startNanos = clockNowNanos();
+	while (sem_wait(sem) != 0) {
+		// Interrupted by signal, keep waiting
+	}
+
+	STATS_BUMP(counters->semWakeupCount[semId], 1);
+	STATS_BUMP(counters->semBlockedNanos[semId], clockNowNanos() - startNanos);
+}
+
+/**
+ * Lock a mutex, counting the lock and measuring how long it blocked.
+ *
+ * Counted under the same ids as semaphores, for protocols using mutexes instead.
+ *
+ * @param mutex Mutex to lock
+ * @param semId Id of semaphore in the semNames given to statsInit() this mutex stands for
+ */
+void statsMutexLock(pthread_mutex_t *mutex, int semId)
+{
+	StatsThreadCounters *counters;
+	long long startNanos;
+
+	if (!sharedStatsEnabled || !(counters = statsThreadCounters())) {
+		pthread_mutex_lock(mutex);
+		return;
+	}
+
+	STATS_BUMP(counters->semWaitCount[semId], 1);
+
+	if (pthread_mutex_trylock(mutex) == 0) {
+		// Mutex was free, no blocking took place
+		return;
+	}
+
+	startNanos = clockNowNanos();
+	pthread_mutex_lock(mutex);
+
+	STATS_BUMP(counters->semWakeupCount[semId], 1);
+	STATS_BUMP(counters->semBlockedNanos[semId], clockNowNanos() - startNanos);
+}
+
+/**
+ * Wait on a condition variable, counting the wait and measuring how long it blocked.
+ *
+ * Counted under the same ids as semaphores, for protocols using condition variables instead.
+ * Unlike semaphores, every wait on a condition variable blocks.
+ *
+ * @param cond Condition variable to wait on
+ * @param mutex Mutex held by the caller
+ * @param semId Id of semaphore in the semNames given to statsInit() this condition stands for
+ */
+void statsCondWait(pthread_cond_t *cond, pthread_mutex_t *mutex, int semId)
+{
+	StatsThreadCounters *counters;
+	long long startNanos;
+
+	if (!sharedStatsEnabled || !(counters = statsThreadCounters())) {
+		pthread_cond_wait(cond, mutex);
+		return;
+	}
+
+	startNanos = clockNowNanos();
+	pthread_cond_wait(cond, mutex);
+
+	STATS_BUMP(counters->semWaitCount[semId], 1);
+	STATS_BUMP(counters->semWakeupCount[semId], 1);
+	STATS_BUMP(counters->semBlockedNanos[semId], clockNowNanos() - startNanos);
+}
+
+/**
+ * Wait until a file descriptor becomes readable, counting the wait and measuring how long it blocked.
+ *
+ * Counted under the same ids as semaphores, for protocols signaling on file descriptors. Always
+ * blocks, so callers only wait after finding out they can't proceed.
+ *
+ * @param fd File descriptor to wait on
+ * @param semId Id of semaphore in the semNames given to statsInit() this descriptor stands for
+ */
+void statsFdWait(int fd, int semId)
+{
+	StatsThreadCounters *counters = NULL;
+	long long startNanos = 0;
+	struct pollfd pollFd = { fd, POLLIN, 0 };
+
+	if (STATS && sharedStatsEnabled && (counters = statsThreadCounters())) {
+		startNanos = clockNowNanos();
+	}
+
+	while (poll(&pollFd, 1, -1) < 0) {
+		// Interrupted by signal, keep waiting
+	}
+
+	if (counters) {
+		STATS_BUMP(counters->semWaitCount[semId], 1);
+		STATS_BUMP(counters->semWakeupCount[semId], 1);
+		STATS_BUMP(counters->semBlockedNanos[semId], clockNowNanos() - startNanos);
+	}
+}
+
+/**
+ * Count a semaphore wait the caller did on its own, e.g. by busy-polling it (see latency.c).
+ *
+ * Counted just like statsSemWait() counts its waits, the time spent polling as blocked time.
+ *
+ * @param semId Id of semaphore in the semNames given to statsInit()
+ * @param startNanos clockNowNanos() when the wait found the semaphore taken, 0 if it didn't
+ */
+void statsSemWaited(int semId, long long startNanos)
+{
+	StatsThreadCounters *counters;
+
+	if (!sharedStatsEnabled || !(counters = statsThreadCounters())) {
+		return;
+	}
+
+	STATS_BUMP(counters->semWaitCount[semId], 1);
+
+	if (startNanos) {
+		STATS_BUMP(counters->semWakeupCount[semId], 1);
+		STATS_BUMP(counters->semBlockedNanos[semId], clockNowNanos() - startNanos);
+	}
+}
+
+/**
+ * Add n to a counter of the calling thread.
+ *
+ * @param counterId Id of counter in the counterNames given to statsInit()
+ * @param n Amount to add
+ */
+void statsCount(int counterId, long long n)
+{
+	StatsThreadCounters *counters;
+
+	if (sharedStatsEnabled && (counters = statsThreadCounters())) {
+		STATS_BUMP(counters->counters[counterId], n);
+	}
+}
+
+/**
+ * Turn counting on or off at runtime.
+ *
+ * @param enabled 1 to count, 0 to stop counting
+ */
+void statsSetEnabled(int enabled)
+{
+	sharedStatsEnabled = enabled;
+}
+
+/**
+ * Print one line of statistics.
+ *
+ * @param segment Segment the counters belong to
+ * @param out Stream to print to
+ * @param name Name of the line (thread name or total)
+ * @param counters Counters to print
+ */
+static void statsPrintCounters(const StatsSegment *segment, FILE *out, const char *name,
+		const StatsThreadCounters *counters)
+{
+	int i;
+	int per;
+
+	fprintf(out, "%-16s", name);
+
+	for (i = 0; i < segment->semCount; i++) {
+		fprintf(out, " %s: %llu waits %llu wakeups %.3f ms blocked |", segment->semNames[i],
+				counters->semWaitCount[i], counters->semWakeupCount[i],
+				counters->semBlockedNanos[i] / 1e6);
+	}
+
+	for (i = 0; i < segment->counterCount; i++) {
+		fprintf(out, " %s: %llu", segment->counterNames[i], counters->counters[i]);
+
+		per = segment->counterPer[i];
+		if ((per >= 0) && (counters->counters[per] > 0)) {
+			fprintf(out, " (%.2f per %s)", (double) counters->counters[i] / counters->counters[per],
+					segment->counterNames[per]);
+		}
+	}
+
+	fprintf(out, "\n");
+}
+
+/**
+ * Take a snapshot of counters some thread may keep updating, adding it up into total.
+ *
+ * @param segment Segment the counters belong to
+ * @param counters Counters to take a snapshot of
+ * @param snapshot Receives the snapshot
+ * @param total Totals to add the snapshot to
+ */
+static void statsSnapshotCounters(const StatsSegment *segment, const StatsThreadCounters *counters,
+		StatsThreadCounters *snapshot, StatsThreadCounters *total)
+{
+	int j;
+
+	memset(snapshot, 0, sizeof(StatsThreadCounters));
+
+	for (j = 0; j < segment->semCount; j++) {
+		snapshot->semWaitCount[j] = STATS_READ(counters->semWaitCount[j]);
+		snapshot->semWakeupCount[j] = STATS_READ(counters->semWakeupCount[j]);
+		snapshot->semBlockedNanos[j] = STATS_READ(counters->semBlockedNanos[j]);
+
+		total->semWaitCount[j] += snapshot->semWaitCount[j];
+		total->semWakeupCount[j] += snapshot->semWakeupCount[j];
+		total->semBlockedNanos[j] += snapshot->semBlockedNanos[j];
+	}
+	for (j = 0; j < segment->counterCount; j++) {
+		snapshot->counters[j] = STATS_READ(counters->counters[j]);
+		total->counters[j] += snapshot->counters[j];
+	}
+}
+
+/**
+ * Print per thread and total statistics of a stats segment.
+ *
+ * May be called while threads keep counting, even from another process.
+ *
+ * @param segment Segment to print
+ * @param out Stream to print to
+ */
+void statsPrint(const StatsSegment *segment, FILE *out)
+{
+	int i;
+	int threadCount = STATS_READ(segment->threadCount);
+	int exitedThreadCount = STATS_READ(segment->exitedThreadCount);
+	char exitedName[STATS_NAME_SIZE];
+	StatsThreadCounters snapshot;
+	StatsThreadCounters total;
+
+	if (threadCount > STATS_MAX_THREADS) {
+		threadCount = STATS_MAX_THREADS;
+	}
+
+	memset(&total, 0, sizeof(total));
+
+	fprintf(out, "----- Stats of pid %d after %.3f s -----\n", segment->pid,
+			(clockNowNanos() - segment->startNanos) / 1e9);
+
+	for (i = 0; i < threadCount; i++) {
+		const StatsThreadCounters *counters = &segment->threads[i];
+
+		if (__atomic_load_n(&counters->isActive, __ATOMIC_ACQUIRE) != 1) {
+			// Slot free, or being taken or freed
+			continue;
+		}
+
+		statsSnapshotCounters(segment, counters, &snapshot, &total);
+		statsPrintCounters(segment, out, counters->threadName, &snapshot);
+	}
+
+	if (exitedThreadCount > 0) {
+		// Threads that have exited are summed up in a single line
+		statsSnapshotCounters(segment, &segment->exitedThreads, &snapshot, &total);
+		snprintf(exitedName, sizeof(exitedName), "[%d exited]", exitedThreadCount);
+		statsPrintCounters(segment, out, exitedName, &snapshot);
+	}
+
+	statsPrintCounters(segment, out, "[total]", &total);
+
+	if (segment->droppedThreadCount > 0) {
+		fprintf(out, "(%d threads not counted, raise STATS_MAX_THREADS)\n", segment->droppedThreadCount);
+	}
+}
+
+/**
+ * Print statistics of this process.
+ *
+ * @param out Stream to print to
+ */
+void statsDump(FILE *out)
+{
+	if (sharedStatsSegment) {
+		statsPrint(sharedStatsSegment, out);
+	}
+}
+
+/**
+ * SIGUSR1, SIGINT and SIGTERM handler. Only wakes up the dumper thread, as printing is not
+ * async-signal-safe.
+ *
+ * @param signalNumber Received signal
+ */
+static void statsSignalHandler(int signalNumber)
+{
+	if (signalNumber != SIGUSR1) {
+		sharedStatsExitRequested = 1;
+	}
+
+	sem_post(&sharedSemDump);
+}
+
+/**
+ * Dumper thread task.
+ *
+ * Dumps statistics to stderr every periodMillis and whenever SIGUSR1 is received. On SIGINT or
+ * SIGTERM dumps them one last time, removes the shared memory segment and exits the program.
+ *
+ * @param periodMillis Dump period in milliseconds, 0 to dump only on SIGUSR1
+ * @return
+ */
+static void *statsDumperThreadTask(void *periodMillis)
+{
+	long period = (long) periodMillis;
+	struct timespec deadline;
+
+	while (1) {
+		if (period > 0) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += period / 1000;
+			deadline.tv_nsec += (period % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			// Either the period expires or a signal arrives, dump anyway
+			if ((sem_timedwait(&sharedSemDump, &deadline) != 0) && (errno == EINTR)) {
+				// Signal was handled by this very thread, the semaphore is posted already
+				continue;
+			}
+		} else if (sem_wait(&sharedSemDump) != 0) {
+			continue;
+		}
+
+		statsDump(stderr);
+
+		if (sharedStatsExitRequested) {
+			statsDestroy();
+			exit(0);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Start dumping statistics periodically and on SIGUSR1.
+ *
+ * Also takes over SIGINT and SIGTERM, so that the shared memory segment is removed when the
+ * program is interrupted.
+ *
+ * Must be called after statsInit().
+ *
+ * @param periodMillis Dump period in milliseconds, 0 to dump only on SIGUSR1
+ */
+void statsStartDumper(long periodMillis)
+{
+	pthread_t dumperThread;
+	struct sigaction action;
+
+	sem_init(&sharedSemDump, 0, 0);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = statsSignalHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	pthread_create(&dumperThread, NULL, statsDumperThreadTask, (void *) periodMillis);
+	pthread_detach(dumperThread);
+}
+
+/**
+ * Remove the shared memory segment, once stats are no longer needed.
+ */
+void statsDestroy()
+{
+	if (sharedStatsSegmentName[0]) {
+		shm_unlink(sharedStatsSegmentName);
+	}
+}
+
+/**
+ * Map the stats segment of another process for reading.
+ *
+ * @param segmentName Name of shared memory segment, as printed by statsInit()
+ * @return Read-only stats segment, or NULL if it can't be found
+ */
+const StatsSegment *statsAttach(const char *segmentName)
+{
+	int fd;
+	StatsSegment *segment;
+
+	fd = shm_open(segmentName, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	segment = mmap(NULL, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ((segment == MAP_FAILED) || (segment->magic != STATS_MAGIC)) {
+		return NULL;
+	}
+
+	return segment;
+}
@@ -0,0 +1,46 @@
+/**
+ * stats_view.c
+ *
+ * Standalone tool printing the live statistics of a running program.
+ *
+ * Attaches read-only to the shared memory stats segment the program announced on startup
+ * ("Stats segment: /swapbufs-stats-1234") and prints it every few seconds, without ever
+ * interrupting the observed program.
+ *
+ * Usage: stats_view <segment name> [period in seconds]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "main.h"
+
+int main(int argc, char *argv[])
+{
+	const StatsSegment *segment;
+	int periodSeconds = (argc > 2) ? atoi(argv[2]) : 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <segment name> [period in seconds]\n", argv[0]);
+		return 1;
+	}
+
+	segment = statsAttach(argv[1]);
+	if (!segment) {
+		fprintf(stderr, "Could not attach to stats segment %s\n", argv[1]);
+		return 1;
+	}
+
+	while (1) {
+		statsPrint(segment, stdout);
+		fflush(stdout);
+
+		if (periodSeconds <= 0) {
+			break;
+		}
+		sleep(periodSeconds);
+	}
+
+	return 0;
+}
@@ -16,6 +16,11 @@
 // Shared variable allowing the exchange of a single item
 static int sharedExchangeBufferValue;
 
+// Ring of slots, for protocols exchanging several items at a time. Each slot keeps the value
+// of an item along with its position in the initial buffer
+static int sharedExchangeSlotValues[EXCHANGE_SLOT_COUNT];
+static int sharedExchangeSlotItemIds[EXCHANGE_SLOT_COUNT];
+
 /**
  * Read the value of sharedExchangeBufferValue variable.
  *
@@ -25,7 +30,7 @@ static int sharedExchangeBufferValue;
  */
 int exchangeBufferReadValue(const char *threadName, int itemId)
 {
-	fprintf(stderr, "%s Reading item with id=%d from the shared exchange buffer\n", threadName, itemId);
+	TRACE("%s Reading item with id=%d from the shared exchange buffer\n", threadName, itemId);
 
 	// Just read whatever is in the shared buffer
 	return sharedExchangeBufferValue;
@@ -40,14 +45,55 @@ int exchangeBufferReadValue(const char *threadName, int itemId)
  */
 void exchangeBufferWriteValue(const char *threadName, int itemId, int itemValue)
 {
-	fprintf(stderr, "%s Writing item with id=%d and value=%d to the shared exchange buffer\n", threadName, itemId, itemValue);
+	TRACE("%s Writing item with id=%d and value=%d to the shared exchange buffer\n", threadName, itemId, itemValue);
 	sharedExchangeBufferValue = itemValue;
 }
 
+/**
+ * Read the value and item id kept in a slot of the exchange ring.
+ *
+ * @param threadName Name of reader thread reading a value
+ * @param slotId Slot to read from
+ * @param itemId Set to the position of the item in the initial buffer
+ * @return Read value
+ */
+int exchangeBufferReadSlotValue(const char *threadName, int slotId, int *itemId)
+{
+	*itemId = sharedExchangeSlotItemIds[slotId];
+
+	TRACE("%s Reading item with id=%d from slot %d of the shared exchange buffer\n", threadName, *itemId, slotId);
+
+	return sharedExchangeSlotValues[slotId];
+}
+
+/**
+ * Write a value to a slot of the exchange ring so it's read by readers.
+ *
+ * @param threadName Name of writer thread writing out the item value
+ * @param slotId Slot to write to
+ * @param itemId The position of the item in the initial buffer
+ * @param itemValue The value of the item being exchanged with the readers
+ */
+void exchangeBufferWriteSlotValue(const char *threadName, int slotId, int itemId, int itemValue)
+{
+	TRACE("%s Writing item with id=%d and value=%d to slot %d of the shared exchange buffer\n",
+			threadName, itemId, itemValue, slotId);
+
+	sharedExchangeSlotItemIds[slotId] = itemId;
+	sharedExchangeSlotValues[slotId] = itemValue;
+}
+
 /**
  * Initialize shared buffer to some invalid value.
  */
 void exchangeBufferInit()
 {
+	int i;
+
 	sharedExchangeBufferValue = -1;
+
+	for (i = 0; i < EXCHANGE_SLOT_COUNT; i++) {
+		sharedExchangeSlotItemIds[i] = -1;
+		sharedExchangeSlotValues[i] = -1;
+	}
 }
@@ -0,0 +1,285 @@
+/**
+ * handoff_bench.c
+ *
+ * Benchmark of item handoff latency, in the default blocking mode vs. low latency mode (see
+ * latency.c).
+ *
+ * The writer writes an item every period, so readers are done with the previous one and idle
+ * when it's written. Every reader records the time from the writer starting to write each item
+ * until it got the item:
+ *
+ * 1. blocking: readers sleep in sem_wait() and are woken up by the writer
+ * 2. low_latency: writer and readers run with SCHED_FIFO, memory is locked and readers busy-poll
+ *    their read semaphore. Whatever isn't permitted is left out with a warning
+ *
+ * Links against any protocol implementation supporting protocolReadValue(), just like main.c.
+ * Each mode runs in a process of its own, on a freshly initialized protocol. Only the first
+ * BENCH_SAMPLED_READERS readers record latencies, so thousands of readers don't take gigabytes
+ * of histograms.
+ *
+ * Usage: handoff_bench [periodMicros] [blocking|low_latency|all]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "main.h"
+
+// Largest latency recorded, in nanoseconds
+#define BENCH_MAX_LATENCY_NANOS (10 * 1000000000LL)
+
+// Precision of latency histograms, 2^-10 i.e. about 0.1%
+#define BENCH_SIGNIFICANT_BITS 11
+
+// Number of readers recording latencies
+#define BENCH_SAMPLED_READERS 64
+
+// Stack size of reader threads, kept small so thousands of them fit in memory
+#define BENCH_STACK_SIZE (64 * 1024)
+
+// A mode to benchmark
+typedef struct BenchMode {
+	const char *name;
+
+	// Low latency flags of the process, its writer and its readers
+	int flags;
+	int writerFlags;
+	int readerFlags;
+} BenchMode;
+
+// Modes to benchmark, in order
+static const BenchMode benchModes[] = {
+	{ "blocking", 0, 0, 0 },
+	{ "low_latency", LATENCY_MLOCKALL, LATENCY_SCHED_FIFO, LATENCY_SCHED_FIFO | LATENCY_BUSY_POLL },
+};
+
+//
+// Global (shared) variables
+//
+
+// Run parameters
+static const BenchMode *sharedMode;
+static long long sharedPeriodNanos;
+
+// Time the writer started writing each item
+static long long sharedWriteNanos[ITEM_COUNT];
+
+// Low latency flags actually in effect, over all threads
+static int sharedThreadFlags;
+
+// Number of wrong reads over all readers
+static int sharedWrongReadCount;
+
+// Handoff latencies, merged by readers once done under sharedMutex
+static Histogram sharedHistogram;
+static pthread_mutex_t sharedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Writer thread task.
+ *
+ * Writes an item every period.
+ *
+ * @param threadId Unused
+ * @return
+ */
+static void *benchWriterThreadTask(void *threadId)
+{
+	long long startNanos;
+	int i;
+
+	(void) threadId;
+
+	__sync_fetch_and_or(&sharedThreadFlags, latencyEnterThread(sharedMode->writerFlags));
+
+	// Wake up as close to the intended time as possible
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	// Leave some time for readers to start waiting
+	startNanos = clockNowNanos() + 10000000LL;
+
+	for (i = 0; i < ITEM_COUNT; i++) {
+		clockSleepUntilNanos(startNanos + i * sharedPeriodNanos);
+
+		sharedWriteNanos[i] = clockNowNanos();
+		protocolWriteValue("[writer]", i, itemArrayReadValue(i));
+	}
+
+	return 0;
+}
+
+/**
+ * Reader thread task.
+ *
+ * Reads and checks every item, recording its latency if among the sampled readers.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchReaderThreadTask(void *threadId)
+{
+	Histogram histogram;
+	int isSampled = (long) threadId < BENCH_SAMPLED_READERS;
+	int wrongReadCount = 0;
+	int itemValue;
+	int i;
+	char threadName[32];
+
+	sprintf(threadName, "[reader %4ld]", (long) threadId);
+
+	__sync_fetch_and_or(&sharedThreadFlags, latencyEnterThread(sharedMode->readerFlags));
+
+	if (isSampled) {
+		histogramInit(&histogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+	}
+
+	for (i = 0; i < ITEM_COUNT; i++) {
+		itemValue = protocolReadValue(threadName, i);
+
+		if (isSampled) {
+			histogramRecord(&histogram, clockNowNanos() - sharedWriteNanos[i]);
+		}
+		if (!itemArrayIsValueCorrect(i, itemValue)) {
+			wrongReadCount++;
+		}
+	}
+
+	if (wrongReadCount > 0) {
+		__sync_fetch_and_add(&sharedWrongReadCount, wrongReadCount);
+	}
+
+	if (isSampled) {
+		pthread_mutex_lock(&sharedMutex);
+		histogramMerge(&sharedHistogram, &histogram);
+		pthread_mutex_unlock(&sharedMutex);
+
+		histogramDestroy(&histogram);
+	}
+
+	return 0;
+}
+
+/**
+ * Describe low latency flags.
+ *
+ * @param flags Low latency flags
+ * @param names Receives the names of flags, comma separated
+ * @param size Size of names
+ */
+static void benchFlagNames(int flags, char *names, size_t size)
+{
+	snprintf(names, size, "%s%s%s%s", flags ? "" : "sem_wait",
+			(flags & LATENCY_SCHED_FIFO) ? "fifo," : "",
+			(flags & LATENCY_MLOCKALL) ? "mlockall," : "",
+			(flags & LATENCY_BUSY_POLL) ? "busy_poll," : "");
+
+	if (flags) {
+		// Drop the trailing comma
+		names[strlen(names) - 1] = '\0';
+	}
+}
+
+/**
+ * Write all items to all readers in a mode. Runs in a process of its own.
+ *
+ * @param mode Mode
+ * @return Process exit status, 1 if any value read was wrong
+ */
+static int benchRun(const BenchMode *mode)
+{
+	long i;
+	int flags;
+	char flagNames[64];
+	pthread_attr_t attr;
+	pthread_t writerThread;
+	pthread_t *readerThreads = malloc(READERS_COUNT * sizeof(pthread_t));
+
+	sharedMode = mode;
+	histogramInit(&sharedHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+
+	// Lock memory before allocating the item array, so it's locked as well
+	flags = latencyInit(mode->flags);
+
+	exchangeBufferInit();
+	if (!itemArrayInit("main")) {
+		return 1;
+	}
+	protocolInit();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+
+	for (i = 0; i < READERS_COUNT; i++) {
+		if (pthread_create(&readerThreads[i], &attr, benchReaderThreadTask, (void *) i) != 0) {
+			fprintf(stderr, "Could not create reader %ld\n", i);
+			return 1;
+		}
+	}
+	pthread_create(&writerThread, &attr, benchWriterThreadTask, NULL);
+
+	pthread_join(writerThread, NULL);
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_join(readerThreads[i], NULL);
+	}
+
+	flags |= sharedThreadFlags;
+	benchFlagNames(flags, flagNames, sizeof(flagNames));
+
+	printf("%-12s %-24s p50 %8.2f us  p90 %8.2f us  p99 %8.2f us  p99.9 %8.2f us  max %9.2f us%s\n",
+			mode->name, flagNames,
+			histogramValueAtPercentile(&sharedHistogram, 50) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 90) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 99) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 99.9) / 1e3,
+			sharedHistogram.maxRecordedValue / 1e3,
+			sharedWrongReadCount ? " ***** FAIL *****" : "");
+
+	latencyDestroy();
+	histogramDestroy(&sharedHistogram);
+	pthread_attr_destroy(&attr);
+	free(readerThreads);
+
+	return sharedWrongReadCount ? 1 : 0;
+}
+
+/**
+ * Runs the benchmark in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	const char *modeName = (argc > 2) ? argv[2] : "all";
+	int failedRunCount = 0;
+	int status;
+	pid_t pid;
+	int i;
+
+	sharedPeriodNanos = (argc > 1) ? atol(argv[1]) * 1000LL : 200000LL;
+
+	printf("%d readers, %d items, one every %.0f us\n", READERS_COUNT, ITEM_COUNT, sharedPeriodNanos / 1e3);
+
+	for (i = 0; i < (int) (sizeof(benchModes) / sizeof(benchModes[0])); i++) {
+		if ((strcmp(modeName, benchModes[i].name) != 0) && (strcmp(modeName, "all") != 0)) {
+			continue;
+		}
+
+		// Don't let the child flush what's still buffered here
+		fflush(stdout);
+
+		if ((pid = fork()) == 0) {
+			status = benchRun(&benchModes[i]);
+			fflush(stdout);
+			_exit(status);
+		}
+
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+			failedRunCount++;
+		}
+	}
+
+	return failedRunCount ? 1 : 0;
+}
@@ -20,7 +20,8 @@
 
 // The actual data that need to be exchanged. This should be visible only
 // to the writer thread, but it's defined global to allow *assertions* after task executions.
-static int protectedItemArray[ITEM_COUNT];
+// Allocated on init, backed as set up with memorySetFlags()
+static int *protectedItemArray;
 
 /**
  * @return Size of item array.
@@ -57,15 +58,26 @@ int itemArrayIsValueCorrect(int itemId, int testItemValue)
  * Initialize array with random items.
  *
  * @param threadName Name of threading calling the initialization.
+ * @return 1 on success, 0 if the array could not be allocated
  */
-void itemArrayInit(const char *threadName)
+int itemArrayInit(const char *threadName)
 {
 	int i;
 
+	if (!protectedItemArray && !(protectedItemArray = memoryAlloc("item array", ITEM_COUNT * sizeof(int)))) {
+		return 0;
+	}
+
 	// Fill in buffer with data
-	printf("%s Initializing shared values:\n", threadName);
+	if (VERBOSE) {
+		printf("%s Initializing shared values:\n", threadName);
+	}
 	for (i = 0; i < ITEM_COUNT; i++) {
 		protectedItemArray[i] = (int) ((double) rand() / RAND_MAX * MAX_ITEM_VALUE);
-		printf("%s %3d. %d\n", threadName, i, protectedItemArray[i]);
+		if (VERBOSE) {
+			printf("%s %3d. %d\n", threadName, i, protectedItemArray[i]);
+		}
 	}
+
+	return 1;
 }
@@ -37,6 +37,10 @@ void *writerThreadTask(void *threadId)
 
 	// Compile thread name
 	sprintf(threadName, "[writer]");
+	statsRegisterThread(threadName);
+
+	// The writer never busy-polls, so it doesn't hold up readers sharing its CPU
+	latencyEnterThread(LATENCY_FLAGS & LATENCY_SCHED_FIFO);
 
 	for (i = 0; i < ITEM_COUNT; i++) {
 		protocolWriteValue(threadName, i, itemArrayReadValue(i));
@@ -74,6 +78,8 @@ void *readerThreadTask(void *threadId)
 
 	// Compile thread name
 	sprintf(threadName, "[reader %3ld]", (long)threadId);
+	statsRegisterThread(threadName);
+	latencyEnterThread(LATENCY_FLAGS);
 
 	for (i = 0; i < ITEM_COUNT; i++) {
 
@@ -112,11 +118,24 @@ int main()
 {
 	int i;
 
+	//
+	// Collect contention statistics, dumped periodically, on SIGUSR1 and readable by stats_view
+	//
+	statsInitDefault("onebuf");
+	statsStartDumper(STATS_DUMP_PERIOD_MS);
+
+	//
+	// Lock memory before allocating buffers, so they're locked as well (-DLATENCY_FLAGS=...)
+	//
+	latencyInit(LATENCY_FLAGS);
+
 	//
 	// Initialize buffers and related shared variables and semaphores
 	//
 	exchangeBufferInit();
-	itemArrayInit("main");
+	if (!itemArrayInit("main")) {
+		return 1;
+	}
 	protocolInit();
 
 	//
@@ -138,5 +157,9 @@ int main()
 		pthread_join(readerThread[i], NULL);
 	}
 
+	statsDump(stderr);
+	statsDestroy();
+	latencyDestroy();
+
 	return 0;
 }
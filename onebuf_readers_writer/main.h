@@ -9,20 +9,57 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <semaphore.h>
 #include <stdio.h>
+#include "../common/common.h"
 
 //
 // Configurable constants. Feel free to try different combinations. Avoid 0 values :)
+// All of them may also be overridden at compile time, e.g. gcc -DREADERS_COUNT=512 ...
 //
 
 // Number of producer threads to create
+#ifndef READERS_COUNT
 #define READERS_COUNT 10
+#endif
 
 // Size of buffer
+#ifndef ITEM_COUNT
 #define ITEM_COUNT 20
+#endif
 
 // Max value of produced integer items
+#ifndef MAX_ITEM_VALUE
 #define MAX_ITEM_VALUE 300
+#endif
+
+// Number of readers sharing a completion counter in tree_read_sem.c
+#ifndef READER_GROUP_SIZE
+#define READER_GROUP_SIZE 64
+#endif
+
+// Max number of readers subscribed at the same time in subscription_sem.c
+#ifndef MAX_SUBSCRIBERS
+#define MAX_SUBSCRIBERS 64
+#endif
+
+// Time a subscribed reader may take to read an item before it's evicted in subscription_sem.c
+#ifndef SUBSCRIBER_TIMEOUT_MS
+#define SUBSCRIBER_TIMEOUT_MS 500
+#endif
+
+// Number of slots in the exchange ring used by sequence_sem.c
+#ifndef EXCHANGE_SLOT_COUNT
+#define EXCHANGE_SLOT_COUNT 64
+#endif
+
+// Print a trace message for every protocol step. Benchmarks compile with -DVERBOSE=0
+#ifndef VERBOSE
+#define VERBOSE 1
+#endif
+
+// Trace message printing, compiled away when VERBOSE is 0
+#define TRACE(...) do { if (VERBOSE) fprintf(stderr, __VA_ARGS__); } while (0)
 
 //
 // Exchange buffer functions
@@ -31,6 +68,10 @@ int exchangeBufferReadValue(const char *threadName, int itemId);
 
 void exchangeBufferWriteValue(const char *threadName, int itemId, int itemValue);
 
+int exchangeBufferReadSlotValue(const char *threadName, int slotId, int *itemId);
+
+void exchangeBufferWriteSlotValue(const char *threadName, int slotId, int itemId, int itemValue);
+
 void exchangeBufferInit();
 
 //
@@ -42,7 +83,7 @@ int itemArrayReadValue(int itemId);
 
 int itemArrayIsValueCorrect(int itemId, int testItemValue);
 
-void itemArrayInit(const char *threadName);
+int itemArrayInit(const char *threadName);
 
 
 //
@@ -58,4 +99,56 @@ void protocolWriteValue(const char *threadName, int itemId, int itemValue);
 // One-time initialization function
 void protocolInit();
 
+//
+// Subscription functions, only provided by protocols supporting readers joining and leaving
+// at will (subscription_sem.c)
+//
+
+// Value returned by protocolReadValue() to a reader that has been evicted for stalling.
+// Item values are never negative, so it can't be mistaken for an item value.
+#define PROTOCOL_EVICTED -1
+
+// Subscribe calling reader thread. Returns id of first item to read, -1 if there's no room
+int protocolSubscribe(const char *threadName);
+
+// Unsubscribe calling reader thread
+void protocolUnsubscribe(const char *threadName);
+
+//
+// Multiple writer functions, only provided by protocols supporting many writers (sequence_sem.c)
+//
+
+// Publish an item, possibly concurrently with other writers. Returns its position in the stream
+int protocolPublishValue(const char *threadName, int itemId, int itemValue);
+
+// Read the item at the given position of the stream, setting itemId to its id
+int protocolReadSequenceValue(const char *threadName, int sequence, int *itemId);
+
+//
+// Stats ids of the protocols (see ../common/stats.c)
+//
+
+// Instrumented semaphores of the protocols
+enum {
+	STATS_SEM_MAY_WRITE,
+	STATS_SEM_MAY_READ,
+	STATS_SEM_MUTEX,
+	STATS_SEM_COUNT
+};
+
+// Counters of the protocols. A round is complete once all readers have read an item
+enum {
+	STATS_COUNTER_WRITTEN_ITEMS,
+	STATS_COUNTER_READ_ITEMS,
+	STATS_COUNTER_ROUNDS,
+	STATS_COUNTER_COUNT
+};
+
+// Names of the semaphores and counters above, and the counter each one is divided by when printed
+#define STATS_SEM_NAMES { "mayWrite", "mayRead", "mutex" }
+#define STATS_COUNTER_NAMES { "written", "read", "rounds" }
+#define STATS_COUNTER_PER { -1, STATS_COUNTER_WRITTEN_ITEMS, -1 }
+
+
+
 #endif  /* MAIN_H */
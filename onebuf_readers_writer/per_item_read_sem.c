@@ -39,13 +39,14 @@ int protocolReadValue(const char *threadName, int itemId)
 {
 	int itemValue;
 
-	fprintf(stderr, "%s Waiting to read item with id=%d from the shared buffer\n", threadName, itemId);
+	TRACE("%s Waiting to read item with id=%d from the shared buffer\n", threadName, itemId);
 
 	// Wait until the writer has written out the value of itemId in the shared buffer
-	sem_wait(&sharedSemMayReadPerItem[itemId]);
+	latencySemWait(&sharedSemMayReadPerItem[itemId], STATS_SEM_MAY_READ);
 
 	// Read value from exchange buffer
 	itemValue = exchangeBufferReadValue(threadName, itemId);
+	STATS_COUNT(STATS_COUNTER_READ_ITEMS, 1);
 
 	// Update the number of readers that have read the currently shared value
 	sharedFinishedReaderCount++;
@@ -55,6 +56,7 @@ int protocolReadValue(const char *threadName, int itemId)
 
 		// Reset number of readers for the next round
 		sharedFinishedReaderCount = 0;
+		STATS_COUNT(STATS_COUNTER_ROUNDS, 1);
 
 		// Signal the writer to write the next value, but not the readers, as they might
 		// have the chance to read the old value in the shared buffer, before even the
@@ -80,15 +82,16 @@ int protocolReadValue(const char *threadName, int itemId)
  */
 void protocolWriteValue(const char *threadName, int itemId, int itemValue)
 {
-	fprintf(stderr, "%s Waiting for readers to complete reading\n", threadName);
+	TRACE("%s Waiting for readers to complete reading\n", threadName);
 
 	// Wait until all readers are done reading
-	sem_wait(&sharedSemMayWrite);
+	STATS_SEM_WAIT(&sharedSemMayWrite, STATS_SEM_MAY_WRITE);
 
 	// Write the item value to the shared variable
 	exchangeBufferWriteValue(threadName, itemId, itemValue);
+	STATS_COUNT(STATS_COUNTER_WRITTEN_ITEMS, 1);
 
-	fprintf(stderr, "%s Signaling readers to resume reading on item with id=%d\n", threadName, itemId);
+	TRACE("%s Signaling readers to resume reading on item with id=%d\n", threadName, itemId);
 
 	// Signal readers so they start reading
 	sem_post(&sharedSemMayReadPerItem[itemId]);
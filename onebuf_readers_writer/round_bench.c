@@ -0,0 +1,138 @@
+/**
+ * round_bench.c
+ *
+ * Benchmark of the time it takes for an item to be written and read by all readers (a round).
+ *
+ * Links against any protocol implementation, just like main.c, but without printing every
+ * read. Reports the average round time and checks every read value. Timing starts once all
+ * threads have been created and stops when the last reader has read the last item, so creating
+ * and joining thousands of readers doesn't count, while the last round does.
+ *
+ * Compile with different -DREADERS_COUNT values to see how a protocol scales (see round_bench.sh).
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "main.h"
+
+// Stack size of reader threads, kept small so thousands of them fit in memory
+#define BENCH_STACK_SIZE (64 * 1024)
+
+//
+// Global (shared) variables
+//
+
+// Number of wrong reads over all readers
+static int sharedWrongReadCount;
+
+// Released once the writer and all readers are up
+static pthread_barrier_t sharedStartBarrier;
+
+// Time the writer started writing, past the start barrier
+static long long sharedStartNanos;
+
+// Number of readers done reading all items, the last one sets sharedEndNanos
+static int sharedFinishedReaderCount;
+static long long sharedEndNanos;
+
+/**
+ * Writer thread task.
+ *
+ * @param threadId Unused
+ * @return
+ */
+static void *benchWriterThreadTask(void *threadId)
+{
+	int i;
+
+	(void) threadId;
+
+	pthread_barrier_wait(&sharedStartBarrier);
+	sharedStartNanos = clockNowNanos();
+
+	for (i = 0; i < ITEM_COUNT; i++) {
+		protocolWriteValue("[writer]", i, itemArrayReadValue(i));
+	}
+
+	return 0;
+}
+
+/**
+ * Reader thread task.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchReaderThreadTask(void *threadId)
+{
+	int i;
+	int wrongReadCount = 0;
+	char threadName[32];
+
+	sprintf(threadName, "[reader %4ld]", (long) threadId);
+
+	pthread_barrier_wait(&sharedStartBarrier);
+
+	for (i = 0; i < ITEM_COUNT; i++) {
+		if (!itemArrayIsValueCorrect(i, protocolReadValue(threadName, i))) {
+			wrongReadCount++;
+		}
+	}
+
+	if (__sync_add_and_fetch(&sharedFinishedReaderCount, 1) == READERS_COUNT) {
+		// Last reader done with the last item, the last round is over
+		sharedEndNanos = clockNowNanos();
+	}
+
+	if (wrongReadCount > 0) {
+		__sync_fetch_and_add(&sharedWrongReadCount, wrongReadCount);
+	}
+
+	return 0;
+}
+
+int main()
+{
+	long i;
+	long long elapsedNanos;
+	pthread_attr_t attr;
+	pthread_t writerThread;
+	pthread_t *readerThreads = malloc(READERS_COUNT * sizeof(pthread_t));
+
+	exchangeBufferInit();
+	if (!itemArrayInit("main")) {
+		return 1;
+	}
+	protocolInit();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+	pthread_barrier_init(&sharedStartBarrier, NULL, READERS_COUNT + 1);
+
+	for (i = 0; i < READERS_COUNT; i++) {
+		if (pthread_create(&readerThreads[i], &attr, benchReaderThreadTask, (void *) i) != 0) {
+			fprintf(stderr, "Could not create reader %ld\n", i);
+			return 1;
+		}
+	}
+	pthread_create(&writerThread, &attr, benchWriterThreadTask, NULL);
+
+	pthread_join(writerThread, NULL);
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_join(readerThreads[i], NULL);
+	}
+
+	elapsedNanos = sharedEndNanos - sharedStartNanos;
+
+	printf("%5d readers, %d items: %.3f ms total, %.1f us per round%s\n",
+			READERS_COUNT, ITEM_COUNT, elapsedNanos / 1e6, elapsedNanos / 1e3 / ITEM_COUNT,
+			sharedWrongReadCount ? " ***** FAIL *****" : "");
+
+	pthread_barrier_destroy(&sharedStartBarrier);
+	pthread_attr_destroy(&attr);
+	free(readerThreads);
+
+	return sharedWrongReadCount ? 1 : 0;
+}
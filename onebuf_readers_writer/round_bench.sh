@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# round_bench.sh
+#
+# Compares the per round time of the flat counter protocol (swap_read_sem.c) and the combining
+# tree protocol (tree_read_sem.c) at 64, 512 and 4096 readers.
+#
+# Usage: ./round_bench.sh [itemCount]
+#
+
+ITEM_COUNT=${1:-200}
+
+for READERS_COUNT in 64 512 4096; do
+	for PROTOCOL in swap_read_sem tree_read_sem; do
+		gcc -I. -O2 -pthread -DVERBOSE=0 -DSTATS=0 -DREADERS_COUNT=$READERS_COUNT -DITEM_COUNT=$ITEM_COUNT \
+			-o round_bench round_bench.c exchange_buffer.c item_array.c $PROTOCOL.c ../common/memory.c ../common/stats.c ../common/clock.c ../common/latency.c || exit 1
+
+		printf "%-14s " $PROTOCOL
+		./round_bench || exit 1
+	done
+done
+
+rm -f round_bench
@@ -0,0 +1,210 @@
+/**
+ * sequence_bench.c
+ *
+ * Throughput benchmark of protocols supporting many writers (sequence_sem.c).
+ *
+ * The items of the initial buffer are split among the writers, writer w publishing items
+ * w, w + writerCount, w + 2 * writerCount... in this order, all writers at the same time. Every
+ * reader reads all ITEM_COUNT positions of the resulting stream and checks that:
+ *
+ * 1. Every value read is the correct value of the item it claims to be.
+ * 2. Every item shows up exactly once.
+ * 3. The items of each writer show up in the order they were published.
+ * 4. All readers observe the same total order (compared through a hash of the item ids read).
+ *
+ * The run is repeated for each writer count given, reporting items per second.
+ *
+ * Usage: sequence_bench [writerCount]...     (default: 1 2 4 8)
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "main.h"
+
+// Writer counts to run with, if none are given
+#define BENCH_DEFAULT_WRITER_COUNTS { 1, 2, 4, 8 }
+
+//
+// Global (shared) variables
+//
+
+// Number of writers of the current run
+static int sharedWriterCount;
+
+// Number of readers that failed any of the checks in the current run
+static int sharedFailedReaderCount;
+
+// Hash of the order of items observed by each reader
+static unsigned long sharedOrderHashes[READERS_COUNT];
+
+/**
+ * Writer thread task.
+ *
+ * Publishes its share of the items, in order.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchWriterThreadTask(void *threadId)
+{
+	int i;
+	char threadName[32];
+
+	sprintf(threadName, "[writer %2ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	for (i = (int) (long) threadId; i < ITEM_COUNT; i += sharedWriterCount) {
+		protocolPublishValue(threadName, i, itemArrayReadValue(i));
+	}
+
+	return 0;
+}
+
+/**
+ * Reader thread task.
+ *
+ * Reads the whole stream and checks it.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchReaderThreadTask(void *threadId)
+{
+	long readerId = (long) threadId;
+	int sequence;
+	int itemId;
+	int itemValue;
+	int wrongReadCount = 0;
+	int *lastItemIds = malloc(sharedWriterCount * sizeof(int));
+	char *isItemRead = calloc(ITEM_COUNT, 1);
+	unsigned long orderHash = 5381;
+	char threadName[32];
+
+	sprintf(threadName, "[reader %3ld]", readerId);
+	statsRegisterThread(threadName);
+
+	for (itemId = 0; itemId < sharedWriterCount; itemId++) {
+		lastItemIds[itemId] = -1;
+	}
+
+	for (sequence = 0; sequence < ITEM_COUNT; sequence++) {
+		itemValue = protocolReadSequenceValue(threadName, sequence, &itemId);
+
+		if ((itemId < 0) || (itemId >= ITEM_COUNT) || isItemRead[itemId]
+				|| !itemArrayIsValueCorrect(itemId, itemValue)
+				|| (itemId <= lastItemIds[itemId % sharedWriterCount])) {
+			wrongReadCount++;
+			fprintf(stderr, "***** FAIL ***** %s Read item with id=%d at sequence %d, copied value = %d\n",
+					threadName, itemId, sequence, itemValue);
+			continue;
+		}
+
+		isItemRead[itemId] = 1;
+		lastItemIds[itemId % sharedWriterCount] = itemId;
+		orderHash = orderHash * 33 + itemId;
+	}
+
+	sharedOrderHashes[readerId] = orderHash;
+
+	if (wrongReadCount > 0) {
+		__sync_fetch_and_add(&sharedFailedReaderCount, 1);
+	}
+
+	free(lastItemIds);
+	free(isItemRead);
+
+	return 0;
+}
+
+/**
+ * Push all items through the protocol with the given number of writers.
+ *
+ * @param writerCount Number of writer threads
+ * @return Items per second
+ */
+static double benchRun(int writerCount)
+{
+	long i;
+	long long startNanos;
+	long long elapsedNanos;
+	pthread_t *writerThreads = malloc(writerCount * sizeof(pthread_t));
+	pthread_t readerThreads[READERS_COUNT];
+
+	exchangeBufferInit();
+	protocolInit();
+	sharedWriterCount = writerCount;
+	sharedFailedReaderCount = 0;
+
+	startNanos = clockNowNanos();
+
+	for (i = 0; i < writerCount; i++) {
+		pthread_create(&writerThreads[i], NULL, benchWriterThreadTask, (void *) i);
+	}
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_create(&readerThreads[i], NULL, benchReaderThreadTask, (void *) i);
+	}
+
+	for (i = 0; i < writerCount; i++) {
+		pthread_join(writerThreads[i], NULL);
+	}
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_join(readerThreads[i], NULL);
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	for (i = 1; i < READERS_COUNT; i++) {
+		if (sharedOrderHashes[i] != sharedOrderHashes[0]) {
+			fprintf(stderr, "***** FAIL ***** [reader %3ld] observed a different order than [reader %3d]\n", i, 0);
+			sharedFailedReaderCount++;
+		}
+	}
+
+	free(writerThreads);
+
+	return ITEM_COUNT / (elapsedNanos / 1e9);
+}
+
+/**
+ * Runs the benchmark for each writer count given.
+ */
+int main(int argc, char *argv[])
+{
+	int defaultWriterCounts[] = BENCH_DEFAULT_WRITER_COUNTS;
+	int runCount = (argc > 1) ? argc - 1 : (int) (sizeof(defaultWriterCounts) / sizeof(int));
+	int writerCount;
+	int failedRunCount = 0;
+	int i;
+	double rate;
+
+	statsInitDefault("sequence_bench");
+	if (!itemArrayInit("main")) {
+		return 1;
+	}
+
+	printf("%d readers, %d items, %d slots\n", READERS_COUNT, ITEM_COUNT, EXCHANGE_SLOT_COUNT);
+
+	for (i = 0; i < runCount; i++) {
+		writerCount = (argc > 1) ? atoi(argv[i + 1]) : defaultWriterCounts[i];
+		if (writerCount < 1) {
+			fprintf(stderr, "Invalid writer count '%s'\n", argv[i + 1]);
+			return 1;
+		}
+
+		rate = benchRun(writerCount);
+
+		printf("%2d writers: %12.0f items/s%s\n", writerCount, rate,
+				sharedFailedReaderCount ? " ***** FAIL *****" : "");
+
+		if (sharedFailedReaderCount) {
+			failedRunCount++;
+		}
+	}
+
+	statsDump(stdout);
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * sequence_sem.c
+ *
+ * Protocol implementation supporting many concurrent writers, all publishing into a single,
+ * totally ordered stream of items.
+ *
+ * Instead of the single exchange variable, items go through a ring of EXCHANGE_SLOT_COUNT slots,
+ * each with its own read semaphore and completion counter:
+ *
+ * 1. A writer first takes a free slot permit (sharedSemMayWrite, initialized to the number of
+ *    slots), then claims the next position of the stream (its sequence) with an atomic increment.
+ * 2. It writes the item to slot (sequence % EXCHANGE_SLOT_COUNT) and posts the read semaphore of
+ *    that slot. Writers never wait for each other: they only hold a permit while writing their own
+ *    slot, so there's no lock around the whole publish step.
+ * 3. Readers go through sequences 0, 1, 2... in order, waiting on a read semaphore of the
+ *    respective slot and passing it on to the next reader like in swap_read_sem.c. A writer
+ *    publishing sequence n + 1 before sequence n is published doesn't matter: readers are still
+ *    stuck waiting for the slot of n, so all of them observe the same order.
+ * 4. The last reader of a slot frees it by posting a permit.
+ *
+ * Readers finish slots in sequence order, since each reader reads in sequence order. So, with
+ * at most EXCHANGE_SLOT_COUNT permits out, the slot of sequence n is free by the time some writer
+ * claims n: sequence n - EXCHANGE_SLOT_COUNT must have been read by all readers.
+ *
+ * protocolWriteValue()/protocolReadValue() are provided as well, so main.c works with this
+ * protocol too. With a single writer, sequences coincide with item ids.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <semaphore.h>
+#include "main.h"
+
+// A slot of the exchange ring. Aligned to a cache line so that readers and writers of
+// neighbouring slots don't slow each other down
+typedef struct SequenceSlot {
+	// Signaling semaphores telling readers they can read the item in this slot. Swapped per lap
+	// around the ring like in swap_read_sem.c: a fast reader may already be waiting for the next
+	// lap while slower ones still pass the current item on, and must not steal their wake-ups
+	sem_t semMayReadSwap[2];
+
+	// Number of readers done reading the item in this slot
+	int finishedReaderCount;
+} __attribute__((aligned(64))) SequenceSlot;
+
+//
+// Global (shared) variables
+//
+
+// Counting semaphore of free slots, telling writers they can claim the next sequence
+static sem_t sharedSemMayWrite;
+
+// Slots of the exchange ring
+static SequenceSlot sharedSlots[EXCHANGE_SLOT_COUNT];
+
+// Next sequence to be claimed by a writer
+static int sharedNextSequence __attribute__((aligned(64)));
+
+/**
+ * Safely read the item at a position of the stream.
+ *
+ * This functions follows the sequence semaphore protocol. Readers must go through all sequences
+ * in order, starting from 0.
+ *
+ * @param threadName Name of reader thread reading a value
+ * @param sequence Position of the item in the stream
+ * @param itemId Set to the position of the item in the initial buffer
+ * @return Read value
+ */
+int protocolReadSequenceValue(const char *threadName, int sequence, int *itemId)
+{
+	int itemValue;
+	int slotId = sequence % EXCHANGE_SLOT_COUNT;
+	int readSemaphoreId = (sequence / EXCHANGE_SLOT_COUNT) % 2;
+	SequenceSlot *slot = &sharedSlots[slotId];
+
+	TRACE("%s Waiting on slot %d semaphore to read sequence %d\n", threadName, slotId, sequence);
+
+	// Wait until some writer has published sequence in the slot
+	latencySemWait(&slot->semMayReadSwap[readSemaphoreId], STATS_SEM_MAY_READ);
+
+	// Read value from exchange ring
+	itemValue = exchangeBufferReadSlotValue(threadName, slotId, itemId);
+	STATS_COUNT(STATS_COUNTER_READ_ITEMS, 1);
+
+	// Increase the number of readers done with this slot. Only one reader at a time holds the
+	// slot's read semaphore, so there's no race here
+	slot->finishedReaderCount++;
+
+	if (slot->finishedReaderCount == READERS_COUNT) {
+		// We were the last reader, so reset the counter and free the slot
+		slot->finishedReaderCount = 0;
+		STATS_COUNT(STATS_COUNTER_ROUNDS, 1);
+
+		TRACE("%s Freeing slot %d after sequence %d\n", threadName, slotId, sequence);
+
+		sem_post(&sharedSemMayWrite);
+	} else {
+		// There are still readers that need to read this sequence
+		sem_post(&slot->semMayReadSwap[readSemaphoreId]);
+	}
+
+	return itemValue;
+}
+
+/**
+ * Safely publish an item, possibly concurrently with other writers.
+ *
+ * @param threadName Name of writer thread writing out the item value
+ * @param itemId The position of the item in the initial buffer
+ * @param itemValue The value of the item being exchanged with the readers
+ * @return Position of the item in the stream
+ */
+int protocolPublishValue(const char *threadName, int itemId, int itemValue)
+{
+	int sequence;
+	int slotId;
+
+	TRACE("%s Waiting for a free slot\n", threadName);
+
+	// Wait until there's a slot guaranteed to be free for the sequence we're about to claim
+	STATS_SEM_WAIT(&sharedSemMayWrite, STATS_SEM_MAY_WRITE);
+
+	// Claim the next position of the stream
+	sequence = __sync_fetch_and_add(&sharedNextSequence, 1);
+	slotId = sequence % EXCHANGE_SLOT_COUNT;
+
+	// Write the item to its slot
+	exchangeBufferWriteSlotValue(threadName, slotId, itemId, itemValue);
+	STATS_COUNT(STATS_COUNTER_WRITTEN_ITEMS, 1);
+
+	TRACE("%s Signaling readers to read sequence %d from slot %d\n", threadName, sequence, slotId);
+
+	// Publish it. sem_post() is a full barrier, so readers see the written slot
+	sem_post(&sharedSlots[slotId].semMayReadSwap[(sequence / EXCHANGE_SLOT_COUNT) % 2]);
+
+	return sequence;
+}
+
+/**
+ * Safely read a value from the stream.
+ *
+ * @param threadName Name of reader thread reading a value
+ * @param itemId The position of the item in the stream, i.e. in the initial buffer if there's
+ *               a single writer
+ * @return Read value
+ */
+int protocolReadValue(const char *threadName, int itemId)
+{
+	int publishedItemId;
+
+	return protocolReadSequenceValue(threadName, itemId, &publishedItemId);
+}
+
+/**
+ * Safely write a value to the stream so it's read by readers.
+ *
+ * @param threadName Name of writer thread writing out the item value
+ * @param itemId The position of the item in the initial buffer
+ * @param itemValue The value of the item being exchanged with the readers
+ */
+void protocolWriteValue(const char *threadName, int itemId, int itemValue)
+{
+	protocolPublishValue(threadName, itemId, itemValue);
+}
+
+/**
+ * Initializes shared variables and semaphores.
+ */
+void protocolInit()
+{
+	int i;
+
+	// Writers may take all slots right away
+	sem_init(&sharedSemMayWrite, 0, EXCHANGE_SLOT_COUNT);
+
+	sharedNextSequence = 0;
+
+	for (i = 0; i < EXCHANGE_SLOT_COUNT; i++) {
+		// Initialize read semaphores to 0 (nothing published yet)
+		sem_init(&sharedSlots[i].semMayReadSwap[0], 0, 0);
+		sem_init(&sharedSlots[i].semMayReadSwap[1], 0, 0);
+		sharedSlots[i].finishedReaderCount = 0;
+	}
+}
@@ -0,0 +1,164 @@
+/**
+ * subscription_main.c
+ *
+ * Workflow skeleton for protocols supporting dynamic reader subscription (subscription_sem.c).
+ *
+ * Unlike main.c, readers don't all start at item 0 and read every item:
+ * 1. Reader i subscribes i * JOIN_DELAY_MS milliseconds late and starts at whatever item is current.
+ * 2. Every third reader unsubscribes early, after reading LEAVE_AFTER_COUNT items.
+ * 3. The last reader stalls for longer than SUBSCRIBER_TIMEOUT_MS, gets evicted, subscribes
+ *    again and reads the rest of the items.
+ *
+ * The writer must not get stuck on any of them, and every value read must be correct.
+ * Compile with some -DITEM_COUNT=100 or more, so that late readers find items left to read.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "main.h"
+
+// Time between consecutive writes, as if items arrived at a steady pace
+#define WRITE_DELAY_MS 1
+
+// Delay between reader subscriptions
+#define JOIN_DELAY_MS 3
+
+// Time readers spend on each item they read
+#define READ_DELAY_MS 1
+
+// Number of items read by readers leaving early
+#define LEAVE_AFTER_COUNT 5
+
+/**
+ * Writer thread task.
+ *
+ * Writes out all items at a steady pace, no matter who's listening.
+ *
+ * @param threadId Id assigned to thread
+ * @return
+ */
+void *writerThreadTask(void *threadId)
+{
+	int i;
+	char threadName[255];
+
+	sprintf(threadName, "[writer]");
+	statsRegisterThread(threadName);
+
+	for (i = 0; i < ITEM_COUNT; i++) {
+		protocolWriteValue(threadName, i, itemArrayReadValue(i));
+		usleep(WRITE_DELAY_MS * 1000);
+	}
+
+	fprintf(stderr, "%s succeeded writing %d items\n", threadName, ITEM_COUNT);
+
+	return 0;
+}
+
+/**
+ * Reader thread task.
+ *
+ * Subscribes late and reads items, possibly leaving early or stalling, depending on its id.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+void *readerThreadTask(void *threadId)
+{
+	long readerId = (long) threadId;
+	int itemId;
+	int itemValue;
+	int readCount = 0;
+	int wrongReadCount = 0;
+	int evictionCount = 0;
+	int firstItemId;
+	int leavesEarly = (readerId % 3 == 2);
+	int stalls = (readerId == READERS_COUNT - 1);
+	char threadName[255];
+
+	sprintf(threadName, "[reader %3ld]", readerId);
+	statsRegisterThread(threadName);
+
+	// Join late
+	usleep(readerId * JOIN_DELAY_MS * 1000);
+
+	firstItemId = itemId = protocolSubscribe(threadName);
+
+	while ((itemId >= 0) && (itemId < ITEM_COUNT)) {
+		itemValue = protocolReadValue(threadName, itemId);
+
+		if (itemValue == PROTOCOL_EVICTED) {
+			// We've been left behind, catch up with the current item
+			evictionCount++;
+			itemId = protocolSubscribe(threadName);
+			continue;
+		}
+
+		if (!itemArrayIsValueCorrect(itemId, itemValue)) {
+			wrongReadCount++;
+			fprintf(stderr, "***** FAIL ***** %s Read item with id=%d, copied value = %d\n",
+					threadName, itemId, itemValue);
+		}
+		readCount++;
+		itemId++;
+
+		if (leavesEarly && (readCount == LEAVE_AFTER_COUNT)) {
+			break;
+		}
+
+		// Take a nap, or a much longer one if we're the stalling reader
+		if (stalls && (readCount == LEAVE_AFTER_COUNT)) {
+			usleep(2 * SUBSCRIBER_TIMEOUT_MS * 1000);
+		} else {
+			usleep(READ_DELAY_MS * 1000);
+		}
+	}
+
+	protocolUnsubscribe(threadName);
+
+	fprintf(stderr, "%s%s Joined at item %d, read %d items, left at item %d, evicted %d times\n",
+			wrongReadCount ? "***** FAIL ***** " : "", threadName, firstItemId, readCount, itemId, evictionCount);
+
+	return 0;
+}
+
+/**
+ * Initializes shared variables and semaphores.
+ *
+ * Then fires up writer & reader threads.
+ */
+int main()
+{
+	long i;
+
+	statsInitDefault("onebuf");
+	statsStartDumper(STATS_DUMP_PERIOD_MS);
+
+	exchangeBufferInit();
+	if (!itemArrayInit("main")) {
+		return 1;
+	}
+	protocolInit();
+
+	pthread_t writerThread;
+	pthread_t readerThread[READERS_COUNT];
+
+	pthread_create(&writerThread, NULL, writerThreadTask, ((void *) -1));
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_create(&readerThread[i], NULL, readerThreadTask, ((void *) i));
+	}
+
+	pthread_join(writerThread, NULL);
+	for (i = 0; i < READERS_COUNT; i++) {
+		pthread_join(readerThread[i], NULL);
+	}
+
+	statsDump(stderr);
+	statsDestroy();
+
+	return 0;
+}
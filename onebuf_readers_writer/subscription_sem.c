@@ -0,0 +1,394 @@
+/**
+ * subscription_sem.c
+ *
+ * Protocol implementation allowing readers to come and go while the writer is writing.
+ *
+ * The other protocols expect exactly READERS_COUNT readers, all reading every single item, so a
+ * reader joining late or leaving early makes the writer wait forever. Here readers subscribe
+ * before reading and unsubscribe when they're done, and the writer only waits for the readers
+ * subscribed when the item was written:
+ *
+ * 1. Membership is kept per epoch, an epoch being the lifetime of a single item. When the writer
+ *    writes an item it opens a new epoch and expects all currently subscribed readers to read it.
+ * 2. A reader subscribing while an epoch is open joins it, i.e. starts reading at the current item.
+ *    Otherwise it starts at the next item written.
+ * 3. A reader unsubscribing before reading the current item is no longer waited for.
+ * 4. If readers don't read the current item within SUBSCRIBER_TIMEOUT_MS, the writer evicts
+ *    them, so a stalled reader can't hold back everybody else. Evicted readers get
+ *    PROTOCOL_EVICTED from protocolReadValue() and have to subscribe again.
+ *
+ * Every subscriber waits on a read semaphore of its own, so the writer only wakes up members of
+ * the current epoch and evicted readers can never steal a wake-up meant for somebody else.
+ *
+ * Use the driver in subscription_main.c, since main.c never subscribes.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+#include "main.h"
+
+// A subscriber slot
+typedef struct Subscriber {
+	// Whether the slot is taken by a subscribed reader
+	int isSubscribed;
+
+	// Whether the reader has been evicted and not noticed yet
+	int isEvicted;
+
+	// Epoch (item id) the reader has to read next
+	int nextItemId;
+
+	// Signaling semaphore telling the reader it can read the current item
+	sem_t semMayRead;
+} Subscriber;
+
+//
+// Global (shared) variables
+//
+
+// Mutex regulating exclusive access to subscribers and epoch counters
+static sem_t sharedSemMutex;
+
+// Signaling semaphore telling writer he can proceed to writing next item in shared buffer
+static sem_t sharedSemMayWrite;
+
+// Subscriber slots
+static Subscriber sharedSubscribers[MAX_SUBSCRIBERS];
+
+// Number of subscribed readers
+static int sharedSubscriberCount;
+
+// Id of the last item written, i.e. the current epoch
+static int sharedCurrentItemId;
+
+// Whether readers are still reading the current item
+static int sharedIsEpochOpen;
+
+// Readers expected to read the current item, and readers done with it
+static int sharedEpochReaderCount;
+static int sharedFinishedReaderCount;
+
+// Slot of each reader thread, NULL while not subscribed
+static __thread Subscriber *localSubscriber;
+
+/**
+ * Close the current epoch if all its readers are done, letting the writer proceed.
+ *
+ * Must be called holding sharedSemMutex.
+ *
+ * @param threadName Name of calling thread
+ */
+static void protocolCloseEpochIfDone(const char *threadName)
+{
+	if (sharedIsEpochOpen && (sharedFinishedReaderCount == sharedEpochReaderCount)) {
+		TRACE("%s Epoch of item with id=%d complete\n", threadName, sharedCurrentItemId);
+
+		sharedIsEpochOpen = 0;
+		STATS_COUNT(STATS_COUNTER_ROUNDS, 1);
+
+		// Signal the writer to write the next value
+		sem_post(&sharedSemMayWrite);
+	}
+}
+
+/**
+ * Subscribe the calling reader thread.
+ *
+ * @param threadName Name of reader thread subscribing
+ * @return Id of first item the reader will read, or -1 if there are no free subscriber slots
+ */
+int protocolSubscribe(const char *threadName)
+{
+	int i;
+	int firstItemId;
+	Subscriber *subscriber = NULL;
+
+	if (localSubscriber) {
+		return localSubscriber->nextItemId;
+	}
+
+	STATS_SEM_WAIT(&sharedSemMutex, STATS_SEM_MUTEX);
+
+	for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+		if (!sharedSubscribers[i].isSubscribed) {
+			subscriber = &sharedSubscribers[i];
+			break;
+		}
+	}
+
+	if (!subscriber) {
+		sem_post(&sharedSemMutex);
+		return -1;
+	}
+
+	subscriber->isSubscribed = 1;
+	subscriber->isEvicted = 0;
+	sharedSubscriberCount++;
+
+	if (sharedIsEpochOpen) {
+		// Join the current epoch and read the current item right away
+		firstItemId = sharedCurrentItemId;
+		sharedEpochReaderCount++;
+		sem_post(&subscriber->semMayRead);
+	} else {
+		// Wait for the next item
+		firstItemId = sharedCurrentItemId + 1;
+	}
+	subscriber->nextItemId = firstItemId;
+
+	TRACE("%s Subscribed, %d readers now, starting at item with id=%d\n",
+			threadName, sharedSubscriberCount, firstItemId);
+
+	sem_post(&sharedSemMutex);
+
+	localSubscriber = subscriber;
+
+	return firstItemId;
+}
+
+/**
+ * Make a subscriber slot available for new subscribers.
+ *
+ * Must be called holding sharedSemMutex.
+ *
+ * @param subscriber Subscriber slot to free
+ */
+static void protocolFreeSlot(Subscriber *subscriber)
+{
+	// Drop any wake-up the previous subscriber didn't get to consume. All posts are made holding
+	// sharedSemMutex, so none can sneak in after this
+	while (sem_trywait(&subscriber->semMayRead) == 0) {
+	}
+
+	subscriber->isSubscribed = 0;
+	subscriber->isEvicted = 0;
+}
+
+/**
+ * Remove a subscriber from the current epoch and free its slot.
+ *
+ * Must be called holding sharedSemMutex.
+ *
+ * @param threadName Name of calling thread
+ * @param subscriber Subscriber to remove
+ */
+static void protocolRemoveSubscriber(const char *threadName, Subscriber *subscriber)
+{
+	if (sharedIsEpochOpen && (subscriber->nextItemId == sharedCurrentItemId)) {
+		// Subscriber is a member of the current epoch but hasn't read the item, don't wait for it
+		sharedEpochReaderCount--;
+	}
+
+	protocolFreeSlot(subscriber);
+	sharedSubscriberCount--;
+
+	protocolCloseEpochIfDone(threadName);
+}
+
+/**
+ * Unsubscribe the calling reader thread.
+ *
+ * @param threadName Name of reader thread unsubscribing
+ */
+void protocolUnsubscribe(const char *threadName)
+{
+	Subscriber *subscriber = localSubscriber;
+
+	if (!subscriber) {
+		return;
+	}
+
+	STATS_SEM_WAIT(&sharedSemMutex, STATS_SEM_MUTEX);
+
+	if (subscriber->isEvicted) {
+		// Already removed by the writer, just free the slot
+		protocolFreeSlot(subscriber);
+	} else {
+		protocolRemoveSubscriber(threadName, subscriber);
+
+		TRACE("%s Unsubscribed, %d readers left\n", threadName, sharedSubscriberCount);
+	}
+
+	sem_post(&sharedSemMutex);
+
+	localSubscriber = NULL;
+}
+
+/**
+ * Safely read a value from the sharedSingleItem variable.
+ *
+ * The calling reader must be subscribed, and read items in order starting from the item id
+ * returned by protocolSubscribe().
+ *
+ * @param threadName Name of reader thread reading a value
+ * @param itemId The position of the item in the initial buffer
+ * @return Read value, or PROTOCOL_EVICTED if the reader has been evicted
+ */
+int protocolReadValue(const char *threadName, int itemId)
+{
+	int itemValue;
+	Subscriber *subscriber = localSubscriber;
+
+	if (!subscriber) {
+		return PROTOCOL_EVICTED;
+	}
+
+	TRACE("%s Waiting to read item with id=%d from the shared buffer\n", threadName, itemId);
+
+	// Wait until the writer has written out the value of itemId in the shared buffer
+	latencySemWait(&subscriber->semMayRead, STATS_SEM_MAY_READ);
+
+	STATS_SEM_WAIT(&sharedSemMutex, STATS_SEM_MUTEX);
+
+	if (subscriber->isEvicted) {
+		// We took too long and the writer moved on without us. The slot is ours until we find out
+		TRACE("%s Evicted before reading item with id=%d\n", threadName, itemId);
+
+		protocolFreeSlot(subscriber);
+		localSubscriber = NULL;
+		sem_post(&sharedSemMutex);
+
+		return PROTOCOL_EVICTED;
+	}
+
+	// Read value from exchange buffer
+	itemValue = exchangeBufferReadValue(threadName, itemId);
+	STATS_COUNT(STATS_COUNTER_READ_ITEMS, 1);
+
+	subscriber->nextItemId = itemId + 1;
+
+	// Update the number of readers that have read the currently shared value
+	sharedFinishedReaderCount++;
+	protocolCloseEpochIfDone(threadName);
+
+	sem_post(&sharedSemMutex);
+
+	return itemValue;
+}
+
+/**
+ * Wait until all readers of the current epoch are done, evicting the ones taking too long.
+ *
+ * @param threadName Name of writer thread
+ */
+static void protocolWaitForReaders(const char *threadName)
+{
+	int i;
+	struct timespec deadline;
+
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SUBSCRIBER_TIMEOUT_MS / 1000;
+		deadline.tv_nsec += (SUBSCRIBER_TIMEOUT_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		if (sem_timedwait(&sharedSemMayWrite, &deadline) == 0) {
+			return;
+		}
+
+		if (errno != ETIMEDOUT) {
+			// Interrupted by signal, keep waiting
+			continue;
+		}
+
+		STATS_SEM_WAIT(&sharedSemMutex, STATS_SEM_MUTEX);
+
+		// Evict all readers that still haven't read the current item
+		for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+			Subscriber *subscriber = &sharedSubscribers[i];
+
+			if (subscriber->isSubscribed && !subscriber->isEvicted
+					&& (subscriber->nextItemId == sharedCurrentItemId)) {
+				TRACE("%s Evicting reader in slot %d, stalled on item with id=%d\n",
+						threadName, i, sharedCurrentItemId);
+
+				protocolRemoveSubscriber(threadName, subscriber);
+
+				// Keep the slot until the reader finds out, so it isn't reused under its feet
+				subscriber->isSubscribed = 1;
+				subscriber->isEvicted = 1;
+
+				// Wake it up, in case it's waiting for an item it will never read
+				sem_post(&subscriber->semMayRead);
+			}
+		}
+
+		sem_post(&sharedSemMutex);
+	}
+}
+
+/**
+ * Safely write a value to the sharedSingleItem variable so it's read by the subscribed readers.
+ *
+ * @param threadName Name of writer thread writing out the item value
+ * @param itemId The position of the item in the initial buffer
+ * @param itemValue The value of the item being exchanged with the readers
+ */
+void protocolWriteValue(const char *threadName, int itemId, int itemValue)
+{
+	int i;
+
+	TRACE("%s Waiting for readers to complete reading\n", threadName);
+
+	// Wait until all readers are done reading
+	protocolWaitForReaders(threadName);
+
+	STATS_SEM_WAIT(&sharedSemMutex, STATS_SEM_MUTEX);
+
+	// Write the item value to the shared variable
+	exchangeBufferWriteValue(threadName, itemId, itemValue);
+	STATS_COUNT(STATS_COUNTER_WRITTEN_ITEMS, 1);
+
+	// Open a new epoch for all current subscribers
+	sharedCurrentItemId = itemId;
+	sharedIsEpochOpen = 1;
+	sharedEpochReaderCount = 0;
+	sharedFinishedReaderCount = 0;
+
+	for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+		if (sharedSubscribers[i].isSubscribed && !sharedSubscribers[i].isEvicted) {
+			sharedEpochReaderCount++;
+			sem_post(&sharedSubscribers[i].semMayRead);
+		}
+	}
+
+	TRACE("%s Signaled %d subscribed readers to read item with id=%d\n",
+			threadName, sharedEpochReaderCount, itemId);
+
+	// Nobody to wait for if there are no subscribers
+	protocolCloseEpochIfDone(threadName);
+
+	sem_post(&sharedSemMutex);
+}
+
+/**
+ * Initializes shared variables and semaphores.
+ */
+void protocolInit()
+{
+	int i;
+
+	sem_init(&sharedSemMutex, 0, 1);
+
+	// Writer may start doing work right away
+	sem_init(&sharedSemMayWrite, 0, 1);
+
+	// Nobody has subscribed, nothing has been written
+	sharedSubscriberCount = 0;
+	sharedCurrentItemId = -1;
+	sharedIsEpochOpen = 0;
+	sharedEpochReaderCount = 0;
+	sharedFinishedReaderCount = 0;
+
+	for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+		sharedSubscribers[i].isSubscribed = 0;
+		sharedSubscribers[i].isEvicted = 0;
+		sem_init(&sharedSubscribers[i].semMayRead, 0, 0);
+	}
+}
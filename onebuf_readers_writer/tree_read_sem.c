@@ -0,0 +1,191 @@
+/**
+ * tree_read_sem.c
+ *
+ * Protocol implementation scaling to thousands of readers, using a two-level combining tree
+ * for reader completion and a dissemination of wake-ups within groups of readers.
+ *
+ * In swap_read_sem.c and per_item_read_sem.c readers go through the exchange buffer one after
+ * the other: each one waits for the previous to pass the read semaphore on, so a round takes
+ * READERS_COUNT consecutive hand-offs, all of them through the same semaphore and the same
+ * sharedFinishedReaderCount.
+ *
+ * Here readers are split into groups of READER_GROUP_SIZE, each group with its own (cache line
+ * aligned) read semaphore and completion counter:
+ *
+ * 1. The writer posts the read semaphore of each group once.
+ * 2. Every woken reader wakes up to two more readers of its group, so a whole group is awake
+ *    after log2(READER_GROUP_SIZE) hand-offs instead of READER_GROUP_SIZE.
+ * 3. When done reading, a reader decrements the counter of its group. Only the last reader of
+ *    each group (the group leader for this round) decrements the root counter, and only the last
+ *    group leader signals the writer.
+ *
+ * As in swap_read_sem.c, this only works given itemId takes all consecutive values starting
+ * from 0. Readers join a group on their first read, in order of arrival.
+ *
+ * Groups aren't formed by core or socket: readers aren't pinned, so the CPU a reader happens to
+ * run on when it joins says little about where the scheduler runs it afterwards, and grouping by
+ * the CPU of the moment would leave groups uneven, some of them longer to wake up than
+ * log2(READER_GROUP_SIZE) hand-offs. Grouping by arrival keeps every group full. Readers pinned
+ * by the caller could be grouped by sched_getcpu() on their first read instead.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <semaphore.h>
+#include "main.h"
+
+// Number of reader groups
+#define READER_GROUP_COUNT ((READERS_COUNT + READER_GROUP_SIZE - 1) / READER_GROUP_SIZE)
+
+// A group of readers sharing a read semaphore and a completion counter. Aligned to a cache line
+// so that groups don't slow each other down
+typedef struct ReaderGroup {
+	// Number of readers in the group
+	int readerCount;
+
+	// Readers of the group that haven't finished reading the current item yet
+	int pendingReaderCount;
+
+	// Wake-ups handed out for the current item so far, including the writer's
+	int wakeupTicketCount;
+
+	// Signaling semaphores telling readers of the group they can read the current item. Swapped
+	// per item like in swap_read_sem.c, so that readers done with an item and waiting for the
+	// next one can't steal wake-ups meant for their slower group mates
+	sem_t semMayReadSwap[2];
+} __attribute__((aligned(64))) ReaderGroup;
+
+//
+// Global (shared) variables
+//
+
+// Signaling semaphore telling writer he can proceed to writing next item in shared buffer
+static sem_t sharedSemMayWrite;
+
+// Reader groups, i.e. the leaves of the completion tree
+static ReaderGroup sharedReaderGroups[READER_GROUP_COUNT];
+
+// Root of the completion tree: groups that haven't finished reading the current item yet
+static int sharedPendingGroupCount __attribute__((aligned(64)));
+
+// Number of readers that have joined a group so far
+static int sharedJoinedReaderCount;
+
+// Group of each reader thread, NULL until its first read
+static __thread ReaderGroup *localReaderGroup;
+
+/**
+ * Safely read a value from the sharedSingleItem variable.
+ *
+ * This functions follows the tree read semaphore protocol.
+ *
+ * @param threadName Name of reader thread reading a value
+ * @param itemId The position of the item in the initial buffer
+ * @return Read value
+ */
+int protocolReadValue(const char *threadName, int itemId)
+{
+	int i;
+	int itemValue;
+	int firstTicket;
+	int readSemaphoreId = itemId % 2;
+	ReaderGroup *group = localReaderGroup;
+
+	if (!group) {
+		// First read, join the next group with free places
+		group = &sharedReaderGroups[__sync_fetch_and_add(&sharedJoinedReaderCount, 1) / READER_GROUP_SIZE];
+		localReaderGroup = group;
+	}
+
+	TRACE("%s Waiting on group semaphore to read item with id=%d from the shared buffer\n", threadName, itemId);
+
+	// Wait until the writer has written out the value of itemId in the shared buffer
+	latencySemWait(&group->semMayReadSwap[readSemaphoreId], STATS_SEM_MAY_READ);
+
+	// Wake up two more readers of our group, unless everybody's up already
+	firstTicket = __sync_fetch_and_add(&group->wakeupTicketCount, 2);
+	for (i = firstTicket; (i < firstTicket + 2) && (i < group->readerCount); i++) {
+		sem_post(&group->semMayReadSwap[readSemaphoreId]);
+	}
+
+	// Read value from exchange buffer
+	itemValue = exchangeBufferReadValue(threadName, itemId);
+	STATS_COUNT(STATS_COUNTER_READ_ITEMS, 1);
+
+	if (__sync_sub_and_fetch(&group->pendingReaderCount, 1) == 0) {
+		// We were the last reader of our group. Nobody in the group may touch its counters
+		// before the next item is written, so it's safe to reset them for the next round
+		group->pendingReaderCount = group->readerCount;
+		group->wakeupTicketCount = 1;
+
+		if (__sync_sub_and_fetch(&sharedPendingGroupCount, 1) == 0) {
+			// We were the last group, reset the root for the next round as well
+			sharedPendingGroupCount = READER_GROUP_COUNT;
+			STATS_COUNT(STATS_COUNTER_ROUNDS, 1);
+
+			// Signal the writer to write the next value
+			sem_post(&sharedSemMayWrite);
+		}
+	}
+
+	return itemValue;
+}
+
+/**
+ * Safely write a value to the sharedSingleItem variable so it's read by readers.
+ *
+ * @param threadName Name of writer thread writing out the item value
+ * @param itemId The position of the item in the initial buffer
+ * @param itemValue The value of the item being exchanged with the readers
+ */
+void protocolWriteValue(const char *threadName, int itemId, int itemValue)
+{
+	int i;
+	int readSemaphoreId = itemId % 2;
+
+	TRACE("%s Waiting for readers to complete reading\n", threadName);
+
+	// Wait until all readers are done reading
+	STATS_SEM_WAIT(&sharedSemMayWrite, STATS_SEM_MAY_WRITE);
+
+	// Write the item value to the shared variable
+	exchangeBufferWriteValue(threadName, itemId, itemValue);
+	STATS_COUNT(STATS_COUNTER_WRITTEN_ITEMS, 1);
+
+	TRACE("%s Signaling %d reader groups to resume reading on item with id=%d\n",
+			threadName, READER_GROUP_COUNT, itemId);
+
+	// Wake up one reader per group, the rest will be woken up by their group mates
+	for (i = 0; i < READER_GROUP_COUNT; i++) {
+		sem_post(&sharedReaderGroups[i].semMayReadSwap[readSemaphoreId]);
+	}
+}
+
+/**
+ * Initializes shared variables and semaphores.
+ */
+void protocolInit()
+{
+	int i;
+
+	// Writer may start doing work right away
+	sem_init(&sharedSemMayWrite, 0, 1);
+
+	// No reader has joined yet, no group has finished the first item
+	sharedJoinedReaderCount = 0;
+	sharedPendingGroupCount = READER_GROUP_COUNT;
+
+	for (i = 0; i < READER_GROUP_COUNT; i++) {
+		// Last group gets whatever readers are left
+		sharedReaderGroups[i].readerCount = (i < READER_GROUP_COUNT - 1)
+				? READER_GROUP_SIZE : READERS_COUNT - i * READER_GROUP_SIZE;
+		sharedReaderGroups[i].pendingReaderCount = sharedReaderGroups[i].readerCount;
+
+		// The writer's wake-up is the first one
+		sharedReaderGroups[i].wakeupTicketCount = 1;
+
+		// Initialize read semaphores to 0 (not usable yet)
+		sem_init(&sharedReaderGroups[i].semMayReadSwap[0], 0, 0);
+		sem_init(&sharedReaderGroups[i].semMayReadSwap[1], 0, 0);
+	}
+}
@@ -0,0 +1,643 @@
+/**
+ * bridge.c
+ *
+ * Bridge extending a buffer across processes, over a Unix domain or TCP socket.
+ *
+ * The sending side drains the consume side of a local buffer, a whole buffer at a time, and
+ * ships what it gets as frames: a header holding the number of items and the send time,
+ * followed by the items. The receiving side produces the items of each frame into the produce
+ * side of its own buffer. A frame of no items marks the end of the stream, so the remote buffer
+ * gets closed once the local one has been closed and drained.
+ *
+ * Header and items are sent with a single sendmsg() from separate iovecs, so items are never
+ * copied into a send buffer. If the local protocol supports non-blocking consumption (see
+ * event_fd.c), whatever else is ready right away is gathered into the same sendmsg(), up to
+ * BRIDGE_MAX_FRAMES frames. With BRIDGE_ZEROCOPY, TCP sends use MSG_ZEROCOPY and items stay in
+ * their slot until the kernel reports it's done with them. BRIDGE_PER_ITEM sends each item as a
+ * frame of its own with send(), for comparison.
+ *
+ * Addresses are given as "unix:/path/to/socket" or "tcp:host:port".
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "main.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Number of frames the sending side keeps items of, while sending or waiting for zero copy completions
+#define BRIDGE_SLOT_COUNT (4 * BRIDGE_MAX_FRAMES)
+
+// Size of the receiving side's read buffer
+#define BRIDGE_READ_BUFFER_SIZE (256 * 1024)
+
+// Header preceding the items of every frame
+typedef struct BridgeFrameHeader {
+	uint32_t itemCount;
+	uint32_t reserved;
+
+	// clockNowNanos() when the frame was sent. The monotonic clock is shared by all processes of a host
+	int64_t sendNanos;
+} BridgeFrameHeader;
+
+// A frame of the sending side
+typedef struct BridgeSlot {
+	BridgeFrameHeader header;
+	int *items;
+
+	// Id of the last zero copy sendmsg() carrying the frame
+	uint32_t sendId;
+} BridgeSlot;
+
+// Buffered reading of the receiving side
+typedef struct BridgeReader {
+	int fd;
+	char *data;
+	size_t length;
+	size_t pos;
+} BridgeReader;
+
+/**
+ * Parse an address into a socket address.
+ *
+ * @param address "unix:/path" or "tcp:host:port"
+ * @param socketAddress Receives the socket address
+ * @param socketAddressLength Receives the length of the socket address
+ * @return Address family, -1 if address is malformed
+ */
+static int bridgeParseAddress(const char *address, struct sockaddr_storage *socketAddress, socklen_t *socketAddressLength)
+{
+	struct sockaddr_un *unixAddress = (struct sockaddr_un *) socketAddress;
+	struct sockaddr_in *inetAddress = (struct sockaddr_in *) socketAddress;
+	const char *port;
+	char host[64];
+
+	memset(socketAddress, 0, sizeof(*socketAddress));
+
+	if ((strncmp(address, "unix:", 5) == 0) && (strlen(address + 5) < sizeof(unixAddress->sun_path))) {
+		unixAddress->sun_family = AF_UNIX;
+		strcpy(unixAddress->sun_path, address + 5);
+		*socketAddressLength = sizeof(*unixAddress);
+
+		return AF_UNIX;
+	}
+
+	if ((strncmp(address, "tcp:", 4) == 0) && (port = strrchr(address + 4, ':'))
+			&& ((size_t) (port - address - 4) < sizeof(host))) {
+		memcpy(host, address + 4, port - address - 4);
+		host[port - address - 4] = '\0';
+
+		inetAddress->sin_family = AF_INET;
+		inetAddress->sin_port = htons((uint16_t) atoi(port + 1));
+		if (inet_pton(AF_INET, host, &inetAddress->sin_addr) == 1) {
+			*socketAddressLength = sizeof(*inetAddress);
+
+			return AF_INET;
+		}
+	}
+
+	fprintf(stderr, "Malformed bridge address '%s'\n", address);
+
+	return -1;
+}
+
+/**
+ * Disable Nagle's algorithm on TCP sockets, so frames leave as soon as they're sent.
+ *
+ * @param fd Connected socket
+ */
+static void bridgeSetNoDelay(int fd)
+{
+	struct sockaddr_storage socketAddress;
+	socklen_t socketAddressLength = sizeof(socketAddress);
+	int isEnabled = 1;
+
+	if ((getsockname(fd, (struct sockaddr *) &socketAddress, &socketAddressLength) == 0)
+			&& (socketAddress.ss_family == AF_INET)) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &isEnabled, sizeof(isEnabled));
+	}
+}
+
+/**
+ * Listen for the sending side of a bridge.
+ *
+ * Unix domain socket files left over are replaced. TCP port 0 picks any free port, see
+ * bridgeGetAddress().
+ *
+ * @param address Address to listen at
+ * @return Listening socket, -1 on failure
+ */
+int bridgeListen(const char *address)
+{
+	struct sockaddr_storage socketAddress;
+	socklen_t socketAddressLength;
+	int family = bridgeParseAddress(address, &socketAddress, &socketAddressLength);
+	int isEnabled = 1;
+	int fd;
+
+	if ((family < 0) || ((fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)) {
+		return -1;
+	}
+
+	if (family == AF_UNIX) {
+		unlink(((struct sockaddr_un *) &socketAddress)->sun_path);
+	} else {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &isEnabled, sizeof(isEnabled));
+	}
+
+	if ((bind(fd, (struct sockaddr *) &socketAddress, socketAddressLength) != 0) || (listen(fd, 1) != 0)) {
+		perror(address);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Get the address the sending side should connect to.
+ *
+ * @param listenFd Socket returned by bridgeListen()
+ * @param address Receives the address
+ * @param size Size of address
+ */
+void bridgeGetAddress(int listenFd, char *address, size_t size)
+{
+	struct sockaddr_storage socketAddress;
+	socklen_t socketAddressLength = sizeof(socketAddress);
+	char host[INET_ADDRSTRLEN];
+
+	getsockname(listenFd, (struct sockaddr *) &socketAddress, &socketAddressLength);
+
+	if (socketAddress.ss_family == AF_UNIX) {
+		snprintf(address, size, "unix:%s", ((struct sockaddr_un *) &socketAddress)->sun_path);
+	} else {
+		inet_ntop(AF_INET, &((struct sockaddr_in *) &socketAddress)->sin_addr, host, sizeof(host));
+		snprintf(address, size, "tcp:%s:%d", host, ntohs(((struct sockaddr_in *) &socketAddress)->sin_port));
+	}
+}
+
+/**
+ * Wait for the sending side of a bridge to connect.
+ *
+ * @param listenFd Socket returned by bridgeListen()
+ * @return Connected socket, -1 on failure
+ */
+int bridgeAccept(int listenFd)
+{
+	int fd;
+
+	while (((fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) < 0) && (errno == EINTR)) {
+		// Interrupted by signal, try again
+	}
+
+	if (fd < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	bridgeSetNoDelay(fd);
+
+	return fd;
+}
+
+/**
+ * Connect to the receiving side of a bridge.
+ *
+ * @param address Address the receiving side listens at
+ * @return Connected socket, -1 on failure
+ */
+int bridgeConnect(const char *address)
+{
+	struct sockaddr_storage socketAddress;
+	socklen_t socketAddressLength;
+	int family = bridgeParseAddress(address, &socketAddress, &socketAddressLength);
+	int fd;
+
+	if ((family < 0) || ((fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)) {
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *) &socketAddress, socketAddressLength) != 0) {
+		perror(address);
+		close(fd);
+		return -1;
+	}
+
+	bridgeSetNoDelay(fd);
+
+	return fd;
+}
+
+/**
+ * Collect zero copy completions, waiting for one if asked to.
+ *
+ * TCP reports completions in order, so the range of sendmsg() ids reported tells how many are
+ * done.
+ *
+ * @param fd Connected socket
+ * @param completedCount Number of zero copy sendmsg() calls completed, updated
+ * @param copiedCount Number of completions for which the kernel copied after all, updated
+ * @param isWaiting 1 to wait for at least one completion
+ */
+static void bridgeReapZeroCopy(int fd, uint32_t *completedCount, long *copiedCount, int isWaiting)
+{
+	struct pollfd pollFd = { fd, 0, 0 };
+	struct msghdr message;
+	struct cmsghdr *controlMessage;
+	struct sock_extended_err *error;
+	char control[128];
+
+	if (isWaiting) {
+		// Errors (i.e. completions) are always polled for
+		poll(&pollFd, 1, -1);
+	}
+
+	while (1) {
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			return;
+		}
+
+		for (controlMessage = CMSG_FIRSTHDR(&message); controlMessage;
+				controlMessage = CMSG_NXTHDR(&message, controlMessage)) {
+			error = (struct sock_extended_err *) CMSG_DATA(controlMessage);
+			if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+
+			// Ids ee_info to ee_data are done
+			*completedCount = error->ee_data + 1;
+			if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				(*copiedCount)++;
+			}
+		}
+	}
+}
+
+/**
+ * Send a whole message, going on after partial sends.
+ *
+ * With MSG_ZEROCOPY, running out of zero copy memory (ENOBUFS) waits for completions to free
+ * some before trying again. With no send in flight there's nothing to wait for, so that fails.
+ *
+ * @param fd Connected socket
+ * @param message Message, its iovecs are consumed
+ * @param flags sendmsg() flags
+ * @param sendCount Receives the number of sendmsg() calls that succeeded
+ * @param completedCount Number of zero copy sendmsg() calls completed, updated
+ * @param copiedCount Number of completions for which the kernel copied after all, updated
+ * @return 1 on success, 0 on failure
+ */
+static int bridgeSendAll(int fd, struct msghdr *message, int flags, uint32_t *sendCount,
+		uint32_t *completedCount, long *copiedCount)
+{
+	ssize_t sent;
+
+	while (message->msg_iovlen > 0) {
+		sent = sendmsg(fd, message, flags | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				// Interrupted by signal, try again
+				continue;
+			}
+			if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY) && (*completedCount != *sendCount)) {
+				// Out of zero copy memory, wait for sends still in flight to release some
+				bridgeReapZeroCopy(fd, completedCount, copiedCount, 1);
+				continue;
+			}
+
+			perror("Bridge sendmsg");
+			return 0;
+		}
+
+		(*sendCount)++;
+
+		// Skip what's been sent
+		while ((message->msg_iovlen > 0) && ((size_t) sent >= message->msg_iov->iov_len)) {
+			sent -= message->msg_iov->iov_len;
+			message->msg_iov++;
+			message->msg_iovlen--;
+		}
+		if (message->msg_iovlen > 0) {
+			message->msg_iov->iov_base = (char *) message->msg_iov->iov_base + sent;
+			message->msg_iov->iov_len -= sent;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Send a small frame with a single send().
+ *
+ * @param fd Connected socket
+ * @param frame Frame
+ * @param size Size of frame in bytes
+ * @return 1 on success, 0 on failure
+ */
+static int bridgeSendFrame(int fd, const void *frame, size_t size)
+{
+	ssize_t sent;
+
+	while (((sent = send(fd, frame, size, MSG_NOSIGNAL)) < 0) && (errno == EINTR)) {
+		// Interrupted by signal, try again
+	}
+
+	if (sent < 0) {
+		perror("Bridge send");
+		return 0;
+	}
+
+	// Blocking sends of a few bytes only come back short if interrupted, which the stream can't survive
+	if ((size_t) sent != size) {
+		fprintf(stderr, "Bridge send: %zd of %zu bytes sent\n", sent, size);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Drain a local buffer into a bridge until the local protocol is closed and drained, then tell
+ * the receiving side the stream has ended.
+ *
+ * @param protocol Local protocol to consume from
+ * @param fd Socket connected to the receiving side
+ * @param flags Any combination of BRIDGE_PER_ITEM and BRIDGE_ZEROCOPY
+ * @param stats Receives sending statistics, may be NULL
+ * @return 1 on success, 0 on failure
+ */
+int bridgeSend(Protocol *protocol, int fd, int flags, BridgeSendStats *stats)
+{
+	BridgeSlot slots[BRIDGE_SLOT_COUNT];
+	struct iovec iovecs[2 * BRIDGE_MAX_FRAMES];
+	struct msghdr message;
+	struct { BridgeFrameHeader header; int item; } __attribute__((packed)) itemFrame;
+	BridgeSendStats localStats = { 0, 0, 0, 0, 0 };
+	uint32_t sendId = 0;
+	uint32_t previousSendId;
+	uint32_t completedCount = 0;
+	int isZeroCopy = 0;
+	int isSucceeded = 1;
+	int isEnded = 0;
+
+	// Zero copy slots: being filled from headSlot, sent up to sentSlot, the kernel may still use them from tailSlot
+	int headSlot = 0;
+	int sentSlot = 0;
+	int tailSlot = 0;
+	int frameCount;
+	int count;
+	int item;
+	int i;
+
+	if (flags & BRIDGE_ZEROCOPY) {
+		isZeroCopy = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &isZeroCopy, sizeof(isZeroCopy)) != 0) {
+			fprintf(stderr, "Warning: zero copy not available on this socket (%s), copying\n", strerror(errno));
+			isZeroCopy = 0;
+		}
+	}
+
+	for (i = 0; i < BRIDGE_SLOT_COUNT; i++) {
+		if (!(slots[i].items = malloc(BUFFER_SIZE * sizeof(int)))) {
+			fprintf(stderr, "Could not allocate bridge slots\n");
+			while (--i >= 0) {
+				free(slots[i].items);
+			}
+			return 0;
+		}
+	}
+
+	while (!isEnded && isSucceeded) {
+		if (flags & BRIDGE_PER_ITEM) {
+			// One frame, and one send(), per item
+			if ((count = protocolConsumeBatch(protocol, "[bridge]", &item, 1)) == 0) {
+				break;
+			}
+
+			itemFrame.header.itemCount = 1;
+			itemFrame.header.reserved = 0;
+			itemFrame.header.sendNanos = clockNowNanos();
+			itemFrame.item = item;
+
+			if (!bridgeSendFrame(fd, &itemFrame, sizeof(itemFrame))) {
+				isSucceeded = 0;
+				break;
+			}
+
+			localStats.itemCount++;
+			localStats.frameCount++;
+			localStats.sendCount++;
+			continue;
+		}
+
+		// Gather whole buffers into frames, blocking for the first one only
+		frameCount = 0;
+		while ((frameCount < BRIDGE_MAX_FRAMES) && !isEnded) {
+			BridgeSlot *slot;
+
+			if (isZeroCopy) {
+				// Wait for the kernel to be done with the slot we're about to fill
+				while (((headSlot + 1) % BRIDGE_SLOT_COUNT) == tailSlot) {
+					bridgeReapZeroCopy(fd, &completedCount, &localStats.copiedCount,
+							(int32_t) (slots[tailSlot].sendId - completedCount) >= 0);
+					while ((tailSlot != sentSlot) && ((int32_t) (slots[tailSlot].sendId - completedCount) < 0)) {
+						tailSlot = (tailSlot + 1) % BRIDGE_SLOT_COUNT;
+					}
+				}
+			} else {
+				headSlot = frameCount;
+			}
+
+			slot = &slots[headSlot];
+
+			count = (frameCount == 0)
+					? protocolConsumeBatch(protocol, "[bridge]", slot->items, BUFFER_SIZE)
+					: protocolTryConsumeBatch(protocol, "[bridge]", slot->items, BUFFER_SIZE);
+			if (count == PROTOCOL_WOULD_BLOCK) {
+				break;
+			}
+			if (count == 0) {
+				// Local buffer closed and drained, send the end of stream frame
+				isEnded = 1;
+			}
+
+			slot->header.itemCount = count;
+			slot->header.reserved = 0;
+			slot->header.sendNanos = clockNowNanos();
+
+			iovecs[2 * frameCount].iov_base = &slot->header;
+			iovecs[2 * frameCount].iov_len = sizeof(slot->header);
+			iovecs[2 * frameCount + 1].iov_base = slot->items;
+			iovecs[2 * frameCount + 1].iov_len = count * sizeof(int);
+
+			localStats.itemCount += count;
+			frameCount++;
+
+			if (isZeroCopy) {
+				headSlot = (headSlot + 1) % BRIDGE_SLOT_COUNT;
+			}
+		}
+
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iovecs;
+		message.msg_iovlen = 2 * frameCount;
+
+		previousSendId = sendId;
+		isSucceeded = bridgeSendAll(fd, &message, isZeroCopy ? MSG_ZEROCOPY : 0, &sendId,
+				&completedCount, &localStats.copiedCount);
+		localStats.frameCount += frameCount;
+		localStats.sendCount += sendId - previousSendId;
+
+		if (isZeroCopy) {
+			// Slots just sent are done once the last sendmsg() carrying them is
+			for (; sentSlot != headSlot; sentSlot = (sentSlot + 1) % BRIDGE_SLOT_COUNT) {
+				slots[sentSlot].sendId = sendId - 1;
+			}
+		}
+	}
+
+	if ((flags & BRIDGE_PER_ITEM) && isSucceeded) {
+		// End of stream frame
+		itemFrame.header.itemCount = 0;
+		itemFrame.header.reserved = 0;
+		itemFrame.header.sendNanos = clockNowNanos();
+		isSucceeded = bridgeSendFrame(fd, &itemFrame.header, sizeof(itemFrame.header));
+		localStats.frameCount++;
+		localStats.sendCount++;
+	}
+
+	// Slots must not be released before the kernel is done with them
+	while (isZeroCopy && isSucceeded && (completedCount != sendId)) {
+		bridgeReapZeroCopy(fd, &completedCount, &localStats.copiedCount, 1);
+	}
+	localStats.zeroCopyCount = isZeroCopy ? sendId : 0;
+
+	for (i = 0; i < BRIDGE_SLOT_COUNT; i++) {
+		free(slots[i].items);
+	}
+
+	if (stats) {
+		*stats = localStats;
+	}
+
+	return isSucceeded;
+}
+
+/**
+ * Read exactly size bytes from the receiving side's read buffer, refilling it as needed.
+ *
+ * @param reader Reader
+ * @param data Receives the bytes read
+ * @param size Number of bytes to read
+ * @return 1 on success, 0 if the connection got closed or failed
+ */
+static int bridgeRead(BridgeReader *reader, void *data, size_t size)
+{
+	size_t length;
+	ssize_t received;
+
+	while (size > 0) {
+		if (reader->pos == reader->length) {
+			received = recv(reader->fd, reader->data, BRIDGE_READ_BUFFER_SIZE, 0);
+			if (received <= 0) {
+				if ((received < 0) && (errno == EINTR)) {
+					continue;
+				}
+				return 0;
+			}
+
+			reader->length = received;
+			reader->pos = 0;
+		}
+
+		length = reader->length - reader->pos;
+		if (length > size) {
+			length = size;
+		}
+
+		memcpy(data, reader->data + reader->pos, length);
+		reader->pos += length;
+		data = (char *) data + length;
+		size -= length;
+	}
+
+	return 1;
+}
+
+/**
+ * Feed the frames received from a bridge into a local buffer, until the end of stream frame,
+ * then close the local protocol.
+ *
+ * @param fd Socket connected to the sending side
+ * @param protocol Local protocol to produce into
+ * @param latencies Receives, for every item, the time from sending its frame to receiving it. May be NULL
+ * @return Number of items received, -1 if the connection failed before the end of stream
+ */
+long bridgeReceive(int fd, Protocol *protocol, Histogram *latencies)
+{
+	BridgeReader reader = { fd, malloc(BRIDGE_READ_BUFFER_SIZE), 0, 0 };
+	BridgeFrameHeader header;
+	int *items = malloc(BUFFER_SIZE * sizeof(int));
+	long long latencyNanos;
+	long itemCount = 0;
+	uint32_t i;
+
+	if (!reader.data || !items) {
+		fprintf(stderr, "Could not allocate bridge read buffers\n");
+		itemCount = -1;
+	}
+
+	while (itemCount >= 0) {
+		if (!bridgeRead(&reader, &header, sizeof(header)) || (header.itemCount > BUFFER_SIZE)
+				|| !bridgeRead(&reader, items, header.itemCount * sizeof(int))) {
+			fprintf(stderr, "Bridge connection failed or sent a malformed frame\n");
+			itemCount = -1;
+			break;
+		}
+
+		if (header.itemCount == 0) {
+			break;
+		}
+
+		if (latencies) {
+			latencyNanos = clockNowNanos() - header.sendNanos;
+			for (i = 0; i < header.itemCount; i++) {
+				histogramRecord(latencies, latencyNanos);
+			}
+		}
+
+		protocolProduceBatch(protocol, "[bridge]", items, header.itemCount);
+		itemCount += header.itemCount;
+	}
+
+	protocolClose(protocol, "[bridge]");
+
+	free(reader.data);
+	free(items);
+
+	return itemCount;
+}
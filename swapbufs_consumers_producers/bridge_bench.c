@@ -0,0 +1,346 @@
+/**
+ * bridge_bench.c
+ *
+ * Benchmark of a buffer bridged to another process (see bridge.c), over a Unix domain socket
+ * and over loopback TCP.
+ *
+ * A child process produces itemCount items into its local buffer and bridges them to this
+ * process, where a consumer drains the remote buffer. The bridge sends:
+ *
+ * 1. per_item: one frame, and one send(), per item, as a naive bridge would
+ * 2. batch: whole buffers, several of them per sendmsg() if ready at once
+ * 3. zerocopy: the same with MSG_ZEROCOPY (TCP only). Over loopback the kernel copies anyway,
+ *    so this mostly shows the cost of completion notifications
+ *
+ * Throughput is measured from connection to end of stream. Latency is from a frame being sent
+ * to it being received, recorded for every item of the frame. It doesn't include the time items
+ * wait in the local buffer before being consumed by the bridge. Items are sent as fast as they
+ * come, so batched latency is mostly the time frames queue in socket buffers.
+ *
+ * Usage: bridge_bench [itemCount] [unix|tcp|all] [per_item|batch|zerocopy|all] [producers] [protocol]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "main.h"
+
+// Largest latency recorded, in nanoseconds
+#define BENCH_MAX_LATENCY_NANOS (60 * 1000000000LL)
+
+// Precision of latency histograms, 2^-10 i.e. about 0.1%
+#define BENCH_SIGNIFICANT_BITS 11
+
+// Max number of items produced or consumed at once
+#define BENCH_BATCH_SIZE 256
+
+// A way of bridging to benchmark
+typedef struct BenchMode {
+	const char *name;
+	int bridgeFlags;
+	int isTcpOnly;
+} BenchMode;
+
+// Ways of bridging to benchmark, in order
+static const BenchMode benchModes[] = {
+	{ "per_item", BRIDGE_PER_ITEM, 0 },
+	{ "batch", 0, 0 },
+	{ "zerocopy", BRIDGE_ZEROCOPY, 1 },
+};
+
+//
+// Global (shared) variables
+//
+
+// Protocol instance of the process, local in the sending one and remote in the receiving one
+static Protocol *sharedProtocol;
+
+// Run parameters
+static long sharedItemCount;
+static int sharedProducerCount;
+
+// Number of producers done producing, the last one closes the protocol
+static int sharedFinishedProducerCount;
+
+// Number and sum of items consumed from the remote buffer
+static long sharedConsumedCount;
+static long long sharedConsumedSum;
+
+/**
+ * Producer thread task, in the sending process.
+ *
+ * Produces its share of sharedItemCount items in batches.
+ *
+ * @param threadId Id assigned to thread
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	int items[BENCH_BATCH_SIZE];
+	long itemCount = sharedItemCount / sharedProducerCount;
+	long produced = 0;
+	int batchCount;
+	int i;
+
+	// First producer also takes the remainder
+	if ((long) threadId == 0) {
+		itemCount += sharedItemCount % sharedProducerCount;
+	}
+
+	while (produced < itemCount) {
+		batchCount = (itemCount - produced < BENCH_BATCH_SIZE) ? (int) (itemCount - produced) : BENCH_BATCH_SIZE;
+		for (i = 0; i < batchCount; i++) {
+			items[i] = (int) ((produced + i) % (MAX_ITEM_VALUE + 1));
+		}
+
+		protocolProduceBatch(sharedProtocol, "[prod]", items, batchCount);
+		produced += batchCount;
+	}
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		protocolClose(sharedProtocol, "[prod]");
+	}
+
+	return 0;
+}
+
+/**
+ * Consumer thread task, in the receiving process.
+ *
+ * Drains the remote buffer, counting and summing items.
+ *
+ * @param threadId Unused
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	int items[BENCH_BATCH_SIZE];
+	int count;
+	int i;
+
+	(void) threadId;
+
+	while ((count = protocolConsumeBatch(sharedProtocol, "[cons]", items, BENCH_BATCH_SIZE)) > 0) {
+		sharedConsumedCount += count;
+		for (i = 0; i < count; i++) {
+			sharedConsumedSum += items[i];
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sending process: produce into a local buffer and bridge it to the receiving process.
+ *
+ * @param mode Way of bridging
+ * @param address Address the receiving process listens at
+ * @return Process exit status
+ */
+static int benchSend(const BenchMode *mode, const char *address)
+{
+	Buffer buffer;
+	BridgeSendStats stats;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	long i;
+	int fd;
+
+	if ((fd = bridgeConnect(address)) < 0) {
+		return 1;
+	}
+
+	if (!bufferInit(&buffer)) {
+		close(fd);
+		return 1;
+	}
+	if (!(sharedProtocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+	sharedFinishedProducerCount = 0;
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+
+	if (!bridgeSend(sharedProtocol, fd, mode->bridgeFlags, &stats)) {
+		// Producers may be stuck on a buffer nobody drains any more, leave them to _exit()
+		return 1;
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+
+	printf("  sent %ld frames in %ld sends (%.1f items/send)", stats.frameCount, stats.sendCount,
+			(double) stats.itemCount / stats.sendCount);
+	if (stats.zeroCopyCount) {
+		printf(", %ld zero copy sends, %ld completions copied", stats.zeroCopyCount, stats.copiedCount);
+	}
+	printf("\n");
+
+	close(fd);
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	free(producerThreads);
+
+	return 0;
+}
+
+/**
+ * Bridge all items from a child process into a fresh buffer of this one.
+ *
+ * @param mode Way of bridging
+ * @param transport "unix" or "tcp"
+ * @return 0 on success, 1 if items received aren't the ones produced
+ */
+static int benchRun(const BenchMode *mode, const char *transport)
+{
+	Buffer buffer;
+	Histogram latencies;
+	pthread_t consumerThread;
+	char address[128];
+	long long expectedSum = 0;
+	long long startNanos;
+	long long elapsedNanos;
+	long received;
+	int isVerified;
+	int status;
+	pid_t pid;
+	long i;
+	int listenFd;
+	int fd;
+
+	if (strcmp(transport, "unix") == 0) {
+		snprintf(address, sizeof(address), "unix:/tmp/bridge_bench.%d.sock", (int) getpid());
+	} else {
+		snprintf(address, sizeof(address), "tcp:127.0.0.1:0");
+	}
+
+	if ((listenFd = bridgeListen(address)) < 0) {
+		return 1;
+	}
+	bridgeGetAddress(listenFd, address, sizeof(address));
+
+	// Allocate before forking, so there's no sending process left waiting if this fails
+	if (!bufferInit(&buffer)) {
+		close(listenFd);
+		return 1;
+	}
+
+	// Don't let the child flush what's still buffered here
+	fflush(stdout);
+
+	if ((pid = fork()) == 0) {
+		close(listenFd);
+		status = benchSend(mode, address);
+		fflush(stdout);
+		_exit(status);
+	}
+
+	histogramInit(&latencies, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+	if (!(sharedProtocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+	sharedConsumedCount = 0;
+	sharedConsumedSum = 0;
+
+	fd = bridgeAccept(listenFd);
+	startNanos = clockNowNanos();
+
+	pthread_create(&consumerThread, NULL, benchConsumerThreadTask, NULL);
+
+	received = (fd >= 0) ? bridgeReceive(fd, sharedProtocol, &latencies) : -1;
+	if (fd < 0) {
+		protocolClose(sharedProtocol, "[bench]");
+	}
+
+	pthread_join(consumerThread, NULL);
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	waitpid(pid, &status, 0);
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		long producerItemCount = sharedItemCount / sharedProducerCount + ((i == 0) ? sharedItemCount % sharedProducerCount : 0);
+		long j;
+
+		for (j = 0; j < producerItemCount; j++) {
+			expectedSum += j % (MAX_ITEM_VALUE + 1);
+		}
+	}
+
+	isVerified = (received == sharedItemCount) && (sharedConsumedCount == sharedItemCount)
+			&& (sharedConsumedSum == expectedSum) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+
+	printf("%-5s %-9s %12.0f items/s, %8.1f ms, latency p50 %9.1f us  p99 %9.1f us  p99.9 %9.1f us  max %9.1f us%s\n",
+			transport, mode->name, sharedItemCount / (elapsedNanos / 1e9), elapsedNanos / 1e6,
+			histogramValueAtPercentile(&latencies, 50) / 1e3,
+			histogramValueAtPercentile(&latencies, 99) / 1e3,
+			histogramValueAtPercentile(&latencies, 99.9) / 1e3,
+			latencies.maxRecordedValue / 1e3,
+			isVerified ? "" : " ***** FAIL *****");
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	close(listenFd);
+	if (strcmp(transport, "unix") == 0) {
+		unlink(address + 5);
+	}
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	histogramDestroy(&latencies);
+
+	return !isVerified;
+}
+
+/**
+ * Runs the benchmark over the transports and in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	static const char *transports[] = { "unix", "tcp" };
+	const char *transportName = (argc > 2) ? argv[2] : "all";
+	const char *modeName = (argc > 3) ? argv[3] : "all";
+	int failedRunCount = 0;
+	int i;
+	int j;
+
+	sharedItemCount = (argc > 1) ? atol(argv[1]) : 2000000;
+	sharedProducerCount = (argc > 4) ? atoi(argv[4]) : 2;
+
+	if ((argc > 5) && !protocolSetDefault(argv[5])) {
+		fprintf(stderr, "Unknown protocol '%s'\n", argv[5]);
+		return 1;
+	}
+
+	printf("%ld items, %d producers, buffer size %d, up to %d buffers per sendmsg()\n",
+			sharedItemCount, sharedProducerCount, BUFFER_SIZE, BRIDGE_MAX_FRAMES);
+
+	statsInitDefault("bridge_bench");
+	statsSetEnabled(0);
+
+	for (i = 0; i < (int) (sizeof(transports) / sizeof(transports[0])); i++) {
+		if ((strcmp(transportName, transports[i]) != 0) && (strcmp(transportName, "all") != 0)) {
+			continue;
+		}
+
+		for (j = 0; j < (int) (sizeof(benchModes) / sizeof(benchModes[0])); j++) {
+			if (benchModes[j].isTcpOnly && (strcmp(transports[i], "tcp") != 0)) {
+				continue;
+			}
+			if ((strcmp(modeName, benchModes[j].name) == 0) || (strcmp(modeName, "all") == 0)) {
+				failedRunCount += benchRun(&benchModes[j], transports[i]);
+			}
+		}
+	}
+
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
@@ -1,121 +1,54 @@
 /**
  * buffer.c
- * 
+ *
  * Non thread-safe implementation of the swappable double-buffer data structure.
  *
+ * Every function operates on the Buffer instance it's given, so a program may use as many
+ * buffers as it needs (e.g. one per pipeline stage). Only initialization and release live here,
+ * the operations used by protocols are inlined from buffer.h.
+ *
  * @author Konstantinos Filios <konfilios@gmail.com>
  */
 #include "main.h"
 
-//
-// Global (shared) variables
-//
-
-// Id (0 or 1) of buffer currently used for consuming/producing respectively
-static int sharedConsumeBufferId;
-static int sharedProduceBufferId;
-
-// Current seek position for next consume/produce action in consume/produce buffers respectively
-static int sharedBufferPos[2];
-
-// The two swappable buffers keeping the integer item values
-static int sharedBuffers[2][BUFFER_SIZE];
-
-/**
- * Swaps the ids of consume/produce buffer.
- *
- * Also updates the respective seek positions.
- *
- * @param threadName Name of thread executing the buffer swap
- */
-void bufferSwap(const char *threadName)
-{
-	// Swap buffers
-	int swapBufferId = sharedConsumeBufferId;
-	sharedConsumeBufferId = sharedProduceBufferId;
-	sharedProduceBufferId = swapBufferId;
-
-	fprintf(stderr, "\t%s Swapping buffers: consume -> %d, produce -> %d\n",
-		threadName, sharedConsumeBufferId, sharedProduceBufferId);
-
-	// Fix positions
-	sharedBufferPos[sharedConsumeBufferId] = 0;
-	sharedBufferPos[sharedProduceBufferId] = 0;
-}
-
-
 /**
- * Produce a new data item into the produce buffer.
- *
- * @param threadName Name of thread producing data
- * @param data Data produced
- */
-void bufferProduceData(const char *threadName, int data)
-{
-	int seekPos = sharedBufferPos[sharedProduceBufferId];
-
-	// Push data to buffer
-	sharedBuffers[sharedProduceBufferId][seekPos] = data;
-
-	fprintf(stderr, "\t%s Wrote new item value %d to buffer[%d][%d] (%d items left in buffer)\n",
-		threadName, data, sharedProduceBufferId, seekPos, BUFFER_SIZE - seekPos - 1);
-
-	// Update produce position
-	sharedBufferPos[sharedProduceBufferId]++;
-}
-
-/**
- * Consume a data item from the consume buffer.
+ * Initialize data structure.
  *
- * @param threadName Name of thread consuming data.
- * @return Consumed data
+ * @param buffer Buffer to initialize
+ * @return 1 on success, 0 if storage could not be allocated (both buffers are left NULL)
  */
-int bufferConsumeData(const char *threadName)
+int bufferInit(Buffer *buffer)
 {
-	int data;
-	int seekPos = sharedBufferPos[sharedConsumeBufferId];
+	// Storage of both buffers, backed as set up with memorySetFlags()
+	if (!(buffer->sharedBuffers[0] = memoryAlloc("buffer", 2 * BUFFER_SIZE * sizeof(int)))) {
+		buffer->sharedBuffers[1] = NULL;
+		return 0;
+	}
+	buffer->sharedBuffers[1] = buffer->sharedBuffers[0] + BUFFER_SIZE;
 
-	data = sharedBuffers[sharedConsumeBufferId][seekPos];
+	// Initial ids of consume and produce buffers
+	buffer->sharedConsumeBufferId = 0;				// First is consume buffer
+	buffer->sharedProduceBufferId = 1;				// Second is produce buffer
 
-	fprintf(stderr, "\t%s Read item value %d from buffer[%d][%d] (%d items left in buffer)\n",
-		threadName, data, sharedConsumeBufferId, seekPos, BUFFER_SIZE - seekPos - 1);
+	// Both buffers may hold up to BUFFER_SIZE items
+	buffer->sharedBufferLength[0] = BUFFER_SIZE;
+	buffer->sharedBufferLength[1] = BUFFER_SIZE;
 
-	// Update consume position
-	sharedBufferPos[sharedConsumeBufferId]++;
+	// Current seek position in consume & produce buffer
+	buffer->sharedBufferPos[buffer->sharedConsumeBufferId] = BUFFER_SIZE;	// Consume buffer starts "full"
+	buffer->sharedBufferPos[buffer->sharedProduceBufferId] = 0;				// Produce buffer starts "empty"
 
-	return data;
+	return 1;
 }
 
 /**
- * Is consume buffer full?
+ * Release buffer storage.
  *
- * @return 1 if produce buffer is full, otherwise 0
+ * @param buffer Buffer to destroy
  */
-int bufferConsumeIsExhausted()
+void bufferDestroy(Buffer *buffer)
 {
-	return (sharedBufferPos[sharedConsumeBufferId] == BUFFER_SIZE);
-}
-
-/**
- * Is produce buffer full?
- *
- * @return 1 if produce buffer is full, otherwise 0
- */
-int bufferProduceIsExhausted()
-{
-	return (sharedBufferPos[sharedProduceBufferId] == BUFFER_SIZE);
-}
-
-/**
- * Initialize data structure.
- */
-void bufferInit()
-{
-	// Initial ids of consume and produce buffers
-	sharedConsumeBufferId = 0;				// First is consume buffer
-	sharedProduceBufferId = 1;				// Second is produce buffer
-
-	// Current seek position in consume & produce buffer
-	sharedBufferPos[sharedConsumeBufferId] = BUFFER_SIZE;		// Consume buffer starts "full"
-	sharedBufferPos[sharedProduceBufferId] = 0;					// Produce buffer starts "empty"
+	memoryFree(buffer->sharedBuffers[0]);
+	buffer->sharedBuffers[0] = NULL;
+	buffer->sharedBuffers[1] = NULL;
 }
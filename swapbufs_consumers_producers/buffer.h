@@ -0,0 +1,128 @@
+/**
+ * buffer.h
+ *
+ * Non thread-safe operations on the swappable double-buffer data structure.
+ *
+ * These are on the hot path of every protocol, so they're defined here as static inline
+ * functions and compiled into each protocol implementation including this header, rather than
+ * called across translation units. Allocation and release of buffers live in buffer.c.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "main.h"
+
+/**
+ * Swaps the ids of consume/produce buffer.
+ *
+ * Also updates the respective seek positions. The new consume buffer holds as many items as
+ * were produced into it, which is BUFFER_SIZE unless the produce buffer is flushed early.
+ *
+ * @param buffer Buffer to operate on
+ * @param threadName Name of thread executing the buffer swap
+ */
+static inline void bufferSwap(Buffer *buffer, const char *threadName)
+{
+	// Swap buffers
+	int swapBufferId = buffer->sharedConsumeBufferId;
+	buffer->sharedConsumeBufferId = buffer->sharedProduceBufferId;
+	buffer->sharedProduceBufferId = swapBufferId;
+
+	TRACE("\t%s Swapping buffers: consume -> %d, produce -> %d\n",
+		threadName, buffer->sharedConsumeBufferId, buffer->sharedProduceBufferId);
+
+	// Whatever was produced is now available for consuming
+	buffer->sharedBufferLength[buffer->sharedConsumeBufferId] = buffer->sharedBufferPos[buffer->sharedConsumeBufferId];
+	buffer->sharedBufferLength[buffer->sharedProduceBufferId] = BUFFER_SIZE;
+
+	STATS_COUNT(STATS_COUNTER_SWAPS, 1);
+	STATS_COUNT(STATS_COUNTER_SWAPPED_ITEMS, buffer->sharedBufferLength[buffer->sharedConsumeBufferId]);
+
+	// Fix positions
+	buffer->sharedBufferPos[buffer->sharedConsumeBufferId] = 0;
+	buffer->sharedBufferPos[buffer->sharedProduceBufferId] = 0;
+}
+
+/**
+ * Produce a new data item into the produce buffer.
+ *
+ * @param buffer Buffer to operate on
+ * @param threadName Name of thread producing data
+ * @param data Data produced
+ */
+static inline void bufferProduceData(Buffer *buffer, const char *threadName, int data)
+{
+	int seekPos = buffer->sharedBufferPos[buffer->sharedProduceBufferId];
+
+	// Push data to buffer
+	buffer->sharedBuffers[buffer->sharedProduceBufferId][seekPos] = data;
+
+	TRACE("\t%s Wrote new item value %d to buffer[%d][%d] (%d items left in buffer)\n",
+		threadName, data, buffer->sharedProduceBufferId, seekPos, BUFFER_SIZE - seekPos - 1);
+
+	// Update produce position
+	buffer->sharedBufferPos[buffer->sharedProduceBufferId]++;
+}
+
+/**
+ * Consume a data item from the consume buffer.
+ *
+ * @param buffer Buffer to operate on
+ * @param threadName Name of thread consuming data.
+ * @return Consumed data
+ */
+static inline int bufferConsumeData(Buffer *buffer, const char *threadName)
+{
+	int data;
+	int seekPos = buffer->sharedBufferPos[buffer->sharedConsumeBufferId];
+
+	data = buffer->sharedBuffers[buffer->sharedConsumeBufferId][seekPos];
+
+	TRACE("\t%s Read item value %d from buffer[%d][%d] (%d items left in buffer)\n",
+		threadName, data, buffer->sharedConsumeBufferId, seekPos,
+		buffer->sharedBufferLength[buffer->sharedConsumeBufferId] - seekPos - 1);
+
+	// Update consume position
+	buffer->sharedBufferPos[buffer->sharedConsumeBufferId]++;
+
+	return data;
+}
+
+/**
+ * Is consume buffer exhausted?
+ *
+ * @param buffer Buffer to operate on
+ * @return 1 if consume buffer is exhausted, otherwise 0
+ */
+static inline int bufferConsumeIsExhausted(Buffer *buffer)
+{
+	return (buffer->sharedBufferPos[buffer->sharedConsumeBufferId]
+			== buffer->sharedBufferLength[buffer->sharedConsumeBufferId]);
+}
+
+/**
+ * Is produce buffer full?
+ *
+ * @param buffer Buffer to operate on
+ * @return 1 if produce buffer is full, otherwise 0
+ */
+static inline int bufferProduceIsExhausted(Buffer *buffer)
+{
+	return (buffer->sharedBufferPos[buffer->sharedProduceBufferId] == BUFFER_SIZE);
+}
+
+/**
+ * Is produce buffer empty?
+ *
+ * @param buffer Buffer to operate on
+ * @return 1 if nothing has been produced since the last swap, otherwise 0
+ */
+static inline int bufferProduceIsEmpty(Buffer *buffer)
+{
+	return (buffer->sharedBufferPos[buffer->sharedProduceBufferId] == 0);
+}
+
+#endif
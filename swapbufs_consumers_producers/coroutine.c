@@ -0,0 +1,532 @@
+/**
+ * coroutine.c
+ *
+ * Stackful coroutines (ucontext) and a scheduler running them on one or more threads.
+ *
+ * A coroutine waiting for something (e.g. room in a buffer) is suspended and queued instead of
+ * blocking its thread, which goes on running other coroutines. Whoever makes the awaited thing
+ * happen (e.g. swaps the buffers) resumes it, putting it back on the run queue of its scheduler.
+ * So thousands of producers and consumers may run on a handful of threads.
+ *
+ * The scheduler runs coroutines on threadCount threads (the calling thread being one of them),
+ * so with a threadCount of 1 everything happens in the calling thread, without any contention.
+ * With more threads a coroutine may be resumed on a different thread than the one it got
+ * suspended on.
+ *
+ * A coroutine suspends itself while holding the lock of the queue it's waiting in, and the
+ * lock is released by its thread only once it has switched away from the coroutine. Otherwise
+ * another thread could resume the coroutine while it's still running.
+ *
+ * Thread local state follows the coroutine rather than the thread: errno is saved when switching
+ * away from a coroutine and restored when switching back to it, and each coroutine counts its
+ * stats in a slot of its own (see statsSwapCounters()), freed once it returns. Still, the
+ * compiler may keep the address of a thread local variable (errno included) in a register across
+ * a function call, so coroutines must not read errno or other thread local variables across
+ * suspensions, e.g. before and after waiting on a semaphore.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "main.h"
+
+struct Coroutine {
+	// Saved registers and stack of the coroutine while it's not running
+	ucontext_t context;
+
+	// Stack of the coroutine
+	void *stack;
+
+	// Function run by the coroutine and its argument
+	CoroutineFunction function;
+	void *arg;
+
+	// Scheduler running the coroutine
+	Scheduler *scheduler;
+
+	// Thread local state of the coroutine, saved while it's not running
+	int savedErrno;
+	StatsThreadCounters *statsCounters;
+
+	// Next coroutine in the run queue
+	Coroutine *next;
+
+	// Set once function has returned
+	int isDone;
+};
+
+// A thread of a scheduler
+typedef struct SchedulerWorker {
+	// Scheduler the thread belongs to
+	Scheduler *scheduler;
+
+	// Saved registers of the thread while it's running a coroutine
+	ucontext_t context;
+
+	// Coroutine the thread is running
+	Coroutine *current;
+
+	// Mutex to release once switched away from the current coroutine, if any
+	pthread_mutex_t *unlockAfterSwitch;
+} SchedulerWorker;
+
+struct Scheduler {
+	// Number of threads running coroutines, and the threads schedulerRun() starts besides its own
+	int threadCount;
+	pthread_t *threads;
+
+	// Mutex protecting the run queue and the live coroutine count
+	pthread_mutex_t mutex;
+
+	// Condition telling idle threads there's a coroutine to run, or none is left
+	pthread_cond_t condMayRun;
+
+	// Coroutines ready to run, in order
+	Coroutine *runQueueHead;
+	Coroutine *runQueueTail;
+
+	// Number of coroutines that haven't returned yet
+	int liveCount;
+};
+
+// Scheduler thread the calling thread is, NULL outside schedulers
+static __thread SchedulerWorker *localWorker;
+
+/**
+ * Get the scheduler thread the calling thread is.
+ *
+ * Never inlined: a coroutine may resume on a different thread than the one it got suspended
+ * on, so the address of the thread local variable must not be cached across suspensions.
+ *
+ * @return Scheduler thread, NULL outside schedulers
+ */
+static __attribute__((noinline)) SchedulerWorker *schedulerCurrentWorker()
+{
+	return localWorker;
+}
+
+/**
+ * @return Coroutine running on the calling thread, NULL if not called from a coroutine
+ */
+Coroutine *coroutineCurrent()
+{
+	SchedulerWorker *worker = schedulerCurrentWorker();
+
+	return worker ? worker->current : NULL;
+}
+
+/**
+ * Entry point of all coroutines.
+ *
+ * makecontext() only passes int arguments, so the coroutine is found through the thread instead.
+ */
+static void coroutineEntry()
+{
+	Coroutine *coroutine = coroutineCurrent();
+
+	coroutine->function(coroutine->arg);
+	coroutine->isDone = 1;
+
+	// Free the stats slot of the coroutine, if it has counted anything
+	statsUnregisterThread();
+
+	// Switch back to whatever thread we're running on, never to return
+	setcontext(&schedulerCurrentWorker()->context);
+}
+
+/**
+ * Switch from the calling coroutine back to its thread.
+ *
+ * The coroutine must have been queued somewhere first, so that it's resumed later on.
+ *
+ * @param mutex Mutex held by the caller, released once the coroutine has been switched away
+ *              from (NULL if none)
+ */
+void coroutineSuspend(pthread_mutex_t *mutex)
+{
+	SchedulerWorker *worker = schedulerCurrentWorker();
+
+	worker->unlockAfterSwitch = mutex;
+	swapcontext(&worker->current->context, &worker->context);
+}
+
+/**
+ * Put a suspended coroutine back on the run queue of its scheduler.
+ *
+ * @param coroutine Suspended coroutine
+ */
+void coroutineResume(Coroutine *coroutine)
+{
+	Scheduler *scheduler = coroutine->scheduler;
+
+	pthread_mutex_lock(&scheduler->mutex);
+
+	coroutine->next = NULL;
+	if (scheduler->runQueueTail) {
+		scheduler->runQueueTail->next = coroutine;
+	} else {
+		scheduler->runQueueHead = coroutine;
+	}
+	scheduler->runQueueTail = coroutine;
+
+	pthread_cond_signal(&scheduler->condMayRun);
+	pthread_mutex_unlock(&scheduler->mutex);
+}
+
+/**
+ * Let other coroutines run before the calling one goes on.
+ */
+void coroutineYield()
+{
+	Coroutine *coroutine = coroutineCurrent();
+	Scheduler *scheduler = coroutine->scheduler;
+
+	// Queue ourselves at the end of the run queue, and keep the run queue locked until we've
+	// been switched away from
+	pthread_mutex_lock(&scheduler->mutex);
+
+	coroutine->next = NULL;
+	if (scheduler->runQueueTail) {
+		scheduler->runQueueTail->next = coroutine;
+	} else {
+		scheduler->runQueueHead = coroutine;
+	}
+	scheduler->runQueueTail = coroutine;
+
+	pthread_cond_signal(&scheduler->condMayRun);
+
+	coroutineSuspend(&scheduler->mutex);
+}
+
+/**
+ * Set up the context of a new coroutine, so that it starts at coroutineEntry() on its own stack.
+ *
+ * Kept apart from coroutineCreate(), as getcontext() may return twice as far as the compiler
+ * knows, which puts the locals of its caller at risk.
+ *
+ * @param coroutine Coroutine whose stack has been mapped
+ */
+static __attribute__((noinline)) void coroutineInitContext(Coroutine *coroutine)
+{
+	getcontext(&coroutine->context);
+	coroutine->context.uc_stack.ss_sp = coroutine->stack;
+	coroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+	coroutine->context.uc_link = NULL;
+	makecontext(&coroutine->context, coroutineEntry, 0);
+}
+
+/**
+ * Create a coroutine, ready to run once its scheduler runs.
+ *
+ * @param scheduler Scheduler running the coroutine
+ * @param function Function run by the coroutine
+ * @param arg Argument passed to function
+ * @return New coroutine, released once function returns. NULL if out of memory
+ */
+Coroutine *coroutineCreate(Scheduler *scheduler, CoroutineFunction function, void *arg)
+{
+	Coroutine *coroutine = malloc(sizeof(Coroutine));
+
+	if (!coroutine) {
+		return NULL;
+	}
+
+	// Stacks are mapped rather than allocated, so only the pages actually used take memory
+	coroutine->stack = mmap(NULL, COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (coroutine->stack == MAP_FAILED) {
+		free(coroutine);
+		return NULL;
+	}
+
+	coroutineInitContext(coroutine);
+
+	coroutine->function = function;
+	coroutine->arg = arg;
+	coroutine->scheduler = scheduler;
+	coroutine->savedErrno = 0;
+	coroutine->statsCounters = NULL;
+	coroutine->isDone = 0;
+
+	pthread_mutex_lock(&scheduler->mutex);
+	scheduler->liveCount++;
+	pthread_mutex_unlock(&scheduler->mutex);
+
+	coroutineResume(coroutine);
+
+	return coroutine;
+}
+
+/**
+ * Scheduler thread task.
+ *
+ * Runs coroutines from the run queue until no coroutine is left.
+ *
+ * @param scheduler Scheduler the thread belongs to
+ * @return
+ */
+static void *schedulerThreadTask(void *scheduler)
+{
+	SchedulerWorker worker = { scheduler, { 0 }, NULL, NULL };
+	StatsThreadCounters *threadCounters;
+	Coroutine *coroutine;
+	pthread_mutex_t *mutex;
+
+	localWorker = &worker;
+	statsRegisterThread("[scheduler]");
+
+	while (1) {
+		pthread_mutex_lock(&worker.scheduler->mutex);
+
+		while (!worker.scheduler->runQueueHead && (worker.scheduler->liveCount > 0)) {
+			pthread_cond_wait(&worker.scheduler->condMayRun, &worker.scheduler->mutex);
+		}
+
+		coroutine = worker.scheduler->runQueueHead;
+		if (!coroutine) {
+			// All coroutines have returned
+			pthread_mutex_unlock(&worker.scheduler->mutex);
+			break;
+		}
+
+		worker.scheduler->runQueueHead = coroutine->next;
+		if (!worker.scheduler->runQueueHead) {
+			worker.scheduler->runQueueTail = NULL;
+		}
+
+		pthread_mutex_unlock(&worker.scheduler->mutex);
+
+		// Run the coroutine until it returns or gets suspended, with its own thread local state
+		worker.current = coroutine;
+		threadCounters = statsSwapCounters(coroutine->statsCounters);
+		errno = coroutine->savedErrno;
+
+		swapcontext(&worker.context, &coroutine->context);
+
+		coroutine->savedErrno = errno;
+		coroutine->statsCounters = statsSwapCounters(threadCounters);
+		worker.current = NULL;
+
+		// Now it's safe for others to resume the coroutine
+		if ((mutex = worker.unlockAfterSwitch)) {
+			worker.unlockAfterSwitch = NULL;
+			pthread_mutex_unlock(mutex);
+		}
+
+		if (coroutine->isDone) {
+			munmap(coroutine->stack, COROUTINE_STACK_SIZE);
+			free(coroutine);
+
+			pthread_mutex_lock(&worker.scheduler->mutex);
+			if (--worker.scheduler->liveCount == 0) {
+				// Let idle threads know we're done
+				pthread_cond_broadcast(&worker.scheduler->condMayRun);
+			}
+			pthread_mutex_unlock(&worker.scheduler->mutex);
+		}
+	}
+
+	localWorker = NULL;
+
+	return 0;
+}
+
+/**
+ * Create a scheduler.
+ *
+ * @param threadCount Number of threads running coroutines, including the one calling schedulerRun()
+ * @return New scheduler, NULL if out of memory
+ */
+Scheduler *schedulerCreate(int threadCount)
+{
+	Scheduler *scheduler = malloc(sizeof(Scheduler));
+
+	if (!scheduler) {
+		return NULL;
+	}
+
+	// Allocated up front, so running can't fail
+	if (!(scheduler->threads = malloc(threadCount * sizeof(pthread_t)))) {
+		free(scheduler);
+		return NULL;
+	}
+
+	scheduler->threadCount = threadCount;
+	scheduler->runQueueHead = NULL;
+	scheduler->runQueueTail = NULL;
+	scheduler->liveCount = 0;
+
+	pthread_mutex_init(&scheduler->mutex, NULL);
+	pthread_cond_init(&scheduler->condMayRun, NULL);
+
+	return scheduler;
+}
+
+/**
+ * Run coroutines until all of them have returned.
+ *
+ * @param scheduler Scheduler to run
+ */
+void schedulerRun(Scheduler *scheduler)
+{
+	int i;
+	pthread_t *threads = scheduler->threads;
+
+	for (i = 1; i < scheduler->threadCount; i++) {
+		pthread_create(&threads[i], NULL, schedulerThreadTask, scheduler);
+	}
+
+	schedulerThreadTask(scheduler);
+
+	for (i = 1; i < scheduler->threadCount; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/**
+ * Release a scheduler, once it's done running.
+ *
+ * @param scheduler Scheduler to release
+ */
+void schedulerDestroy(Scheduler *scheduler)
+{
+	pthread_mutex_destroy(&scheduler->mutex);
+	pthread_cond_destroy(&scheduler->condMayRun);
+
+	free(scheduler->threads);
+	free(scheduler);
+}
+
+/**
+ * Initialize a coroutine semaphore.
+ *
+ * @param sem Semaphore to initialize
+ * @param value Initial value
+ */
+void coroutineSemInit(CoroutineSem *sem, int value)
+{
+	pthread_mutex_init(&sem->mutex, NULL);
+	sem->value = value;
+	sem->waitersHead = NULL;
+	sem->waitersTail = NULL;
+}
+
+/**
+ * Queue a waiter at the end of the waiters of a coroutine semaphore.
+ *
+ * @param sem Semaphore, locked by the caller
+ * @param waiter Waiter to queue
+ */
+static void coroutineSemQueue(CoroutineSem *sem, CoroutineWaiter *waiter)
+{
+	waiter->isWoken = 0;
+	waiter->next = NULL;
+	if (sem->waitersTail) {
+		sem->waitersTail->next = waiter;
+	} else {
+		sem->waitersHead = waiter;
+	}
+	sem->waitersTail = waiter;
+}
+
+/**
+ * Wait on a coroutine semaphore, suspending the calling coroutine (not its thread) if needed.
+ *
+ * If not called from a coroutine, the calling thread blocks instead.
+ *
+ * @param sem Semaphore to wait on
+ */
+void coroutineSemWait(CoroutineSem *sem)
+{
+	CoroutineWaiter waiter;
+
+	pthread_mutex_lock(&sem->mutex);
+
+	if (sem->value > 0) {
+		sem->value--;
+		pthread_mutex_unlock(&sem->mutex);
+		return;
+	}
+
+	// Queue ourselves. The waiter lives on our stack, which stays put while we're suspended
+	waiter.coroutine = coroutineCurrent();
+
+	if (waiter.coroutine) {
+		// Whoever posts hands the semaphore over to us directly
+		coroutineSemQueue(sem, &waiter);
+		coroutineSuspend(&sem->mutex);
+		return;
+	}
+
+	// Threads wait on a condition of their own, so that only the one woken up by a post wakes up.
+	// The semaphore isn't handed over to threads, so that a running thread may take it meanwhile
+	// instead of waiting for the woken one to get scheduled. If so, we wait again
+	pthread_cond_init(&waiter.condWoken, NULL);
+
+	while (sem->value == 0) {
+		coroutineSemQueue(sem, &waiter);
+		while (!waiter.isWoken) {
+			pthread_cond_wait(&waiter.condWoken, &sem->mutex);
+		}
+	}
+	sem->value--;
+
+	pthread_mutex_unlock(&sem->mutex);
+	pthread_cond_destroy(&waiter.condWoken);
+}
+
+/**
+ * Post a coroutine semaphore, resuming the first coroutine or waking up the first thread waiting
+ * on it, if any.
+ *
+ * May be called from coroutines and plain threads alike.
+ *
+ * @param sem Semaphore to post
+ */
+void coroutineSemPost(CoroutineSem *sem)
+{
+	CoroutineWaiter *waiter;
+	Coroutine *resumed = NULL;
+
+	pthread_mutex_lock(&sem->mutex);
+
+	waiter = sem->waitersHead;
+	if (waiter) {
+		sem->waitersHead = waiter->next;
+		if (!sem->waitersHead) {
+			sem->waitersTail = NULL;
+		}
+	}
+
+	// Waiters live on the stack of their coroutine or thread, so don't touch them after unlocking
+	if (waiter && waiter->coroutine) {
+		resumed = waiter->coroutine;
+	} else {
+		sem->value++;
+
+		if (waiter) {
+			waiter->isWoken = 1;
+			pthread_cond_signal(&waiter->condWoken);
+		}
+	}
+
+	pthread_mutex_unlock(&sem->mutex);
+
+	if (resumed) {
+		coroutineResume(resumed);
+	}
+}
+
+/**
+ * Destroy a coroutine semaphore nobody waits on.
+ *
+ * @param sem Semaphore to destroy
+ */
+void coroutineSemDestroy(CoroutineSem *sem)
+{
+	pthread_mutex_destroy(&sem->mutex);
+}
@@ -0,0 +1,301 @@
+/**
+ * coroutine_bench.c
+ *
+ * Benchmark of thousands of producers and consumers as coroutines vs. a thread per actor.
+ *
+ * Half of actorCount actors produce itemsPerProducer items each into a single buffer, a batch at
+ * a time, and the other half consume them. The last producer done closes the protocol. Actors run:
+ *
+ * 1. coroutines: as coroutines on a single scheduler thread, over the coroutine semaphore protocol
+ *    (see three_sem.c).
+ * 2. coroutines: as coroutines on schedulerThreads threads, same protocol.
+ * 3. threads: as a thread each, over the three semaphore protocol.
+ *
+ * Usage: coroutine_bench [actorCount] [itemsPerProducer] [schedulerThreads] [batchSize] [coroutines|threads|all]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "main.h"
+
+// Stack size of actor threads, kept small so thousands of them fit in memory
+#define BENCH_STACK_SIZE (64 * 1024)
+
+//
+// Global (shared) variables
+//
+
+// Run parameters
+static int sharedProducerCount;
+static int sharedConsumerCount;
+static long sharedItemsPerProducer;
+static int sharedBatchSize;
+
+// Protocol instance under test
+static Protocol *sharedProtocol;
+
+// Number of producers done producing, the last one closes the protocol
+static int sharedFinishedProducerCount;
+
+// Number of items consumed during the run
+static long sharedConsumedCount;
+
+/**
+ * Producer actor, run as a coroutine or a thread.
+ *
+ * @param actorId Id assigned to actor
+ */
+static void benchProducer(void *actorId)
+{
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long produced;
+	int batchCount;
+	int i;
+
+	if (!items) {
+		// Nobody would close the protocol without us
+		fprintf(stderr, "Could not allocate producer batch\n");
+		exit(1);
+	}
+
+	for (produced = 0; produced < sharedItemsPerProducer; produced += batchCount) {
+		batchCount = (sharedItemsPerProducer - produced < sharedBatchSize)
+				? (int) (sharedItemsPerProducer - produced) : sharedBatchSize;
+		for (i = 0; i < batchCount; i++) {
+			items[i] = (int) ((produced + i) % (MAX_ITEM_VALUE + 1));
+		}
+
+		protocolProduceBatch(sharedProtocol, "[prod]", items, batchCount);
+	}
+
+	free(items);
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		protocolClose(sharedProtocol, "[prod]");
+	}
+}
+
+/**
+ * Consumer actor, run as a coroutine or a thread.
+ *
+ * @param actorId Id assigned to actor
+ */
+static void benchConsumer(void *actorId)
+{
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long consumed = 0;
+	int count;
+
+	if (!items) {
+		// Items left unconsumed would block producers for good
+		fprintf(stderr, "Could not allocate consumer batch\n");
+		exit(1);
+	}
+
+	while ((count = protocolConsumeBatch(sharedProtocol, "[cons]", items, sharedBatchSize)) > 0) {
+		consumed += count;
+	}
+
+	free(items);
+
+	__sync_fetch_and_add(&sharedConsumedCount, consumed);
+}
+
+/**
+ * Producer thread task, for the thread per actor mode.
+ *
+ * @param actorId Id assigned to thread
+ * @return
+ */
+static void *benchProducerThreadTask(void *actorId)
+{
+	benchProducer(actorId);
+
+	return 0;
+}
+
+/**
+ * Consumer thread task, for the thread per actor mode.
+ *
+ * @param actorId Id assigned to thread
+ * @return
+ */
+static void *benchConsumerThreadTask(void *actorId)
+{
+	benchConsumer(actorId);
+
+	return 0;
+}
+
+/**
+ * Run all actors as coroutines.
+ *
+ * @param threadCount Number of scheduler threads
+ * @return 0 on success, 1 if actors could not be created
+ */
+static int benchRunCoroutines(int threadCount)
+{
+	long i;
+	Scheduler *scheduler = schedulerCreate(threadCount);
+
+	if (!scheduler) {
+		fprintf(stderr, "Could not create scheduler\n");
+		return 1;
+	}
+
+	// Interleave consumers and producers, so both get going right away
+	for (i = 0; (i < sharedProducerCount) || (i < sharedConsumerCount); i++) {
+		if ((i < sharedConsumerCount) && !coroutineCreate(scheduler, benchConsumer, (void *) i)) {
+			fprintf(stderr, "Could not create consumer coroutine %ld\n", i);
+			return 1;
+		}
+		if ((i < sharedProducerCount) && !coroutineCreate(scheduler, benchProducer, (void *) i)) {
+			fprintf(stderr, "Could not create producer coroutine %ld\n", i);
+			return 1;
+		}
+	}
+
+	schedulerRun(scheduler);
+	schedulerDestroy(scheduler);
+
+	return 0;
+}
+
+/**
+ * Run each actor as a thread. Exits if actors could not be created.
+ *
+ * @return 0
+ */
+static int benchRunThreads()
+{
+	long i;
+	pthread_attr_t attr;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	pthread_t *consumerThreads = malloc(sharedConsumerCount * sizeof(pthread_t));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+
+	for (i = 0; i < sharedConsumerCount; i++) {
+		if (pthread_create(&consumerThreads[i], &attr, benchConsumerThreadTask, (void *) i) != 0) {
+			fprintf(stderr, "Could not create consumer thread %ld\n", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < sharedProducerCount; i++) {
+		if (pthread_create(&producerThreads[i], &attr, benchProducerThreadTask, (void *) i) != 0) {
+			fprintf(stderr, "Could not create producer thread %ld\n", i);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	for (i = 0; i < sharedConsumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+
+	pthread_attr_destroy(&attr);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return 0;
+}
+
+/**
+ * Push all items through a fresh buffer.
+ *
+ * @param threadCount Number of scheduler threads, 0 for a thread per actor
+ * @return 0 on success, 1 if items got lost
+ */
+static int benchRun(int threadCount)
+{
+	Buffer buffer;
+	char label[32];
+	long long startNanos;
+	long long elapsedNanos;
+	struct rusage startUsage;
+	struct rusage endUsage;
+	long expectedCount = sharedProducerCount * sharedItemsPerProducer;
+
+	if (!bufferInit(&buffer)) {
+		return 1;
+	}
+	if (!(sharedProtocol = protocolFind(threadCount ? "coroutine" : "three_sem")->create(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+	sharedFinishedProducerCount = 0;
+	sharedConsumedCount = 0;
+
+	getrusage(RUSAGE_SELF, &startUsage);
+	startNanos = clockNowNanos();
+
+	if (threadCount ? benchRunCoroutines(threadCount) : benchRunThreads()) {
+		exit(1);
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+	getrusage(RUSAGE_SELF, &endUsage);
+
+	if (threadCount) {
+		sprintf(label, "coroutines/%d", threadCount);
+	} else {
+		strcpy(label, "threads");
+	}
+
+	printf("%-14s %12.0f items/s, %8.1f ms, %8ld context switches%s\n", label,
+			sharedConsumedCount / (elapsedNanos / 1e9), elapsedNanos / 1e6,
+			(endUsage.ru_nvcsw + endUsage.ru_nivcsw) - (startUsage.ru_nvcsw + startUsage.ru_nivcsw),
+			(sharedConsumedCount != expectedCount) ? " ***** FAIL *****" : "");
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+
+	return sharedConsumedCount != expectedCount;
+}
+
+/**
+ * Runs the benchmark in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	int actorCount;
+	int schedulerThreadCount;
+	const char *mode;
+	int failedRunCount = 0;
+
+	actorCount = (argc > 1) ? atoi(argv[1]) : 10000;
+	sharedItemsPerProducer = (argc > 2) ? atol(argv[2]) : 1000;
+	schedulerThreadCount = (argc > 3) ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	sharedBatchSize = (argc > 4) ? atoi(argv[4]) : 16;
+	mode = (argc > 5) ? argv[5] : "all";
+
+	sharedProducerCount = actorCount / 2;
+	sharedConsumerCount = actorCount - sharedProducerCount;
+
+	printf("%d producers, %d consumers, %ld items per producer, batch size %d, buffer size %d\n",
+			sharedProducerCount, sharedConsumerCount, sharedItemsPerProducer, sharedBatchSize, BUFFER_SIZE);
+
+	statsInitDefault("coroutine_bench");
+	statsSetEnabled(0);
+
+	if ((strcmp(mode, "coroutines") == 0) || (strcmp(mode, "all") == 0)) {
+		failedRunCount += benchRun(1);
+		if (schedulerThreadCount > 1) {
+			failedRunCount += benchRun(schedulerThreadCount);
+		}
+	}
+	if ((strcmp(mode, "threads") == 0) || (strcmp(mode, "all") == 0)) {
+		failedRunCount += benchRun(0);
+	}
+
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
@@ -0,0 +1,380 @@
+/**
+ * event_fd.c
+ *
+ * Thread-safe wrapper of buffer.h signaling readiness on file descriptors, so that consumers
+ * and producers may be driven by an event loop (epoll, io_uring etc.) multiplexing thousands of
+ * buffers on a few threads, rather than each blocking a thread of its own:
+ * 1. mutex: Protects critical section (buffer manipulation)
+ * 2. consumeFd: eventfd becoming readable when a consume buffer is swapped in, or on close
+ * 3. produceFd: eventfd becoming readable when the produce buffer is swapped out
+ *
+ * Event loops call protocolTryConsumeBatch()/protocolTryProduceBatch(), which never block, until
+ * they return PROTOCOL_WOULD_BLOCK (or fewer items than asked for), and then wait for the
+ * respective descriptor. Descriptors are level-triggered and stay readable until a try call
+ * finds nothing to do, so they work with plain poll()/epoll as well.
+ *
+ * Notifications are coalesced: a descriptor is written only on a buffer swap (i.e. once per
+ * BUFFER_SIZE items, no matter the batch sizes) and only if it isn't readable already, so an
+ * event loop wakes up at most once per swap and queue.
+ *
+ * The blocking protocol functions work as well, by waiting on the descriptors with poll().
+ * Picked by name "eventfd" (see protocol.c).
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "buffer.h"
+
+typedef struct EventFdProtocol {
+	// Common protocol state, including the buffer protected by this protocol instance
+	Protocol base;
+
+	// Mutex regulating exclusive access to buffer manipulation sections (critical sections)
+	pthread_mutex_t sharedMutex;
+
+	// Descriptor telling consumers they can proceed with consuming items
+	int sharedConsumeFd;
+
+	// Descriptor telling producers they can proceed with producing items
+	int sharedProduceFd;
+
+	// Are the descriptors readable right now? Protected by the mutex
+	int sharedIsConsumeSignaled;
+	int sharedIsProduceSignaled;
+
+	// Set once producers are done, so consumers may drain a partially filled produce buffer
+	int sharedClosed;
+} EventFdProtocol;
+
+/**
+ * Make a descriptor readable, unless it's readable already. Mutex must be held.
+ *
+ * @param fd Descriptor to signal
+ * @param isSignaled Whether fd is readable, updated
+ */
+static void eventFdNotify(int fd, int *isSignaled)
+{
+	uint64_t one = 1;
+
+	if (!*isSignaled) {
+		*isSignaled = 1;
+		if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+			perror("eventfd write");
+		}
+		STATS_COUNT(STATS_COUNTER_NOTIFICATIONS, 1);
+	}
+}
+
+/**
+ * Make a descriptor non-readable. Mutex must be held.
+ *
+ * Only called after finding out there's nothing to do, so that any later state change notifies
+ * again and no wake-up is ever lost.
+ *
+ * @param fd Descriptor to clear
+ * @param isSignaled Whether fd is readable, updated
+ */
+static void eventFdClear(int fd, int *isSignaled)
+{
+	uint64_t value;
+
+	if (*isSignaled) {
+		*isSignaled = 0;
+		if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+			perror("eventfd read");
+		}
+	}
+}
+
+/**
+ * Swap buffers and notify both consumers and producers. Mutex must be held.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread executing the buffer swap
+ */
+static void eventFdSwap(EventFdProtocol *protocol, const char *threadName)
+{
+	bufferSwap(protocol->base.buffer, threadName);
+
+	TRACE("\t%s Notifying consumers and producers\n", threadName);
+
+	eventFdNotify(protocol->sharedConsumeFd, &protocol->sharedIsConsumeSignaled);
+	eventFdNotify(protocol->sharedProduceFd, &protocol->sharedIsProduceSignaled);
+}
+
+/**
+ * Produce up to count data items into the produce buffer, without blocking.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param items Data produced
+ * @param count Number of items
+ * @return Number of items produced. If less than count, wait on the produce descriptor
+ */
+static int eventFdTryProduceBatch(Protocol *baseProtocol, const char *threadName, const int *items, int count)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int produced = 0;
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	while (produced < count) {
+		if (bufferProduceIsExhausted(buffer)) {
+			if (!bufferConsumeIsExhausted(buffer)) {
+				// Consumers still busy, no room left
+				break;
+			}
+
+			TRACE("\t%s Both buffers exhausted\n", threadName);
+
+			eventFdSwap(protocol, threadName);
+		}
+
+		// Push as much data as fits to buffer
+		while ((produced < count) && !bufferProduceIsExhausted(buffer)) {
+			bufferProduceData(buffer, threadName, items[produced++]);
+		}
+	}
+
+	STATS_COUNT(STATS_COUNTER_PRODUCED_ITEMS, produced);
+
+	// Hand a full produce buffer over right away if consumers are waiting for it
+	if (bufferProduceIsExhausted(buffer) && bufferConsumeIsExhausted(buffer)) {
+		eventFdSwap(protocol, threadName);
+	}
+
+	if (produced < count) {
+		TRACE("\t%s Produce buffer full, producers will have to wait\n", threadName);
+
+		eventFdClear(protocol->sharedProduceFd, &protocol->sharedIsProduceSignaled);
+	}
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+
+	return produced;
+}
+
+/**
+ * Consume up to maxCount data items from the consume buffer, without blocking.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed,
+ *         PROTOCOL_WOULD_BLOCK if there's nothing to consume yet
+ */
+static int eventFdTryConsumeBatch(Protocol *baseProtocol, const char *threadName, int *items, int maxCount)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int count = 0;
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	while (bufferConsumeIsExhausted(buffer)) {
+		if (bufferProduceIsExhausted(buffer)) {
+			TRACE("\t%s Both buffers exhausted\n", threadName);
+
+			eventFdSwap(protocol, threadName);
+		} else if (protocol->sharedClosed) {
+			if (bufferProduceIsEmpty(buffer)) {
+				// Nothing will ever be produced again. The descriptor stays readable, so
+				// everybody finds out
+				TRACE("\t%s End of stream\n", threadName);
+
+				pthread_mutex_unlock(&protocol->sharedMutex);
+
+				return 0;
+			}
+
+			TRACE("\t%s Produce buffer closed, flushing it to consumers\n", threadName);
+
+			eventFdSwap(protocol, threadName);
+		} else {
+			TRACE("\t%s Produce buffer still active, consumers will have to wait\n", threadName);
+
+			eventFdClear(protocol->sharedConsumeFd, &protocol->sharedIsConsumeSignaled);
+			pthread_mutex_unlock(&protocol->sharedMutex);
+
+			return PROTOCOL_WOULD_BLOCK;
+		}
+	}
+
+	// Pop data from buffer
+	while ((count < maxCount) && !bufferConsumeIsExhausted(buffer)) {
+		items[count++] = bufferConsumeData(buffer, threadName);
+	}
+
+	STATS_COUNT(STATS_COUNTER_CONSUMED_ITEMS, count);
+
+	// Let blocked producers go on right away if they've been waiting for us
+	if (bufferConsumeIsExhausted(buffer) && bufferProduceIsExhausted(buffer)) {
+		eventFdSwap(protocol, threadName);
+	}
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+
+	return count;
+}
+
+/**
+ * Safely produce a batch of data items, waiting on the produce descriptor whenever full.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param items Data produced
+ * @param count Number of items
+ */
+static void eventFdProduceBatch(Protocol *baseProtocol, const char *threadName, const int *items, int count)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+	int produced = 0;
+
+	while ((produced += eventFdTryProduceBatch(baseProtocol, threadName, items + produced, count - produced)) < count) {
+		TRACE("%s Waiting on produce descriptor\n", threadName);
+
+		STATS_FD_WAIT(protocol->sharedProduceFd, STATS_SEM_MAY_PRODUCE);
+	}
+}
+
+/**
+ * Safely consume up to maxCount data items, waiting on the consume descriptor if there's nothing
+ * to consume.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed
+ */
+static int eventFdConsumeBatch(Protocol *baseProtocol, const char *threadName, int *items, int maxCount)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+	int count;
+
+	while ((count = eventFdTryConsumeBatch(baseProtocol, threadName, items, maxCount)) == PROTOCOL_WOULD_BLOCK) {
+		TRACE("%s Waiting on consume descriptor\n", threadName);
+
+		STATS_FD_WAIT(protocol->sharedConsumeFd, STATS_SEM_MAY_CONSUME);
+	}
+
+	return count;
+}
+
+/**
+ * Tell consumers no more data will be produced.
+ *
+ * Must be called once, after all producers are done producing. Consumers will consume whatever
+ * is left in the buffer and then receive end of stream.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread closing the protocol
+ */
+static void eventFdClose(Protocol *baseProtocol, const char *threadName)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Closing produce buffer\n", threadName);
+
+	protocol->sharedClosed = 1;
+
+	// Consumers will flush the produce buffer or find out the stream has ended
+	eventFdNotify(protocol->sharedConsumeFd, &protocol->sharedIsConsumeSignaled);
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+}
+
+/**
+ * @param baseProtocol Protocol instance
+ * @return Descriptor becoming readable once consumers may proceed
+ */
+static int eventFdGetConsumeFd(Protocol *baseProtocol)
+{
+	return ((EventFdProtocol *) baseProtocol)->sharedConsumeFd;
+}
+
+/**
+ * @param baseProtocol Protocol instance
+ * @return Descriptor becoming readable once producers may proceed
+ */
+static int eventFdGetProduceFd(Protocol *baseProtocol)
+{
+	return ((EventFdProtocol *) baseProtocol)->sharedProduceFd;
+}
+
+/**
+ * Initializes shared variables, mutex and descriptors.
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @return New protocol instance, NULL if out of memory or descriptors
+ */
+static Protocol *eventFdCreate(Buffer *buffer)
+{
+	EventFdProtocol *protocol = malloc(sizeof(EventFdProtocol));
+
+	if (!protocol) {
+		return NULL;
+	}
+
+	protocol->base.ops = &eventFdProtocolOps;
+	protocol->base.buffer = buffer;
+	protocol->sharedClosed = 0;
+
+	// Nothing to consume yet, and producers find out there's room by trying
+	protocol->sharedIsConsumeSignaled = 0;
+	protocol->sharedIsProduceSignaled = 0;
+	protocol->sharedConsumeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	protocol->sharedProduceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if ((protocol->sharedConsumeFd < 0) || (protocol->sharedProduceFd < 0)) {
+		perror("eventfd");
+		if (protocol->sharedConsumeFd >= 0) {
+			close(protocol->sharedConsumeFd);
+		}
+		free(protocol);
+		return NULL;
+	}
+
+	pthread_mutex_init(&protocol->sharedMutex, NULL);
+
+	return &protocol->base;
+}
+
+/**
+ * Closes descriptors and releases protocol memory.
+ *
+ * @param baseProtocol Protocol instance no longer used by any thread
+ */
+static void eventFdDestroy(Protocol *baseProtocol)
+{
+	EventFdProtocol *protocol = (EventFdProtocol *) baseProtocol;
+
+	pthread_mutex_destroy(&protocol->sharedMutex);
+	close(protocol->sharedConsumeFd);
+	close(protocol->sharedProduceFd);
+
+	free(protocol);
+}
+
+// Event file descriptor protocol implementation
+const ProtocolOps eventFdProtocolOps = {
+	"eventfd",
+	eventFdCreate,
+	eventFdDestroy,
+	eventFdConsumeBatch,
+	eventFdProduceBatch,
+	eventFdClose,
+	eventFdTryConsumeBatch,
+	eventFdTryProduceBatch,
+	eventFdGetConsumeFd,
+	eventFdGetProduceFd
+};
@@ -0,0 +1,276 @@
+/**
+ * handoff_bench.c
+ *
+ * Benchmark of buffer handoff latency, in the default blocking mode vs. low latency mode (see
+ * latency.c).
+ *
+ * A producer fills exactly one buffer every period, so each batch is swapped and handed off to
+ * an idle consumer right away. Every item is the id of its handoff, indexing a table of the time
+ * the producer started producing it, and consumers record, once per handoff, the time from then
+ * until they got its first item. The period leaves consumers idle in between, so what's measured
+ * is how fast a waiting consumer gets going again:
+ *
+ * 1. blocking: consumers sleep in sem_wait() and are woken up by the producer
+ * 2. low_latency: producer and consumers run with SCHED_FIFO, memory is locked and consumers
+ *    busy-poll the consume semaphore. Whatever isn't permitted is left out with a warning
+ *
+ * Usage: handoff_bench [handoffCount] [periodMicros] [consumers] [blocking|low_latency|all]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include "main.h"
+
+// Largest latency recorded, in nanoseconds
+#define BENCH_MAX_LATENCY_NANOS (60 * 1000000000LL)
+
+// Precision of latency histograms, 2^-10 i.e. about 0.1%
+#define BENCH_SIGNIFICANT_BITS 11
+
+// A mode to benchmark
+typedef struct BenchMode {
+	const char *name;
+
+	// Low latency flags of the process, its producer and its consumers
+	int flags;
+	int producerFlags;
+	int consumerFlags;
+} BenchMode;
+
+// Modes to benchmark, in order
+static const BenchMode benchModes[] = {
+	{ "blocking", 0, 0, 0 },
+	{ "low_latency", LATENCY_MLOCKALL, LATENCY_SCHED_FIFO, LATENCY_SCHED_FIFO | LATENCY_BUSY_POLL },
+};
+
+//
+// Global (shared) variables
+//
+
+// Protocol instance under test
+static Protocol *sharedProtocol;
+
+// Run parameters
+static const BenchMode *sharedMode;
+static int sharedHandoffCount;
+static long long sharedPeriodNanos;
+
+// Time the producer started producing each handoff, by handoff id
+static long long *sharedSentNanos;
+
+// Low latency flags actually in effect, over all threads
+static int sharedThreadFlags;
+
+// Handoff latencies, merged by consumers once done under sharedMutex
+static Histogram sharedHistogram;
+static pthread_mutex_t sharedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Producer thread task.
+ *
+ * Fills a buffer with the id of the handoff every period.
+ *
+ * @param threadId Unused
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	int *items = malloc(BUFFER_SIZE * sizeof(int));
+	long long startNanos;
+	int handoffId;
+	int i;
+
+	(void) threadId;
+
+	__sync_fetch_and_or(&sharedThreadFlags, latencyEnterThread(sharedMode->producerFlags));
+
+	// Wake up as close to the intended time as possible
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	// Leave some time for consumers to start waiting
+	startNanos = clockNowNanos() + 10000000LL;
+
+	for (handoffId = 0; handoffId < sharedHandoffCount; handoffId++) {
+		clockSleepUntilNanos(startNanos + handoffId * sharedPeriodNanos);
+
+		for (i = 0; i < BUFFER_SIZE; i++) {
+			items[i] = handoffId;
+		}
+
+		sharedSentNanos[handoffId] = clockNowNanos();
+		protocolProduceBatch(sharedProtocol, "[prod]", items, BUFFER_SIZE);
+	}
+
+	protocolClose(sharedProtocol, "[prod]");
+	free(items);
+
+	return 0;
+}
+
+/**
+ * Consumer thread task.
+ *
+ * Records the latency of every handoff it gets the first items of.
+ *
+ * @param threadId Unused
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	Histogram histogram;
+	int *items = malloc(BUFFER_SIZE * sizeof(int));
+	long long nowNanos;
+	int lastHandoffId = -1;
+	int count;
+
+	(void) threadId;
+
+	__sync_fetch_and_or(&sharedThreadFlags, latencyEnterThread(sharedMode->consumerFlags));
+
+	histogramInit(&histogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+
+	while ((count = protocolConsumeBatch(sharedProtocol, "[cons]", items, BUFFER_SIZE)) > 0) {
+		nowNanos = clockNowNanos();
+
+		// With several consumers, a handoff may be split among them. Only whoever gets to its send
+		// time first records it
+		if (items[0] != lastHandoffId) {
+			long long sentNanos = __atomic_exchange_n(&sharedSentNanos[items[0]], -1LL, __ATOMIC_RELAXED);
+
+			if (sentNanos >= 0) {
+				histogramRecord(&histogram, nowNanos - sentNanos);
+			}
+			lastHandoffId = items[0];
+		}
+	}
+
+	pthread_mutex_lock(&sharedMutex);
+	histogramMerge(&sharedHistogram, &histogram);
+	pthread_mutex_unlock(&sharedMutex);
+
+	histogramDestroy(&histogram);
+	free(items);
+
+	return 0;
+}
+
+/**
+ * Describe low latency flags.
+ *
+ * @param flags Low latency flags
+ * @param names Receives the names of flags, comma separated
+ * @param size Size of names
+ */
+static void benchFlagNames(int flags, char *names, size_t size)
+{
+	snprintf(names, size, "%s%s%s%s", flags ? "" : "sem_wait",
+			(flags & LATENCY_SCHED_FIFO) ? "fifo," : "",
+			(flags & LATENCY_MLOCKALL) ? "mlockall," : "",
+			(flags & LATENCY_BUSY_POLL) ? "busy_poll," : "");
+
+	if (flags) {
+		// Drop the trailing comma
+		names[strlen(names) - 1] = '\0';
+	}
+}
+
+/**
+ * Run all handoffs through a fresh buffer in a mode.
+ *
+ * @param mode Mode
+ * @param consumerCount Number of consumers
+ * @return 0 on success, 1 if not all handoffs got through
+ */
+static int benchRun(const BenchMode *mode, int consumerCount)
+{
+	Buffer buffer;
+	pthread_t producerThread;
+	pthread_t *consumerThreads = malloc(consumerCount * sizeof(pthread_t));
+	char flagNames[64];
+	int flags;
+	int isSucceeded;
+	long i;
+
+	sharedMode = mode;
+	sharedThreadFlags = 0;
+	memset(sharedSentNanos, 0, sharedHandoffCount * sizeof(long long));
+	histogramInit(&sharedHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+
+	// Lock memory before allocating the buffer, so it's locked as well
+	flags = latencyInit(mode->flags);
+
+	if (!bufferInit(&buffer)) {
+		return 1;
+	}
+	if (!(sharedProtocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+
+	for (i = 0; i < consumerCount; i++) {
+		pthread_create(&consumerThreads[i], NULL, benchConsumerThreadTask, (void *) i);
+	}
+	pthread_create(&producerThread, NULL, benchProducerThreadTask, NULL);
+
+	pthread_join(producerThread, NULL);
+	for (i = 0; i < consumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+
+	flags |= sharedThreadFlags;
+	isSucceeded = (sharedHistogram.totalCount == sharedHandoffCount);
+
+	benchFlagNames(flags, flagNames, sizeof(flagNames));
+
+	printf("%-12s %-24s p50 %8.2f us  p90 %8.2f us  p99 %8.2f us  p99.9 %8.2f us  max %9.2f us%s\n",
+			mode->name, flagNames,
+			histogramValueAtPercentile(&sharedHistogram, 50) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 90) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 99) / 1e3,
+			histogramValueAtPercentile(&sharedHistogram, 99.9) / 1e3,
+			sharedHistogram.maxRecordedValue / 1e3,
+			isSucceeded ? "" : " ***** FAIL *****");
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	latencyDestroy();
+	histogramDestroy(&sharedHistogram);
+	free(consumerThreads);
+
+	return !isSucceeded;
+}
+
+/**
+ * Runs the benchmark in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	int consumerCount = (argc > 3) ? atoi(argv[3]) : 1;
+	const char *modeName = (argc > 4) ? argv[4] : "all";
+	int failedRunCount = 0;
+	int i;
+
+	sharedHandoffCount = (argc > 1) ? atoi(argv[1]) : 20000;
+	sharedPeriodNanos = (argc > 2) ? atol(argv[2]) * 1000LL : 200000LL;
+	sharedSentNanos = malloc(sharedHandoffCount * sizeof(long long));
+
+	printf("%d handoffs of %d items every %.0f us, %d consumers\n",
+			sharedHandoffCount, BUFFER_SIZE, sharedPeriodNanos / 1e3, consumerCount);
+
+	statsInitDefault("handoff_bench");
+	statsSetEnabled(0);
+
+	for (i = 0; i < (int) (sizeof(benchModes) / sizeof(benchModes[0])); i++) {
+		if ((strcmp(modeName, benchModes[i].name) == 0) || (strcmp(modeName, "all") == 0)) {
+			failedRunCount += benchRun(&benchModes[i], consumerCount);
+		}
+	}
+
+	statsDestroy();
+	free(sharedSentNanos);
+
+	return failedRunCount ? 1 : 0;
+}
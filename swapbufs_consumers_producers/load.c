@@ -0,0 +1,125 @@
+/**
+ * load.c
+ *
+ * Arrival schedules for open-loop load generation.
+ *
+ * A producer pushing items as fast as the buffer lets it slows down whenever the buffer stalls,
+ * so the items that should have been sent meanwhile are never sent, and latencies measured
+ * hide the backlog (coordinated omission). Instead, a schedule decides when each item is meant
+ * to be sent, regardless of how the buffer is doing. A producer falling behind sends the items
+ * due right away, and latency is measured from the intended send time, so stalls are charged to
+ * every item they delay.
+ *
+ * Schedules:
+ * 1. constant: evenly spaced items
+ * 2. poisson: exponentially distributed gaps, i.e. independent arrivals
+ * 3. bursty: evenly spaced items during on periods of LOAD_BURST_ON_MS, none during off periods
+ *    of LOAD_BURST_OFF_MS, the same mean rate overall
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <math.h>
+#include <string.h>
+#include "main.h"
+
+// On and off periods of bursty schedules, in milliseconds
+#ifndef LOAD_BURST_ON_MS
+#define LOAD_BURST_ON_MS 10
+#endif
+
+#ifndef LOAD_BURST_OFF_MS
+#define LOAD_BURST_OFF_MS 40
+#endif
+
+// Schedule names, by kind
+static const char *loadScheduleNames[] = { "constant", "poisson", "bursty", NULL };
+
+/**
+ * Draw a uniformly distributed random number (xorshift64*).
+ *
+ * @param schedule Schedule whose generator to use
+ * @return Random number in (0, 1]
+ */
+static double loadRandom(LoadSchedule *schedule)
+{
+	schedule->randomState ^= schedule->randomState >> 12;
+	schedule->randomState ^= schedule->randomState << 25;
+	schedule->randomState ^= schedule->randomState >> 27;
+
+	return ((schedule->randomState * 2685821657736338717ULL >> 11) + 1) / 9007199254740992.0;
+}
+
+/**
+ * Initialize an arrival schedule.
+ *
+ * @param schedule Schedule to initialize
+ * @param kind LOAD_CONSTANT, LOAD_POISSON or LOAD_BURSTY
+ * @param rate Mean number of items per second
+ * @param startNanos Time of the first item, as returned by clockNowNanos()
+ * @param seed Random seed, different for every producer
+ */
+void loadScheduleInit(LoadSchedule *schedule, int kind, double rate, long long startNanos, unsigned long long seed)
+{
+	schedule->kind = kind;
+	schedule->rate = rate;
+	schedule->onNanos = LOAD_BURST_ON_MS * 1000000LL;
+	schedule->offNanos = LOAD_BURST_OFF_MS * 1000000LL;
+	schedule->nextNanos = startNanos;
+	schedule->periodStartNanos = startNanos;
+	schedule->randomState = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+/**
+ * Get the intended send time of the next item.
+ *
+ * @param schedule Schedule
+ * @return Time the next item is meant to be sent at, as returned by clockNowNanos()
+ */
+long long loadScheduleNext(LoadSchedule *schedule)
+{
+	long long intendedNanos = schedule->nextNanos;
+	double burstRate;
+
+	switch (schedule->kind) {
+	case LOAD_POISSON:
+		schedule->nextNanos += (long long) (-log(loadRandom(schedule)) / schedule->rate * 1e9);
+		break;
+
+	case LOAD_BURSTY:
+		// Send faster during on periods to make up for off periods
+		burstRate = schedule->rate * (schedule->onNanos + schedule->offNanos) / schedule->onNanos;
+		schedule->nextNanos += (long long) (1e9 / burstRate);
+
+		if (schedule->nextNanos >= schedule->periodStartNanos + schedule->onNanos) {
+			schedule->periodStartNanos += schedule->onNanos + schedule->offNanos;
+			schedule->nextNanos = schedule->periodStartNanos;
+		}
+		break;
+
+	default:
+		schedule->nextNanos += (long long) (1e9 / schedule->rate);
+		break;
+	}
+
+	return intendedNanos;
+}
+
+/**
+ * Find a schedule kind by name.
+ *
+ * @param name "constant", "poisson" or "bursty"
+ * @return Schedule kind, -1 if there's no such schedule
+ */
+int loadScheduleKind(const char *name)
+{
+	int kind;
+
+	for (kind = 0; loadScheduleNames[kind]; kind++) {
+		if (strcmp(loadScheduleNames[kind], name) == 0) {
+			return kind;
+		}
+	}
+
+	return -1;
+}
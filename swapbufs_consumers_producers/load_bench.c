@@ -0,0 +1,283 @@
+/**
+ * load_bench.c
+ *
+ * Open-loop latency benchmark of a protocol (see load.c).
+ *
+ * Producers send items on an arrival schedule (constant rate, Poisson or bursty on/off) for a
+ * number of seconds, whether the buffer keeps up or not. Every item is an id into tables holding
+ * the time it was meant to be sent and the time it was actually sent, so consumers measure:
+ *
+ * 1. Latency from intended send time to consumption. Stalls of the buffer are charged to every
+ *    item they delay, including the ones producers couldn't send meanwhile. This is the latency
+ *    to trust.
+ * 2. Latency from actual send time to consumption, as a closed-loop benchmark would measure it.
+ *    It leaves out the time items waited for producers stuck in the buffer, so it's only shown
+ *    for comparison.
+ *
+ * Note that consumers only get items once the produce buffer is full and swapped, so at low
+ * rates items wait for the buffer to fill up: about BUFFER_SIZE / rate.
+ *
+ * The first distribution is also written in HdrHistogram percentile format (microseconds), to
+ * stdout or to the file given.
+ *
+ * Usage: load_bench [constant|poisson|bursty] [rate] [seconds] [producers] [consumers] [protocol] [histogramFile]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include "main.h"
+
+// Largest latency recorded, in nanoseconds
+#define BENCH_MAX_LATENCY_NANOS (60 * 1000000000LL)
+
+// Precision of latency histograms, 2^-10 i.e. about 0.1%
+#define BENCH_SIGNIFICANT_BITS 11
+
+// Max number of items consumed at once
+#define BENCH_BATCH_SIZE 16
+
+//
+// Global (shared) variables
+//
+
+// Protocol instance under test
+static Protocol *sharedProtocol;
+
+// Run parameters
+static int sharedScheduleKind;
+static double sharedRate;
+static int sharedProducerCount;
+static long long sharedStartNanos;
+static long long sharedEndNanos;
+
+// Intended and actual send time of every item, by item id
+static long long *sharedIntendedNanos;
+static long long *sharedSentNanos;
+static int sharedItemCapacity;
+
+// Id of the next item to send
+static int sharedNextItemId;
+
+// Number of producers done producing, the last one closes the protocol
+static int sharedFinishedProducerCount;
+
+// Latencies from intended and from actual send time, merged by consumers once done under sharedMutex
+static Histogram sharedIntendedHistogram;
+static Histogram sharedSentHistogram;
+static pthread_mutex_t sharedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Producer thread task.
+ *
+ * Sends items on its share of the schedule, sleeping until each one is due unless it's late already.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it and seed its schedule
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	LoadSchedule schedule;
+	long long intendedNanos;
+	int itemId;
+	char threadName[64];
+
+	sprintf(threadName, "[prod %3ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	// Wake up as close to the intended time as possible
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	loadScheduleInit(&schedule, sharedScheduleKind, sharedRate / sharedProducerCount, sharedStartNanos,
+			(unsigned long long) (long) threadId + 1);
+
+	while ((intendedNanos = loadScheduleNext(&schedule)) < sharedEndNanos) {
+		if (intendedNanos > clockNowNanos()) {
+			clockSleepUntilNanos(intendedNanos);
+		}
+
+		if ((itemId = __sync_fetch_and_add(&sharedNextItemId, 1)) >= sharedItemCapacity) {
+			break;
+		}
+
+		sharedIntendedNanos[itemId] = intendedNanos;
+		sharedSentNanos[itemId] = clockNowNanos();
+
+		protocolProduceData(sharedProtocol, threadName, itemId);
+	}
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		protocolClose(sharedProtocol, threadName);
+	}
+
+	return 0;
+}
+
+/**
+ * Consumer thread task.
+ *
+ * Records the latency of every item consumed, from its intended and from its actual send time.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	Histogram intendedHistogram;
+	Histogram sentHistogram;
+	int items[BENCH_BATCH_SIZE];
+	long long nowNanos;
+	int count;
+	int i;
+	char threadName[64];
+
+	sprintf(threadName, "[cons %3ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	histogramInit(&intendedHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+	histogramInit(&sentHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+
+	while ((count = protocolConsumeBatch(sharedProtocol, threadName, items, BENCH_BATCH_SIZE)) > 0) {
+		nowNanos = clockNowNanos();
+
+		for (i = 0; i < count; i++) {
+			histogramRecord(&intendedHistogram, nowNanos - sharedIntendedNanos[items[i]]);
+			histogramRecord(&sentHistogram, nowNanos - sharedSentNanos[items[i]]);
+		}
+	}
+
+	pthread_mutex_lock(&sharedMutex);
+	histogramMerge(&sharedIntendedHistogram, &intendedHistogram);
+	histogramMerge(&sharedSentHistogram, &sentHistogram);
+	pthread_mutex_unlock(&sharedMutex);
+
+	histogramDestroy(&intendedHistogram);
+	histogramDestroy(&sentHistogram);
+
+	return 0;
+}
+
+/**
+ * Print a one line summary of a latency distribution.
+ *
+ * @param label Label of distribution
+ * @param histogram Latencies in nanoseconds
+ */
+static void benchPrintSummary(const char *label, const Histogram *histogram)
+{
+	printf("%-20s p50 %10.1f us  p90 %10.1f us  p99 %10.1f us  p99.9 %10.1f us  p99.99 %10.1f us  max %10.1f us\n",
+			label,
+			histogramValueAtPercentile(histogram, 50) / 1e3,
+			histogramValueAtPercentile(histogram, 90) / 1e3,
+			histogramValueAtPercentile(histogram, 99) / 1e3,
+			histogramValueAtPercentile(histogram, 99.9) / 1e3,
+			histogramValueAtPercentile(histogram, 99.99) / 1e3,
+			histogram->maxRecordedValue / 1e3);
+}
+
+/**
+ * Runs the schedule asked for and prints latency distributions.
+ */
+int main(int argc, char *argv[])
+{
+	const char *scheduleName = (argc > 1) ? argv[1] : "poisson";
+	double seconds = (argc > 3) ? atof(argv[3]) : 5;
+	int consumerCount = (argc > 5) ? atoi(argv[5]) : 2;
+	FILE *histogramFile = stdout;
+	Buffer buffer;
+	pthread_t *producerThreads;
+	pthread_t *consumerThreads;
+	long long elapsedNanos;
+	long i;
+
+	sharedRate = (argc > 2) ? atof(argv[2]) : 200000;
+	sharedProducerCount = (argc > 4) ? atoi(argv[4]) : 2;
+
+	if ((sharedScheduleKind = loadScheduleKind(scheduleName)) < 0) {
+		fprintf(stderr, "Unknown schedule '%s'\n", scheduleName);
+		return 1;
+	}
+	if ((argc > 6) && !protocolSetDefault(argv[6])) {
+		fprintf(stderr, "Unknown protocol '%s'\n", argv[6]);
+		return 1;
+	}
+	if ((argc > 7) && !(histogramFile = fopen(argv[7], "w"))) {
+		perror(argv[7]);
+		return 1;
+	}
+
+	// Room for every item scheduled, with plenty of margin for Poisson arrivals
+	sharedItemCapacity = (int) (sharedRate * seconds * 1.2) + 1024;
+	sharedIntendedNanos = malloc(sharedItemCapacity * sizeof(long long));
+	sharedSentNanos = malloc(sharedItemCapacity * sizeof(long long));
+	sharedNextItemId = 0;
+	sharedFinishedProducerCount = 0;
+
+	histogramInit(&sharedIntendedHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+	histogramInit(&sharedSentHistogram, BENCH_MAX_LATENCY_NANOS, BENCH_SIGNIFICANT_BITS);
+
+	printf("%s schedule, %.0f items/s for %.1f s, %d producers, %d consumers, buffer size %d\n",
+			scheduleName, sharedRate, seconds, sharedProducerCount, consumerCount, BUFFER_SIZE);
+
+	statsInitDefault("load_bench");
+	statsSetEnabled(0);
+
+	if (!bufferInit(&buffer)) {
+		return 1;
+	}
+	if (!(sharedProtocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+
+	producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	consumerThreads = malloc(consumerCount * sizeof(pthread_t));
+
+	// Leave some time for threads to start before the first item is due
+	sharedStartNanos = clockNowNanos() + 10000000LL;
+	sharedEndNanos = sharedStartNanos + (long long) (seconds * 1e9);
+
+	for (i = 0; i < consumerCount; i++) {
+		pthread_create(&consumerThreads[i], NULL, benchConsumerThreadTask, (void *) i);
+	}
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	for (i = 0; i < consumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+
+	elapsedNanos = clockNowNanos() - sharedStartNanos;
+
+	printf("Sent %lld items at %.0f items/s (%.1f%% of the rate asked for)\n",
+			sharedIntendedHistogram.totalCount, sharedIntendedHistogram.totalCount / (elapsedNanos / 1e9),
+			100 * sharedIntendedHistogram.totalCount / (elapsedNanos / 1e9) / sharedRate);
+	benchPrintSummary("From intended time", &sharedIntendedHistogram);
+	benchPrintSummary("From actual send", &sharedSentHistogram);
+
+	if (histogramFile == stdout) {
+		printf("\nLatency from intended send time (us):\n");
+	}
+	histogramPrint(&sharedIntendedHistogram, histogramFile, 1e3);
+	if (histogramFile != stdout) {
+		fclose(histogramFile);
+	}
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	statsDestroy();
+
+	histogramDestroy(&sharedIntendedHistogram);
+	histogramDestroy(&sharedSentHistogram);
+	free(sharedIntendedNanos);
+	free(sharedSentNanos);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return 0;
+}
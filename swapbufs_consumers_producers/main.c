@@ -17,6 +17,16 @@
 #include <unistd.h>
 #include "main.h"
 
+//
+// Global (shared) variables
+//
+
+// The swappable double buffer shared by producers and consumers
+static Buffer sharedBuffer;
+
+// Protocol instance protecting sharedBuffer
+static Protocol *sharedProtocol;
+
 /**
  * Producer thread task.
  *
@@ -32,13 +42,17 @@ void *producerThreadTask(void *threadId)
 
 	// Compile thread name
 	sprintf(threadName, "[prod %3ld]", (long)threadId);
+	statsRegisterThread(threadName);
+
+	// Producers never busy-poll, so they don't hold up consumers sharing their CPU
+	latencyEnterThread(LATENCY_FLAGS & LATENCY_SCHED_FIFO);
 
 	while (1) {
 		// Produce number
 		data = (int) ((double) rand() / RAND_MAX * MAX_ITEM_VALUE);
 
 		// Add it in the produce buffer
-		protocolProduceData(threadName, data);
+		protocolProduceData(sharedProtocol, threadName, data);
 	}
 
 	return 0;
@@ -59,10 +73,12 @@ void *consumerThreadTask(void *threadId)
 
 	// Compile thread name
 	sprintf(threadName, "[cons %3ld]", (long)threadId);
+	statsRegisterThread(threadName);
+	latencyEnterThread(LATENCY_FLAGS);
 
 	while (1) {
 		// Consume number
-		data = protocolConsumeData(threadName);
+		data = protocolConsumeData(sharedProtocol, threadName);
 	}
 
 	return 0;
@@ -75,8 +91,20 @@ void *consumerThreadTask(void *threadId)
  */
 int main()
 {
-	bufferInit();
-	protocolInit();
+	// Collect contention statistics, dumped periodically, on SIGUSR1 and readable by stats_view
+	statsInitDefault("swapbufs");
+	statsStartDumper(STATS_DUMP_PERIOD_MS);
+
+	// Lock memory before allocating the buffer, so it's locked as well
+	latencyInit(LATENCY_FLAGS);
+
+	if (!bufferInit(&sharedBuffer)) {
+		return 1;
+	}
+	if (!(sharedProtocol = protocolCreate(&sharedBuffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
 
 	//
 	// Create producer and consumer threads and let them start work.
@@ -9,50 +9,535 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
+#include "../common/common.h"
 
 //
 // Configurable constants. Feel free to try different combinations. Avoid 0 values :)
+// All of them may also be overridden at compile time, e.g. gcc -DBUFFER_SIZE=1024 ...
 //
 
 // Number of producer threads to create
+#ifndef PRODUCERS_COUNT
 #define PRODUCERS_COUNT 3
+#endif
 
 // Number of consumer threads to create
+#ifndef CONSUMERS_COUNT
 #define CONSUMERS_COUNT 3
+#endif
 
 // Size of each buffer
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 10
+#endif
 
 // Max value of produced integer items
+#ifndef MAX_ITEM_VALUE
 #define MAX_ITEM_VALUE 300
+#endif
+
+// Print a trace message for every buffer/protocol step. Benchmarks compile with -DVERBOSE=0
+#ifndef VERBOSE
+#define VERBOSE 1
+#endif
+
+// Trace message printing, compiled away when VERBOSE is 0
+#define TRACE(...) do { if (VERBOSE) fprintf(stderr, __VA_ARGS__); } while (0)
+
+// Value returned by protocolConsumeData() once the stream is closed and fully consumed.
+// Produced items are never negative, so it can't be mistaken for an item.
+#define END_OF_STREAM -1
 
 //
-// Buffer functions
+// Buffer data structure
 //
-void bufferSwap(const char *threadName);
+typedef struct Buffer {
+	// Id (0 or 1) of buffer currently used for consuming/producing respectively
+	int sharedConsumeBufferId;
+	int sharedProduceBufferId;
 
-void bufferProduceData(const char *threadName, int data);
+	// Current seek position for next consume/produce action in consume/produce buffers respectively
+	int sharedBufferPos[2];
 
-int bufferConsumeData(const char *threadName);
+	// Number of valid items in each buffer. Less than BUFFER_SIZE only if a partially filled
+	// produce buffer had to be swapped in after the producers were done
+	int sharedBufferLength[2];
 
-int bufferConsumeIsExhausted();
+	// The two swappable buffers keeping the integer item values. Both point into a single
+	// allocation of 2 * BUFFER_SIZE items (see memory.c)
+	int *sharedBuffers[2];
+} Buffer;
 
-int bufferProduceIsExhausted();
+//
+// Buffer functions. The operations used by protocols are inlined from buffer.h
+//
+int bufferInit(Buffer *buffer);
 
-void bufferInit();
+void bufferDestroy(Buffer *buffer);
 
 //
 // Protocol functions
 //
 
+typedef struct ProtocolOps ProtocolOps;
+
+// Protocol state wrapping a single buffer. Each protocol implementation extends it with its own
+// state, starting with this struct
+typedef struct Protocol {
+	// Implementation in charge of this instance
+	const ProtocolOps *ops;
+
+	// Buffer protected by this protocol instance
+	Buffer *buffer;
+} Protocol;
+
+// A protocol implementation. Every implementation compiled in is listed in protocol.c, so
+// programs may pick one by name at runtime. Buffer operations are inlined into each of them
+// (see buffer.h), so the only indirect call is the one per batch below
+struct ProtocolOps {
+	// Name to pick the implementation by
+	const char *name;
+
+	// One-time initialization function, returns NULL on failure
+	Protocol *(*create)(Buffer *buffer);
+
+	// Release protocol resources once all threads are done with it
+	void (*destroy)(Protocol *protocol);
+
+	// Read up to maxCount values at once. Returns number of values read, 0 on end of stream
+	int (*consumeBatch)(Protocol *protocol, const char *threadName, int *items, int maxCount);
+
+	// Produce count values at once
+	void (*produceBatch)(Protocol *protocol, const char *threadName, const int *items, int count);
+
+	// Signal that no more data will be produced, so consumers may drain the buffer and stop
+	void (*close)(Protocol *protocol, const char *threadName);
+
+	// Non-blocking variants for event loops, NULL unless the implementation signals readiness on
+	// file descriptors. Consume returns PROTOCOL_WOULD_BLOCK if there's nothing to consume yet,
+	// produce returns the number of items that fit
+	int (*tryConsumeBatch)(Protocol *protocol, const char *threadName, int *items, int maxCount);
+	int (*tryProduceBatch)(Protocol *protocol, const char *threadName, const int *items, int count);
+
+	// File descriptors becoming readable once consuming/producing may proceed
+	int (*getConsumeFd)(Protocol *protocol);
+	int (*getProduceFd)(Protocol *protocol);
+};
+
+// Returned by protocolTryConsumeBatch() when a consumer would have to wait
+#define PROTOCOL_WOULD_BLOCK -1
+
+// Implementation used by protocolCreate() unless changed with protocolSetDefault()
+#ifndef PROTOCOL_DEFAULT
+#define PROTOCOL_DEFAULT "three_sem"
+#endif
+
+// Protocol implementations
+extern const ProtocolOps threeSemProtocolOps;
+extern const ProtocolOps mutexCondProtocolOps;
+extern const ProtocolOps eventFdProtocolOps;
+extern const ProtocolOps coroutineProtocolOps;
+
+// All protocol implementations, NULL terminated
+extern const ProtocolOps *protocolOpsTable[];
+
 // Read value function
-int protocolConsumeData(const char *threadName);
+int protocolConsumeData(Protocol *protocol, const char *threadName);
 
 // Produce data function
-void protocolProduceData(const char *threadName, int data);
+void protocolProduceData(Protocol *protocol, const char *threadName, int data);
+
+// Read up to maxCount values at once. Returns number of values read, 0 on end of stream
+int protocolConsumeBatch(Protocol *protocol, const char *threadName, int *items, int maxCount);
+
+// Produce count values at once
+void protocolProduceBatch(Protocol *protocol, const char *threadName, const int *items, int count);
+
+// Signal that no more data will be produced, so consumers may drain the buffer and stop
+void protocolClose(Protocol *protocol, const char *threadName);
+
+// One-time initialization function, using the default implementation
+Protocol *protocolCreate(Buffer *buffer);
+
+// Release protocol resources once all threads are done with it
+void protocolDestroy(Protocol *protocol);
+
+// Read up to maxCount values without blocking. Returns PROTOCOL_WOULD_BLOCK if nothing is ready
+int protocolTryConsumeBatch(Protocol *protocol, const char *threadName, int *items, int maxCount);
+
+// Produce up to count values without blocking. Returns number of values produced
+int protocolTryProduceBatch(Protocol *protocol, const char *threadName, const int *items, int count);
+
+// File descriptor to poll before trying to consume/produce again, -1 if not supported
+int protocolGetConsumeFd(Protocol *protocol);
+int protocolGetProduceFd(Protocol *protocol);
+
+// Find an implementation by name. Returns NULL if there's no such implementation
+const ProtocolOps *protocolFind(const char *name);
+
+// Set the implementation used by protocolCreate(). Returns 0 if there's no such implementation
+int protocolSetDefault(const char *name);
+
+//
+// Stats ids of the protocols (see ../common/stats.c)
+//
+
+// Instrumented semaphores of the protocols
+enum {
+	STATS_SEM_MUTEX,
+	STATS_SEM_MAY_PRODUCE,
+	STATS_SEM_MAY_CONSUME,
+	STATS_SEM_COUNT
+};
+
+// Counters of the protocols
+enum {
+	STATS_COUNTER_SWAPS,
+	STATS_COUNTER_SWAPPED_ITEMS,
+	STATS_COUNTER_PRODUCED_ITEMS,
+	STATS_COUNTER_CONSUMED_ITEMS,
+	STATS_COUNTER_NOTIFICATIONS,
+	STATS_COUNTER_COUNT
+};
+
+// Names of the semaphores and counters above, and the counter each one is divided by when printed
+#define STATS_SEM_NAMES { "mutex", "mayProduce", "mayConsume" }
+#define STATS_COUNTER_NAMES { "swaps", "swappedItems", "produced", "consumed", "notifications" }
+#define STATS_COUNTER_PER { -1, STATS_COUNTER_SWAPS, -1, -1, -1 }
+
+
+//
+// Pipeline functions
+//
+
+// Max number of stages chained in a pipeline
+#ifndef PIPELINE_MAX_STAGES
+#define PIPELINE_MAX_STAGES 8
+#endif
+
+// Work done by a pipeline stage on a batch of items. Source stages get a NULL inItems and are
+// asked for up to inCount items, returning 0 when they run out. Other stages must not write
+// more than inCount items into outItems. Returns number of items written into outItems.
+typedef int (*StageFunction)(void *stageArg, const int *inItems, int inCount, int *outItems);
+
+typedef struct PipelineStage PipelineStage;
+
+// A single thread of a pipeline stage
+typedef struct PipelineWorker {
+	PipelineStage *stage;
+	char threadName[64];
+
+	// Batches consumed and produced, batchSize items each
+	int *inItems;
+	int *outItems;
+} PipelineWorker;
+
+struct PipelineStage {
+	const char *name;
+	int threadCount;
+	StageFunction function;
+	void *stageArg;
+	int batchSize;
+
+	// Queues connecting the stage with the previous and next ones (NULL for first/last stage)
+	Protocol *input;
+	Protocol *output;
+
+	PipelineWorker *workers;
+	pthread_t *threads;
+
+	// Statistics summed up by the stage threads once they are done, under semStatsMutex
+	sem_t semStatsMutex;
+	int finishedThreadCount;
+	long long itemsIn;
+	long long itemsOut;
+	long long busyNanos;
+	long long waitInNanos;
+	long long waitOutNanos;
+};
+
+typedef struct Pipeline {
+	int stageCount;
+	int batchSize;
+	PipelineStage stages[PIPELINE_MAX_STAGES];
+
+	// Buffer between stage i and stage i + 1
+	Buffer *buffers[PIPELINE_MAX_STAGES - 1];
+
+	long long startNanos;
+	long long endNanos;
+} Pipeline;
+
+void pipelineInit(Pipeline *pipeline, int batchSize);
+
+int pipelineAddStage(Pipeline *pipeline, const char *name, int threadCount,
+		StageFunction function, void *stageArg);
+
+int pipelineStart(Pipeline *pipeline);
+
+void pipelineJoin(Pipeline *pipeline);
+
+void pipelinePrintStats(Pipeline *pipeline, FILE *out);
+
+void pipelineDestroy(Pipeline *pipeline);
+
+//
+// Load generation functions
+//
+
+// Arrival schedules
+enum {
+	LOAD_CONSTANT,
+	LOAD_POISSON,
+	LOAD_BURSTY
+};
+
+// When items are meant to be sent, regardless of when the buffer actually lets them through
+typedef struct LoadSchedule {
+	int kind;
+
+	// Mean number of items per second
+	double rate;
+
+	// Bursty schedules send for onNanos at rate * (onNanos + offNanos) / onNanos, then pause for offNanos
+	long long onNanos;
+	long long offNanos;
+
+	// Intended time of the last item, and start of the current on period
+	long long nextNanos;
+	long long periodStartNanos;
+
+	// Random number generator state, for Poisson arrivals
+	unsigned long long randomState;
+} LoadSchedule;
+
+void loadScheduleInit(LoadSchedule *schedule, int kind, double rate, long long startNanos, unsigned long long seed);
+
+long long loadScheduleNext(LoadSchedule *schedule);
+
+int loadScheduleKind(const char *name);
+
+//
+// Sink functions
+//
+
+// Size of the blocks items are written to files in, a multiple of 4096 for direct I/O
+#ifndef SINK_BLOCK_SIZE
+#define SINK_BLOCK_SIZE (1024 * 1024)
+#endif
+
+// Number of blocks per sink, i.e. up to SINK_QUEUE_DEPTH - 1 blocks written while filling another
+#ifndef SINK_QUEUE_DEPTH
+#define SINK_QUEUE_DEPTH 8
+#endif
+
+// Sink flags
+#define SINK_DIRECT 1
+#define SINK_PWRITEV 2
+
+// How a sink actually writes, after any fallbacks
+enum {
+	SINK_MODE_IO_URING,
+	SINK_MODE_PWRITEV
+};
+
+typedef struct Sink Sink;
+
+Sink *sinkCreate(const char *path, int flags);
+
+void sinkWrite(Sink *sink, const int *items, int count);
+
+// Flush, sync and release the sink. Returns 0 if any write failed
+int sinkClose(Sink *sink);
+
+int sinkGetMode(Sink *sink);
+
+const char *sinkModeName(int mode);
+
+//
+// Partition functions
+//
+
+// Max number of consumers ever joined to a partitioned queue at once
+#ifndef PARTITION_MAX_CONSUMERS
+#define PARTITION_MAX_CONSUMERS 64
+#endif
+
+typedef struct PartitionedQueue PartitionedQueue;
+
+// A consumer of a partitioned queue, draining the partitions it holds
+typedef struct PartitionConsumer {
+	PartitionedQueue *queue;
+	int consumerId;
+
+	// Descriptor telling the consumer to look at partition assignments again
+	int wakeupFd;
+
+	// Value of queue generation when partitions held were last looked at
+	int seenGeneration;
+
+	// Partitions held and not ended yet, and where to resume consuming from
+	int *heldPartitions;
+	int heldCount;
+	int cursor;
+	struct pollfd *pollFds;
+} PartitionConsumer;
+
+struct PartitionedQueue {
+	int partitionCount;
+	Buffer *buffers;
+	Protocol **protocols;
+
+	// Mutex protecting consumers and partition assignments
+	pthread_mutex_t mutex;
+
+	// Consumer each partition is assigned to, and consumer actually holding it (-1 for none)
+	int *assignedConsumers;
+	int *holdingConsumers;
+
+	// Set by the holding consumer once a partition is closed and drained
+	int *isEnded;
+	int endedCount;
+
+	int isConsumerActive[PARTITION_MAX_CONSUMERS];
+	PartitionConsumer consumers[PARTITION_MAX_CONSUMERS];
+
+	// Bumped on every assignment or holding change, read without locking
+	int generation;
+
+	// Rebalance pauses, from a change of consumers until every partition is held by its new consumer
+	int isRebalancing;
+	long long rebalanceStartNanos;
+	int rebalanceCount;
+	long long rebalanceTotalNanos;
+	long long rebalanceMaxNanos;
+};
+
+int partitionedInit(PartitionedQueue *queue, int partitionCount);
+
+int partitionOf(PartitionedQueue *queue, int key);
+
+void partitionedProduceBatch(PartitionedQueue *queue, const char *threadName, int key, const int *items, int count);
+
+void partitionedClose(PartitionedQueue *queue, const char *threadName);
+
+PartitionConsumer *partitionedJoin(PartitionedQueue *queue);
+
+void partitionedLeave(PartitionConsumer *consumer);
+
+int partitionedConsumeBatch(PartitionConsumer *consumer, const char *threadName, int *items, int maxCount, int *partitionId);
+
+void partitionedDestroy(PartitionedQueue *queue);
+
+//
+// Coroutine functions
+//
+
+// Stack size of each coroutine. Stacks are mapped lazily, so only the pages used take memory
+#ifndef COROUTINE_STACK_SIZE
+#define COROUTINE_STACK_SIZE (32 * 1024)
+#endif
+
+typedef struct Coroutine Coroutine;
+typedef struct Scheduler Scheduler;
+
+// Function run by a coroutine
+typedef void (*CoroutineFunction)(void *arg);
+
+// A coroutine (or plain thread, if coroutine is NULL) waiting on a coroutine semaphore. Threads
+// block on condWoken until isWoken is set
+typedef struct CoroutineWaiter {
+	Coroutine *coroutine;
+	int isWoken;
+	pthread_cond_t condWoken;
+	struct CoroutineWaiter *next;
+} CoroutineWaiter;
+
+// Semaphore suspending the waiting coroutine instead of blocking its thread. Plain threads may
+// use it as well, blocking on a condition of their own
+typedef struct CoroutineSem {
+	pthread_mutex_t mutex;
+	int value;
+	CoroutineWaiter *waitersHead;
+	CoroutineWaiter *waitersTail;
+} CoroutineSem;
+
+// Create a scheduler running coroutines on threadCount threads, the one calling schedulerRun()
+// included. Returns NULL if out of memory
+Scheduler *schedulerCreate(int threadCount);
+
+// Run coroutines until all of them have returned
+void schedulerRun(Scheduler *scheduler);
+
+void schedulerDestroy(Scheduler *scheduler);
+
+// Create a coroutine, run once the scheduler runs. Returns NULL if out of memory
+Coroutine *coroutineCreate(Scheduler *scheduler, CoroutineFunction function, void *arg);
+
+// Coroutine running on the calling thread, NULL if not called from a coroutine
+Coroutine *coroutineCurrent();
+
+// Switch away from the calling coroutine, releasing mutex (if not NULL) once switched away
+void coroutineSuspend(pthread_mutex_t *mutex);
+
+// Put a suspended coroutine back on the run queue of its scheduler
+void coroutineResume(Coroutine *coroutine);
+
+// Let other coroutines run before the calling one goes on
+void coroutineYield();
+
+void coroutineSemInit(CoroutineSem *sem, int value);
+
+void coroutineSemWait(CoroutineSem *sem);
+
+void coroutineSemPost(CoroutineSem *sem);
+
+void coroutineSemDestroy(CoroutineSem *sem);
+
+//
+// Bridge functions
+//
+
+// Max number of frames, i.e. whole buffers, gathered into a single sendmsg()
+#ifndef BRIDGE_MAX_FRAMES
+#define BRIDGE_MAX_FRAMES 8
+#endif
+
+// Bridge flags
+#define BRIDGE_PER_ITEM 1
+#define BRIDGE_ZEROCOPY 2
+
+// What the sending side of a bridge did
+typedef struct BridgeSendStats {
+	long itemCount;
+	long frameCount;
+
+	// Number of sendmsg()/send() calls
+	long sendCount;
+
+	// Number of zero copy sendmsg() calls, and of completions for which the kernel copied after all
+	long zeroCopyCount;
+	long copiedCount;
+} BridgeSendStats;
+
+// Listen at "unix:/path" or "tcp:host:port". Returns the listening socket, -1 on failure
+int bridgeListen(const char *address);
+
+// Address to connect to a listening socket at, with the actual port if listening at port 0
+void bridgeGetAddress(int listenFd, char *address, size_t size);
+
+int bridgeAccept(int listenFd);
+
+int bridgeConnect(const char *address);
+
+// Drain protocol into fd until protocol is closed and drained. Returns 0 on failure
+int bridgeSend(Protocol *protocol, int fd, int flags, BridgeSendStats *stats);
 
-// One-time initialization function
-void protocolInit();
+// Produce what's received from fd into protocol until the stream ends, then close protocol.
+// Returns the number of items received, -1 on failure
+long bridgeReceive(int fd, Protocol *protocol, Histogram *latencies);
 
 #endif  /* MAIN_H */
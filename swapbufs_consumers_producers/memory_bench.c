@@ -0,0 +1,244 @@
+/**
+ * memory_bench.c
+ *
+ * Benchmark of buffer memory backing (see memory.c): regular lazily faulted pages vs. huge,
+ * pre-faulted and locked pages.
+ *
+ * Compile with a large BUFFER_SIZE, so the buffer spans many pages. For each backing, a fresh
+ * buffer is allocated and a single thread pushes items through the protocol, producing a whole
+ * buffer in batches and then consuming it, so that it never blocks and every batch measures
+ * nothing but the cost of going through the buffer. It reports:
+ *
+ * 1. The time it takes to allocate (and possibly pre-fault) the buffer.
+ * 2. Page faults and data TLB misses while pushing items through (perf_event_open(), reported as
+ *    n/a if hardware counters aren't available, e.g. in a VM, or perf_event_paranoid forbids it).
+ * 3. The latency distribution of produce/consume batch calls, up to p99.9 and max.
+ *
+ * Usage: memory_bench [itemCount] [batchSize]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "main.h"
+
+// A backing to benchmark
+typedef struct BenchMode {
+	const char *name;
+	int memoryFlags;
+} BenchMode;
+
+// Backings to benchmark, in order
+static const BenchMode benchModes[] = {
+	{ "regular pages", 0 },
+	{ "huge pages", MEMORY_HUGE_PAGES },
+	{ "huge + prefault", MEMORY_HUGE_PAGES | MEMORY_PREFAULT },
+	{ "huge + prefault + lock", MEMORY_HUGE_PAGES | MEMORY_PREFAULT | MEMORY_LOCK },
+};
+
+/**
+ * Open a counter of the calling thread, disabled.
+ *
+ * @return Counter file descriptor, -1 if not available
+ */
+static int benchCounterOpen(int type, long long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Format the value of a counter.
+ *
+ * @param fd Counter file descriptor, -1 if not available
+ * @param text Receives the formatted value
+ */
+static void benchCounterFormat(int fd, char *text)
+{
+	long long value;
+
+	if ((fd < 0) || (read(fd, &value, sizeof(value)) != sizeof(value))) {
+		strcpy(text, "n/a");
+	} else {
+		sprintf(text, "%lld", value);
+	}
+}
+
+/**
+ * Compare latencies, for qsort().
+ */
+static int benchCompareNanos(const void *a, const void *b)
+{
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Push itemCount items through a fresh buffer backed according to mode.
+ *
+ * @param mode Backing to benchmark
+ * @param itemCount Number of items, rounded down to whole buffers
+ * @param batchSize Number of items per produce/consume call
+ * @param latencyNanos Receives the latency of every batch call
+ * @return 0 on success, 1 if items got lost or corrupted
+ */
+static int benchRun(const BenchMode *mode, long itemCount, int batchSize, long long *latencyNanos)
+{
+	int i;
+	int count;
+	int fds[3];
+	char texts[3][32];
+	long pos;
+	long sampleCount = 0;
+	long pushedCount = 0;
+	long long producedSum = 0;
+	long long consumedSum = 0;
+	long long startNanos;
+	long long initNanos;
+	long long elapsedNanos;
+	int *items = malloc(batchSize * sizeof(int));
+	Buffer buffer;
+	Protocol *protocol;
+
+	memorySetFlags(mode->memoryFlags);
+
+	startNanos = clockNowNanos();
+	if (!bufferInit(&buffer)) {
+		free(items);
+		return 1;
+	}
+	initNanos = clockNowNanos() - startNanos;
+
+	if (!(protocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+
+	fds[0] = benchCounterOpen(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+	fds[1] = benchCounterOpen(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	fds[2] = benchCounterOpen(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+			| (PERF_COUNT_HW_CACHE_OP_WRITE << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0) {
+			ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	startNanos = clockNowNanos();
+
+	while (pushedCount + BUFFER_SIZE <= itemCount) {
+		// Fill the produce buffer. The last batch swaps it in for consuming
+		for (pos = 0; pos < BUFFER_SIZE; pos += count) {
+			count = (BUFFER_SIZE - pos < batchSize) ? (int) (BUFFER_SIZE - pos) : batchSize;
+			for (i = 0; i < count; i++) {
+				items[i] = (int) ((pos + i) % (MAX_ITEM_VALUE + 1));
+				producedSum += items[i];
+			}
+
+			latencyNanos[sampleCount] = clockNowNanos();
+			protocolProduceBatch(protocol, "[bench]", items, count);
+			latencyNanos[sampleCount] = clockNowNanos() - latencyNanos[sampleCount];
+			sampleCount++;
+		}
+
+		// Drain it
+		for (pos = 0; pos < BUFFER_SIZE; pos += count) {
+			latencyNanos[sampleCount] = clockNowNanos();
+			count = protocolConsumeBatch(protocol, "[bench]", items, batchSize);
+			latencyNanos[sampleCount] = clockNowNanos() - latencyNanos[sampleCount];
+			sampleCount++;
+
+			for (i = 0; i < count; i++) {
+				consumedSum += items[i];
+			}
+		}
+
+		pushedCount += BUFFER_SIZE;
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0) {
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+		benchCounterFormat(fds[i], texts[i]);
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+
+	qsort(latencyNanos, sampleCount, sizeof(long long), benchCompareNanos);
+
+	printf("%-24s %-24s %8.2f %12.0f %10s %12s %12s %6lld %6lld %7lld %8lld%s\n",
+			mode->name, memoryBackingName(memoryGetBacking(buffer.sharedBuffers[0])),
+			initNanos / 1e6, pushedCount / (elapsedNanos / 1e9),
+			texts[0], texts[1], texts[2],
+			latencyNanos[sampleCount / 2], latencyNanos[sampleCount * 99 / 100],
+			latencyNanos[sampleCount * 999 / 1000], latencyNanos[sampleCount - 1],
+			(producedSum != consumedSum) ? " ***** FAIL *****" : "");
+
+	protocolDestroy(protocol);
+	bufferDestroy(&buffer);
+	free(items);
+
+	return producedSum != consumedSum;
+}
+
+/**
+ * Runs the benchmark for every backing.
+ */
+int main(int argc, char *argv[])
+{
+	long itemCount = (argc > 1) ? atol(argv[1]) : 8L * BUFFER_SIZE;
+	int batchSize = (argc > 2) ? atoi(argv[2]) : 64;
+	int failedRunCount = 0;
+	long sampleCapacity;
+	long long *latencyNanos;
+	unsigned i;
+
+	if (itemCount < BUFFER_SIZE) {
+		itemCount = BUFFER_SIZE;
+	}
+
+	// Two calls per batch, plus one per buffer for the last, partial batches
+	sampleCapacity = 2 * (itemCount / batchSize + itemCount / BUFFER_SIZE) + 2;
+	latencyNanos = malloc(sampleCapacity * sizeof(long long));
+
+	// Fault the samples in, so that only the buffer takes page faults while measuring
+	memset(latencyNanos, 0, sampleCapacity * sizeof(long long));
+
+	printf("%ld items, batch size %d, buffer size %d (%.1f MB)\n", itemCount / BUFFER_SIZE * BUFFER_SIZE,
+			batchSize, BUFFER_SIZE, 2.0 * BUFFER_SIZE * sizeof(int) / (1024 * 1024));
+	printf("%-24s %-24s %8s %12s %10s %12s %12s %6s %6s %7s %8s\n", "mode", "backing", "init ms", "items/s",
+			"faults", "dTLB rd miss", "dTLB wr miss", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+	statsInitDefault("memory_bench");
+	statsSetEnabled(0);
+
+	for (i = 0; i < sizeof(benchModes) / sizeof(BenchMode); i++) {
+		failedRunCount += benchRun(&benchModes[i], itemCount, batchSize, latencyNanos);
+	}
+
+	statsDestroy();
+	free(latencyNanos);
+
+	return failedRunCount ? 1 : 0;
+}
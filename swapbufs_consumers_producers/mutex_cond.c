@@ -0,0 +1,260 @@
+/**
+ * mutex_cond.c
+ *
+ * Thread-safe wrapper of buffer.h using a mutex and two condition variables:
+ * 1. mutex: Protects critical section (buffer manipulation)
+ * 2. mayProduce: Broadcast to producers when the produce buffer gets swapped out
+ * 3. mayConsume: Broadcast to consumers when the consume buffer gets swapped in, or on close
+ *
+ * Unlike three_sem.c, waiting threads re-check the buffer state themselves once woken up, so
+ * whoever finds both buffers exhausted swaps them, be it a producer or a consumer. Picked by
+ * name "mutex_cond" (see protocol.c).
+ *
+ * Mutex and condition variable waits are counted in stats.c under the ids of the respective
+ * semaphores of three_sem.c.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "buffer.h"
+
+typedef struct MutexCondProtocol {
+	// Common protocol state, including the buffer protected by this protocol instance
+	Protocol base;
+
+	// Mutex regulating exclusive access to buffer manipulation sections (critical sections)
+	pthread_mutex_t sharedMutex;
+
+	// Condition telling producers the produce buffer has been swapped out
+	pthread_cond_t sharedCondMayProduce;
+
+	// Condition telling consumers the consume buffer has been swapped in, or the protocol closed
+	pthread_cond_t sharedCondMayConsume;
+
+	// Set once producers are done, so consumers may drain a partially filled produce buffer
+	int sharedClosed;
+} MutexCondProtocol;
+
+/**
+ * Swap buffers and wake up everybody waiting for it. Mutex must be held.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread executing the buffer swap
+ */
+static void mutexCondSwap(MutexCondProtocol *protocol, const char *threadName)
+{
+	bufferSwap(protocol->base.buffer, threadName);
+
+	TRACE("\t%s Signaling consumers and producers\n", threadName);
+
+	pthread_cond_broadcast(&protocol->sharedCondMayConsume);
+	pthread_cond_broadcast(&protocol->sharedCondMayProduce);
+}
+
+/**
+ * Safely produce a batch of data items into the produce buffer.
+ *
+ * Items are pushed as long as there's room in the produce buffer, so a batch may be split
+ * across several buffer swaps.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param items Data produced
+ * @param count Number of items
+ */
+static void mutexCondProduceBatch(Protocol *baseProtocol, const char *threadName, const int *items, int count)
+{
+	MutexCondProtocol *protocol = (MutexCondProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int produced = 0;
+	int batchStart;
+
+	TRACE("%s Waiting on mutex\n", threadName);
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Acquired mutex\n", threadName);
+
+	while (produced < count) {
+		// Wait until there's room for producing
+		while (bufferProduceIsExhausted(buffer)) {
+			if (bufferConsumeIsExhausted(buffer)) {
+				TRACE("\t%s Both buffers exhausted\n", threadName);
+
+				mutexCondSwap(protocol, threadName);
+			} else {
+				TRACE("%s Waiting for consumers to swap buffers\n", threadName);
+
+				STATS_COND_WAIT(&protocol->sharedCondMayProduce, &protocol->sharedMutex, STATS_SEM_MAY_PRODUCE);
+			}
+		}
+
+		// Push as much data as fits to buffer
+		batchStart = produced;
+		while ((produced < count) && !bufferProduceIsExhausted(buffer)) {
+			bufferProduceData(buffer, threadName, items[produced++]);
+		}
+
+		STATS_COUNT(STATS_COUNTER_PRODUCED_ITEMS, produced - batchStart);
+	}
+
+	// Hand a full produce buffer over right away if consumers are waiting for it
+	if (bufferProduceIsExhausted(buffer) && bufferConsumeIsExhausted(buffer)) {
+		mutexCondSwap(protocol, threadName);
+	}
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+
+	TRACE("%s Released mutex\n", threadName);
+}
+
+/**
+ * Safely consume up to maxCount data items from the consume buffer.
+ *
+ * Never waits for more items once at least one has been consumed, so it may return less than
+ * maxCount items even before the end of the stream.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed
+ */
+static int mutexCondConsumeBatch(Protocol *baseProtocol, const char *threadName, int *items, int maxCount)
+{
+	MutexCondProtocol *protocol = (MutexCondProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int count = 0;
+
+	TRACE("%s Waiting on mutex\n", threadName);
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Acquired mutex\n", threadName);
+
+	// Wait until there's something to consume
+	while (bufferConsumeIsExhausted(buffer)) {
+		if (bufferProduceIsExhausted(buffer)) {
+			TRACE("\t%s Both buffers exhausted\n", threadName);
+
+			mutexCondSwap(protocol, threadName);
+		} else if (protocol->sharedClosed) {
+			if (bufferProduceIsEmpty(buffer)) {
+				// Nothing will ever be produced again
+				TRACE("\t%s End of stream\n", threadName);
+
+				pthread_mutex_unlock(&protocol->sharedMutex);
+
+				return 0;
+			}
+
+			TRACE("\t%s Produce buffer closed, flushing it to consumers\n", threadName);
+
+			mutexCondSwap(protocol, threadName);
+		} else {
+			TRACE("%s Waiting for producers to fill the produce buffer\n", threadName);
+
+			STATS_COND_WAIT(&protocol->sharedCondMayConsume, &protocol->sharedMutex, STATS_SEM_MAY_CONSUME);
+		}
+	}
+
+	// Pop data from buffer
+	while ((count < maxCount) && !bufferConsumeIsExhausted(buffer)) {
+		items[count++] = bufferConsumeData(buffer, threadName);
+	}
+
+	STATS_COUNT(STATS_COUNTER_CONSUMED_ITEMS, count);
+
+	// Let blocked producers go on right away if they've been waiting for us
+	if (bufferConsumeIsExhausted(buffer) && bufferProduceIsExhausted(buffer)) {
+		mutexCondSwap(protocol, threadName);
+	}
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+
+	TRACE("%s Released mutex\n", threadName);
+
+	return count;
+}
+
+/**
+ * Tell consumers no more data will be produced.
+ *
+ * Must be called once, after all producers are done producing. Consumers will consume whatever
+ * is left in the buffer and then receive end of stream.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread closing the protocol
+ */
+static void mutexCondClose(Protocol *baseProtocol, const char *threadName)
+{
+	MutexCondProtocol *protocol = (MutexCondProtocol *) baseProtocol;
+
+	STATS_MUTEX_LOCK(&protocol->sharedMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Closing produce buffer\n", threadName);
+
+	protocol->sharedClosed = 1;
+
+	// Waiting consumers will flush the produce buffer or find out the stream has ended
+	pthread_cond_broadcast(&protocol->sharedCondMayConsume);
+
+	pthread_mutex_unlock(&protocol->sharedMutex);
+}
+
+/**
+ * Initializes shared variables, mutex and conditions.
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @return New protocol instance, NULL if out of memory
+ */
+static Protocol *mutexCondCreate(Buffer *buffer)
+{
+	MutexCondProtocol *protocol = malloc(sizeof(MutexCondProtocol));
+
+	if (!protocol) {
+		return NULL;
+	}
+
+	protocol->base.ops = &mutexCondProtocolOps;
+	protocol->base.buffer = buffer;
+	protocol->sharedClosed = 0;
+
+	pthread_mutex_init(&protocol->sharedMutex, NULL);
+	pthread_cond_init(&protocol->sharedCondMayProduce, NULL);
+	pthread_cond_init(&protocol->sharedCondMayConsume, NULL);
+
+	return &protocol->base;
+}
+
+/**
+ * Destroys mutex and conditions and releases protocol memory.
+ *
+ * @param baseProtocol Protocol instance no longer used by any thread
+ */
+static void mutexCondDestroy(Protocol *baseProtocol)
+{
+	MutexCondProtocol *protocol = (MutexCondProtocol *) baseProtocol;
+
+	pthread_mutex_destroy(&protocol->sharedMutex);
+	pthread_cond_destroy(&protocol->sharedCondMayProduce);
+	pthread_cond_destroy(&protocol->sharedCondMayConsume);
+
+	free(protocol);
+}
+
+// Mutex and condition variables protocol implementation
+const ProtocolOps mutexCondProtocolOps = {
+	"mutex_cond",
+	mutexCondCreate,
+	mutexCondDestroy,
+	mutexCondConsumeBatch,
+	mutexCondProduceBatch,
+	mutexCondClose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
@@ -0,0 +1,480 @@
+/**
+ * partition.c
+ *
+ * Keyed queue split into partitions, each partition being a double buffer of its own and each
+ * being drained by a single consumer at a time.
+ *
+ * Producers give a key along with their items, and items are hashed by key into a partition.
+ * Each partition is assigned to one of the consumers joined to the queue, so items of the same
+ * key (produced by the same thread) are consumed in the order they've been produced, without any
+ * lock shared by all partitions or any re-sequencing downstream.
+ *
+ * Consumers join and leave any time. Partitions are then rebalanced, moving as few of them as
+ * possible so that every consumer gets its fair share. A partition moving away from a consumer
+ * is released by the consumer only on its next partitionedConsumeBatch() call, i.e. once it's
+ * done with the batch it got from the partition, and only then it's picked up by the consumer
+ * it's been assigned to. The time from the change of consumers until all moved partitions are
+ * held by their new consumers is recorded as the rebalance pause.
+ *
+ * A consumer holding several partitions waits on all of them at once with poll(), so partitions
+ * are protected with the event file descriptors protocol (see event_fd.c). Each consumer has a
+ * wake-up descriptor of its own as well, written when its partitions change.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "main.h"
+
+/**
+ * Tell a consumer to look at partition assignments again. Queue mutex must be held.
+ *
+ * @param queue Partitioned queue
+ * @param consumerId Consumer to wake up
+ */
+static void partitionWakeup(PartitionedQueue *queue, int consumerId)
+{
+	eventfd_t value = 1;
+
+	if (queue->isConsumerActive[consumerId]) {
+		while ((write(queue->consumers[consumerId].wakeupFd, &value, sizeof(value)) < 0) && (errno == EINTR)) {
+			// Interrupted by signal, try again
+		}
+	}
+}
+
+/**
+ * Record the end of a rebalance pause if every partition is held by the consumer it's been
+ * assigned to. Queue mutex must be held.
+ *
+ * @param queue Partitioned queue
+ */
+static void partitionCheckRebalanced(PartitionedQueue *queue)
+{
+	int partitionId;
+	long long pauseNanos;
+
+	if (!queue->isRebalancing) {
+		return;
+	}
+
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		if (queue->holdingConsumers[partitionId] != queue->assignedConsumers[partitionId]) {
+			return;
+		}
+	}
+
+	pauseNanos = clockNowNanos() - queue->rebalanceStartNanos;
+
+	queue->isRebalancing = 0;
+	queue->rebalanceCount++;
+	queue->rebalanceTotalNanos += pauseNanos;
+	if (pauseNanos > queue->rebalanceMaxNanos) {
+		queue->rebalanceMaxNanos = pauseNanos;
+	}
+}
+
+/**
+ * Assign partitions to active consumers evenly, keeping as many assignments as possible.
+ * Queue mutex must be held.
+ *
+ * Every consumer gets partitionCount / activeCount partitions, the first partitionCount %
+ * activeCount active consumers getting one more. Partitions of consumers gone or over their
+ * share are handed to consumers under their share.
+ *
+ * @param queue Partitioned queue
+ */
+static void partitionRebalance(PartitionedQueue *queue)
+{
+	int consumerId;
+	int partitionId;
+	int activeCount = 0;
+	int rank = 0;
+	int quotas[PARTITION_MAX_CONSUMERS];
+	int counts[PARTITION_MAX_CONSUMERS] = { 0 };
+
+	for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+		activeCount += queue->isConsumerActive[consumerId];
+	}
+
+	for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+		if (queue->isConsumerActive[consumerId]) {
+			quotas[consumerId] = queue->partitionCount / activeCount
+					+ ((rank++ < queue->partitionCount % activeCount) ? 1 : 0);
+		} else {
+			quotas[consumerId] = 0;
+		}
+	}
+
+	// Take partitions away from consumers gone or over their share
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		consumerId = queue->assignedConsumers[partitionId];
+		if (consumerId < 0) {
+			continue;
+		}
+
+		if (counts[consumerId] < quotas[consumerId]) {
+			counts[consumerId]++;
+		} else {
+			queue->assignedConsumers[partitionId] = -1;
+		}
+	}
+
+	// Hand them to consumers under their share
+	consumerId = 0;
+	for (partitionId = 0; (partitionId < queue->partitionCount) && (activeCount > 0); partitionId++) {
+		if (queue->assignedConsumers[partitionId] >= 0) {
+			continue;
+		}
+
+		while (counts[consumerId] >= quotas[consumerId]) {
+			consumerId++;
+		}
+
+		queue->assignedConsumers[partitionId] = consumerId;
+		counts[consumerId]++;
+	}
+
+	// Start counting the pause, unless a previous rebalance is still going on
+	if (!queue->isRebalancing) {
+		queue->isRebalancing = 1;
+		queue->rebalanceStartNanos = clockNowNanos();
+	}
+	partitionCheckRebalanced(queue);
+
+	__atomic_add_fetch(&queue->generation, 1, __ATOMIC_RELEASE);
+
+	for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+		partitionWakeup(queue, consumerId);
+	}
+}
+
+/**
+ * Release partitions no longer assigned to a consumer, pick up the ones newly assigned to it
+ * and not held by anybody else, and list the partitions it now holds.
+ *
+ * @param consumer Consumer, between two batches
+ */
+static void partitionRefresh(PartitionConsumer *consumer)
+{
+	PartitionedQueue *queue = consumer->queue;
+	int isWoken[PARTITION_MAX_CONSUMERS] = { 0 };
+	int partitionId;
+	int consumerId;
+	int isChanged = 0;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	consumer->seenGeneration = __atomic_load_n(&queue->generation, __ATOMIC_ACQUIRE);
+	consumer->heldCount = 0;
+
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		if ((queue->holdingConsumers[partitionId] == consumer->consumerId)
+				&& (queue->assignedConsumers[partitionId] != consumer->consumerId)) {
+			// Done with the last batch of this partition, let its new consumer have it
+			queue->holdingConsumers[partitionId] = -1;
+			isChanged = 1;
+
+			if (queue->assignedConsumers[partitionId] >= 0) {
+				isWoken[queue->assignedConsumers[partitionId]] = 1;
+			}
+		} else if ((queue->holdingConsumers[partitionId] < 0)
+				&& (queue->assignedConsumers[partitionId] == consumer->consumerId)) {
+			queue->holdingConsumers[partitionId] = consumer->consumerId;
+			isChanged = 1;
+		}
+
+		if ((queue->holdingConsumers[partitionId] == consumer->consumerId) && !queue->isEnded[partitionId]) {
+			consumer->heldPartitions[consumer->heldCount++] = partitionId;
+		}
+	}
+
+	if (isChanged) {
+		partitionCheckRebalanced(queue);
+		consumer->seenGeneration = __atomic_add_fetch(&queue->generation, 1, __ATOMIC_RELEASE);
+	}
+
+	// Wake up new consumers only once the generation is bumped, or they may wake up, see the old
+	// generation and go back to waiting for good
+	for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+		if (isWoken[consumerId]) {
+			partitionWakeup(queue, consumerId);
+		}
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+
+	consumer->cursor = 0;
+}
+
+/**
+ * Initialize a partitioned queue with no consumers.
+ *
+ * @param queue Queue to initialize
+ * @param partitionCount Number of partitions
+ * @return 1 on success, 0 if partitions could not be created
+ */
+int partitionedInit(PartitionedQueue *queue, int partitionCount)
+{
+	int partitionId;
+
+	queue->partitionCount = partitionCount;
+	queue->buffers = malloc(partitionCount * sizeof(Buffer));
+	queue->protocols = malloc(partitionCount * sizeof(Protocol *));
+	queue->assignedConsumers = malloc(partitionCount * sizeof(int));
+	queue->holdingConsumers = malloc(partitionCount * sizeof(int));
+	queue->isEnded = calloc(partitionCount, sizeof(int));
+	queue->endedCount = 0;
+	queue->generation = 0;
+	queue->isRebalancing = 0;
+	queue->rebalanceStartNanos = 0;
+	queue->rebalanceCount = 0;
+	queue->rebalanceTotalNanos = 0;
+	queue->rebalanceMaxNanos = 0;
+
+	for (partitionId = 0; partitionId < partitionCount; partitionId++) {
+		if (!bufferInit(&queue->buffers[partitionId])) {
+			return 0;
+		}
+		if (!(queue->protocols[partitionId] = eventFdProtocolOps.create(&queue->buffers[partitionId]))) {
+			return 0;
+		}
+
+		queue->assignedConsumers[partitionId] = -1;
+		queue->holdingConsumers[partitionId] = -1;
+	}
+
+	for (partitionId = 0; partitionId < PARTITION_MAX_CONSUMERS; partitionId++) {
+		queue->isConsumerActive[partitionId] = 0;
+	}
+
+	pthread_mutex_init(&queue->mutex, NULL);
+
+	return 1;
+}
+
+/**
+ * @param queue Partitioned queue
+ * @param key Key of item
+ * @return Partition items of key go to
+ */
+int partitionOf(PartitionedQueue *queue, int key)
+{
+	// Fibonacci hashing, so that consecutive keys are spread across partitions
+	return (int) (((unsigned long long) ((unsigned int) key * 2654435761u) * queue->partitionCount) >> 32);
+}
+
+/**
+ * Produce a batch of data items of the same key, into the partition of the key.
+ *
+ * Waits while the produce buffer of the partition is full.
+ *
+ * @param queue Partitioned queue
+ * @param threadName Name of thread producing data
+ * @param key Key of items
+ * @param items Data produced
+ * @param count Number of items
+ */
+void partitionedProduceBatch(PartitionedQueue *queue, const char *threadName, int key, const int *items, int count)
+{
+	protocolProduceBatch(queue->protocols[partitionOf(queue, key)], threadName, items, count);
+}
+
+/**
+ * Tell consumers no more data will be produced into any partition.
+ *
+ * Must be called once, after all producers are done producing.
+ *
+ * @param queue Partitioned queue
+ * @param threadName Name of thread closing the queue
+ */
+void partitionedClose(PartitionedQueue *queue, const char *threadName)
+{
+	int partitionId;
+
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		protocolClose(queue->protocols[partitionId], threadName);
+	}
+}
+
+/**
+ * Join a new consumer to the queue and rebalance partitions.
+ *
+ * @param queue Partitioned queue
+ * @return New consumer, to be used by a single thread. NULL if there's no room for more consumers
+ */
+PartitionConsumer *partitionedJoin(PartitionedQueue *queue)
+{
+	PartitionConsumer *consumer = NULL;
+	int consumerId;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+		if (!queue->isConsumerActive[consumerId]) {
+			break;
+		}
+	}
+
+	if (consumerId < PARTITION_MAX_CONSUMERS) {
+		consumer = &queue->consumers[consumerId];
+		consumer->queue = queue;
+		consumer->consumerId = consumerId;
+		consumer->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		consumer->seenGeneration = -1;
+		consumer->heldPartitions = malloc(queue->partitionCount * sizeof(int));
+		consumer->heldCount = 0;
+		consumer->cursor = 0;
+		consumer->pollFds = malloc((queue->partitionCount + 1) * sizeof(struct pollfd));
+
+		if (consumer->wakeupFd < 0) {
+			perror("eventfd");
+			free(consumer->heldPartitions);
+			free(consumer->pollFds);
+			consumer = NULL;
+		} else {
+			queue->isConsumerActive[consumerId] = 1;
+			partitionRebalance(queue);
+		}
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+
+	return consumer;
+}
+
+/**
+ * Release all partitions of a consumer, remove it from the queue and rebalance partitions.
+ *
+ * Must be called by the thread of the consumer, once it's done with its last batch.
+ *
+ * @param consumer Consumer leaving
+ */
+void partitionedLeave(PartitionConsumer *consumer)
+{
+	PartitionedQueue *queue = consumer->queue;
+	int partitionId;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	queue->isConsumerActive[consumer->consumerId] = 0;
+	close(consumer->wakeupFd);
+	free(consumer->heldPartitions);
+	free(consumer->pollFds);
+
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		if (queue->holdingConsumers[partitionId] == consumer->consumerId) {
+			queue->holdingConsumers[partitionId] = -1;
+		}
+	}
+
+	partitionRebalance(queue);
+
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * Consume up to maxCount data items from one of the partitions held by a consumer.
+ *
+ * All items returned come from the same partition, in the order they've been produced. The
+ * partition may move to another consumer on the next call, so the caller must be done with the
+ * items by then if it cares about their order.
+ *
+ * @param consumer Consumer
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @param partitionId Receives the partition items were consumed from
+ * @return Number of items consumed, 0 if the queue is closed and all partitions have been drained
+ */
+int partitionedConsumeBatch(PartitionConsumer *consumer, const char *threadName, int *items, int maxCount, int *partitionId)
+{
+	PartitionedQueue *queue = consumer->queue;
+	eventfd_t value;
+	int consumerId;
+	int count;
+	int i;
+
+	while (1) {
+		if (consumer->seenGeneration != __atomic_load_n(&queue->generation, __ATOMIC_ACQUIRE)) {
+			partitionRefresh(consumer);
+		}
+
+		// Go through held partitions round-robin, starting after the last one consumed from
+		for (i = 0; i < consumer->heldCount; i++) {
+			*partitionId = consumer->heldPartitions[(consumer->cursor + i) % consumer->heldCount];
+
+			count = protocolTryConsumeBatch(queue->protocols[*partitionId], threadName, items, maxCount);
+			if (count > 0) {
+				consumer->cursor = (consumer->cursor + i + 1) % consumer->heldCount;
+				return count;
+			}
+
+			if ((count == 0) && !queue->isEnded[*partitionId]) {
+				// Closed and drained, nothing will ever come out of it again
+				queue->isEnded[*partitionId] = 1;
+				consumer->seenGeneration = -1;
+
+				if (__atomic_add_fetch(&queue->endedCount, 1, __ATOMIC_ACQ_REL) == queue->partitionCount) {
+					// Let everybody find out
+					pthread_mutex_lock(&queue->mutex);
+					for (consumerId = 0; consumerId < PARTITION_MAX_CONSUMERS; consumerId++) {
+						partitionWakeup(queue, consumerId);
+					}
+					pthread_mutex_unlock(&queue->mutex);
+				}
+			}
+		}
+
+		if (__atomic_load_n(&queue->endedCount, __ATOMIC_ACQUIRE) == queue->partitionCount) {
+			return 0;
+		}
+
+		if (consumer->seenGeneration == -1) {
+			// Some partition ended, list the partitions left before waiting
+			continue;
+		}
+
+		// Wait for any held partition to become ready, or for partitions to change
+		for (i = 0; i < consumer->heldCount; i++) {
+			consumer->pollFds[i].fd = protocolGetConsumeFd(queue->protocols[consumer->heldPartitions[i]]);
+			consumer->pollFds[i].events = POLLIN;
+		}
+		consumer->pollFds[i].fd = consumer->wakeupFd;
+		consumer->pollFds[i].events = POLLIN;
+
+		if ((poll(consumer->pollFds, consumer->heldCount + 1, -1) > 0) && consumer->pollFds[i].revents) {
+			while (read(consumer->wakeupFd, &value, sizeof(value)) < 0 && (errno == EINTR)) {
+				// Interrupted by signal, try again
+			}
+		}
+	}
+}
+
+/**
+ * Release all partitions, once all consumers have left.
+ *
+ * @param queue Partitioned queue
+ */
+void partitionedDestroy(PartitionedQueue *queue)
+{
+	int partitionId;
+
+	for (partitionId = 0; partitionId < queue->partitionCount; partitionId++) {
+		protocolDestroy(queue->protocols[partitionId]);
+		bufferDestroy(&queue->buffers[partitionId]);
+	}
+
+	pthread_mutex_destroy(&queue->mutex);
+
+	free(queue->buffers);
+	free(queue->protocols);
+	free(queue->assignedConsumers);
+	free(queue->holdingConsumers);
+	free(queue->isEnded);
+}
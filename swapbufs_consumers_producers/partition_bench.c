@@ -0,0 +1,320 @@
+/**
+ * partition_bench.c
+ *
+ * Benchmark of a keyed, partitioned queue (see partition.c): throughput, per key order and
+ * pauses while partitions are rebalanced.
+ *
+ * Producers push items of keyCount keys, each key being produced by a single producer, in
+ * batches of the same key. Every item carries its key and its sequence number within the key,
+ * so consumers check each key arrives in order. Once a third of the items have been consumed
+ * an extra consumer joins, and leaves once two thirds have been consumed, forcing two rebalances.
+ *
+ * The run is repeated for each partition count given (16 and 64 by default), BENCH_REPEAT_COUNT
+ * times over. Compile with e.g. -DBENCH_REPEAT_COUNT=100 to stress rebalancing for races.
+ *
+ * Usage: partition_bench [itemCount] [producers] [consumers] [keyCount] [batchSize] [partitionCount...]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "main.h"
+
+// Bits of an item holding its key, the rest holding its sequence number within the key
+#define BENCH_KEY_BITS 11
+#define BENCH_MAX_KEYS (1 << BENCH_KEY_BITS)
+#define BENCH_MAX_SEQUENCE ((1 << (31 - BENCH_KEY_BITS)) - 1)
+
+// Number of times runs are repeated
+#ifndef BENCH_REPEAT_COUNT
+#define BENCH_REPEAT_COUNT 1
+#endif
+
+//
+// Global (shared) variables
+//
+
+// Queue under test
+static PartitionedQueue sharedQueue;
+
+// Run parameters
+static long sharedItemsPerKey;
+static int sharedProducerCount;
+static int sharedConsumerCount;
+static int sharedKeyCount;
+static int sharedBatchSize;
+
+// Sequence number expected next for each key. Only touched by the consumer holding its partition
+static int sharedNextSequences[BENCH_MAX_KEYS];
+
+// Number of producers done producing, the last one closes the queue
+static int sharedFinishedProducerCount;
+
+// Number of items consumed so far, and of items consumed out of order
+static long sharedConsumedCount;
+static long sharedOutOfOrderCount;
+
+// Rebalance pauses caused by the extra consumer joining and leaving
+static int sharedRebalanceCount;
+static long long sharedRebalanceTotalNanos;
+static long long sharedRebalanceMaxNanos;
+
+/**
+ * Producer thread task.
+ *
+ * Produces itemsPerKey items for each of its keys, a batch at a time per key, round-robin.
+ *
+ * @param threadId Id assigned to thread. Used to pick its keys
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	long producerId = (long) threadId;
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long produced;
+	int batchCount;
+	int key;
+	int i;
+	char threadName[64];
+
+	sprintf(threadName, "[prod %3ld]", producerId);
+	statsRegisterThread(threadName);
+
+	for (produced = 0; produced < sharedItemsPerKey; produced += batchCount) {
+		batchCount = (sharedItemsPerKey - produced < sharedBatchSize)
+				? (int) (sharedItemsPerKey - produced) : sharedBatchSize;
+
+		for (key = producerId; key < sharedKeyCount; key += sharedProducerCount) {
+			for (i = 0; i < batchCount; i++) {
+				items[i] = (int) (((produced + i) << BENCH_KEY_BITS) | key);
+			}
+
+			partitionedProduceBatch(&sharedQueue, threadName, key, items, batchCount);
+		}
+	}
+
+	free(items);
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		partitionedClose(&sharedQueue, threadName);
+	}
+
+	return 0;
+}
+
+/**
+ * Consume from the queue, checking the order of each key, until the queue ends or stopCount
+ * items have been consumed by all consumers.
+ *
+ * @param consumer Consumer joined to the queue
+ * @param threadName Name of calling thread
+ * @param stopCount Total number of consumed items to stop at, 0 to go on until the queue ends
+ */
+static void benchConsume(PartitionConsumer *consumer, const char *threadName, long stopCount)
+{
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	int partitionId;
+	int count;
+	int key;
+	int i;
+
+	while ((count = partitionedConsumeBatch(consumer, threadName, items, sharedBatchSize, &partitionId)) > 0) {
+		for (i = 0; i < count; i++) {
+			key = items[i] & (BENCH_MAX_KEYS - 1);
+			if ((items[i] >> BENCH_KEY_BITS) != sharedNextSequences[key]) {
+				__sync_fetch_and_add(&sharedOutOfOrderCount, 1);
+			}
+			sharedNextSequences[key] = (items[i] >> BENCH_KEY_BITS) + 1;
+		}
+
+		if ((__sync_add_and_fetch(&sharedConsumedCount, count) >= stopCount) && (stopCount > 0)) {
+			break;
+		}
+	}
+
+	free(items);
+}
+
+/**
+ * Consumer thread task, consuming until the queue ends.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	PartitionConsumer *consumer = partitionedJoin(&sharedQueue);
+	char threadName[64];
+
+	sprintf(threadName, "[cons %3ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	benchConsume(consumer, threadName, 0);
+	partitionedLeave(consumer);
+
+	return 0;
+}
+
+/**
+ * Extra consumer thread task, joining once a third of the items have been consumed and leaving
+ * once two thirds have.
+ *
+ * @param unused Unused
+ * @return
+ */
+static void *benchExtraConsumerThreadTask(void *unused)
+{
+	PartitionConsumer *consumer;
+	long itemCount = sharedKeyCount * sharedItemsPerKey;
+
+	statsRegisterThread("[cons extra]");
+
+	while (__atomic_load_n(&sharedConsumedCount, __ATOMIC_ACQUIRE) < itemCount / 3) {
+		usleep(100);
+	}
+
+	// Only count our own rebalances, not the ones of consumers starting up
+	pthread_mutex_lock(&sharedQueue.mutex);
+	sharedQueue.rebalanceCount = 0;
+	sharedQueue.rebalanceTotalNanos = 0;
+	sharedQueue.rebalanceMaxNanos = 0;
+	pthread_mutex_unlock(&sharedQueue.mutex);
+
+	consumer = partitionedJoin(&sharedQueue);
+	benchConsume(consumer, "[cons extra]", 2 * itemCount / 3);
+	partitionedLeave(consumer);
+
+	// Wait until the partitions we've left are picked up, unless the run is over already
+	while (__atomic_load_n(&sharedQueue.isRebalancing, __ATOMIC_ACQUIRE)
+			&& (__atomic_load_n(&sharedConsumedCount, __ATOMIC_ACQUIRE) < itemCount)) {
+		usleep(10);
+	}
+
+	pthread_mutex_lock(&sharedQueue.mutex);
+	sharedRebalanceCount = sharedQueue.rebalanceCount;
+	sharedRebalanceTotalNanos = sharedQueue.rebalanceTotalNanos;
+	sharedRebalanceMaxNanos = sharedQueue.rebalanceMaxNanos;
+	pthread_mutex_unlock(&sharedQueue.mutex);
+
+	return 0;
+}
+
+/**
+ * Push all items through a fresh queue.
+ *
+ * @param partitionCount Number of partitions
+ * @return 0 on success, 1 if items got lost or out of order
+ */
+static int benchRun(int partitionCount)
+{
+	long i;
+	long long startNanos;
+	long long elapsedNanos;
+	long itemCount = sharedKeyCount * sharedItemsPerKey;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	pthread_t *consumerThreads = malloc(sharedConsumerCount * sizeof(pthread_t));
+	pthread_t extraConsumerThread;
+
+	if (!partitionedInit(&sharedQueue, partitionCount)) {
+		fprintf(stderr, "Could not create %d partitions\n", partitionCount);
+		exit(1);
+	}
+
+	for (i = 0; i < sharedKeyCount; i++) {
+		sharedNextSequences[i] = 0;
+	}
+	sharedFinishedProducerCount = 0;
+	sharedConsumedCount = 0;
+	sharedOutOfOrderCount = 0;
+	sharedRebalanceCount = 0;
+	sharedRebalanceTotalNanos = 0;
+	sharedRebalanceMaxNanos = 0;
+
+	startNanos = clockNowNanos();
+
+	for (i = 0; i < sharedConsumerCount; i++) {
+		pthread_create(&consumerThreads[i], NULL, benchConsumerThreadTask, (void *) i);
+	}
+	pthread_create(&extraConsumerThread, NULL, benchExtraConsumerThreadTask, NULL);
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	for (i = 0; i < sharedConsumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+	pthread_join(extraConsumerThread, NULL);
+
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	printf("%3d partitions %12.0f items/s, %ld out of order, %d rebalances, pause avg %.3f ms max %.3f ms%s\n",
+			partitionCount, sharedConsumedCount / (elapsedNanos / 1e9), sharedOutOfOrderCount,
+			sharedRebalanceCount,
+			sharedRebalanceCount ? sharedRebalanceTotalNanos / 1e6 / sharedRebalanceCount : 0.0,
+			sharedRebalanceMaxNanos / 1e6,
+			((sharedConsumedCount != itemCount) || sharedOutOfOrderCount) ? " ***** FAIL *****" : "");
+
+	partitionedDestroy(&sharedQueue);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return (sharedConsumedCount != itemCount) || sharedOutOfOrderCount;
+}
+
+/**
+ * Runs the benchmark for each partition count given.
+ */
+int main(int argc, char *argv[])
+{
+	long itemCount = (argc > 1) ? atol(argv[1]) : 4000000;
+	int defaultPartitionCounts[] = { 16, 64 };
+	int failedRunCount = 0;
+	int repeat;
+	int i;
+
+	sharedProducerCount = (argc > 2) ? atoi(argv[2]) : 4;
+	sharedConsumerCount = (argc > 3) ? atoi(argv[3]) : 4;
+	sharedKeyCount = (argc > 4) ? atoi(argv[4]) : 1024;
+	sharedBatchSize = (argc > 5) ? atoi(argv[5]) : 64;
+
+	if ((sharedKeyCount > BENCH_MAX_KEYS) || (sharedConsumerCount >= PARTITION_MAX_CONSUMERS)) {
+		fprintf(stderr, "At most %d keys and %d consumers\n", BENCH_MAX_KEYS, PARTITION_MAX_CONSUMERS - 1);
+		return 1;
+	}
+
+	sharedItemsPerKey = itemCount / sharedKeyCount;
+	if (sharedItemsPerKey > BENCH_MAX_SEQUENCE) {
+		sharedItemsPerKey = BENCH_MAX_SEQUENCE;
+	}
+
+	printf("%ld items of %d keys, %d producers, %d consumers (+1 joining and leaving), batch size %d, buffer size %d\n",
+			sharedKeyCount * sharedItemsPerKey, sharedKeyCount, sharedProducerCount, sharedConsumerCount,
+			sharedBatchSize, BUFFER_SIZE);
+
+	statsInitDefault("partition_bench");
+	statsSetEnabled(0);
+
+	for (repeat = 0; repeat < BENCH_REPEAT_COUNT; repeat++) {
+		if (argc > 6) {
+			for (i = 6; i < argc; i++) {
+				failedRunCount += benchRun(atoi(argv[i]));
+			}
+		} else {
+			for (i = 0; i < 2; i++) {
+				failedRunCount += benchRun(defaultPartitionCounts[i]);
+			}
+		}
+	}
+
+	if (BENCH_REPEAT_COUNT > 1) {
+		printf("%d failed runs\n", failedRunCount);
+	}
+
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
@@ -0,0 +1,376 @@
+/**
+ * pipeline.c
+ *
+ * Chain of processing stages connected with swappable double buffers.
+ *
+ * Each stage runs its own group of threads. Stage threads consume batches of items from the
+ * buffer fed by the previous stage, process them with the stage function and produce the
+ * results into the buffer read by the next stage. The first stage (source) has no input buffer
+ * and the last one (sink) has no output buffer.
+ *
+ * Backpressure needs no extra machinery: once a stage's produce buffer is exhausted its threads
+ * block in protocolProduceBatch(), stop consuming their own input, and so the previous stage's
+ * produce buffer fills up as well, all the way up to the source.
+ *
+ * When all threads of a stage are done, the last one of them closes the output buffer, so the
+ * next stage drains it and finishes as well.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include "main.h"
+
+/**
+ * Pipeline stage thread task.
+ *
+ * Repeatedly consumes a batch, processes it and produces the outcome, measuring time spent
+ * on each step.
+ *
+ * @param workerArg PipelineWorker of this thread
+ * @return
+ */
+static void *pipelineWorkerTask(void *workerArg)
+{
+	PipelineWorker *worker = (PipelineWorker *) workerArg;
+	PipelineStage *stage = worker->stage;
+	int *inItems = worker->inItems;
+	int *outItems = worker->outItems;
+	int inCount;
+	int outCount;
+	int isLastThread;
+	long long startNanos;
+	long long itemsIn = 0;
+	long long itemsOut = 0;
+	long long busyNanos = 0;
+	long long waitInNanos = 0;
+	long long waitOutNanos = 0;
+
+	while (1) {
+		if (stage->input) {
+			// Get next batch from the previous stage
+			startNanos = clockNowNanos();
+			inCount = protocolConsumeBatch(stage->input, worker->threadName, inItems, stage->batchSize);
+			waitInNanos += clockNowNanos() - startNanos;
+
+			if (inCount == 0) {
+				// Previous stage is done and its buffer is drained
+				break;
+			}
+		} else {
+			// Source stages generate a whole batch on their own
+			inCount = stage->batchSize;
+		}
+
+		// Do the actual work
+		startNanos = clockNowNanos();
+		outCount = stage->function(stage->stageArg, stage->input ? inItems : NULL, inCount, outItems);
+		busyNanos += clockNowNanos() - startNanos;
+
+		if (!stage->input) {
+			if (outCount == 0) {
+				// Source ran out of items
+				break;
+			}
+		} else {
+			itemsIn += inCount;
+		}
+
+		if (stage->output && (outCount > 0)) {
+			// Hand results to the next stage, waiting while its buffer is full
+			startNanos = clockNowNanos();
+			protocolProduceBatch(stage->output, worker->threadName, outItems, outCount);
+			waitOutNanos += clockNowNanos() - startNanos;
+		}
+		itemsOut += outCount;
+	}
+
+	// Add our numbers to the stage totals. The SIGUSR1 stats dump may interrupt the wait
+	while (sem_wait(&stage->semStatsMutex) != 0) {
+		// Interrupted by signal, keep waiting
+	}
+	stage->itemsIn += itemsIn;
+	stage->itemsOut += itemsOut;
+	stage->busyNanos += busyNanos;
+	stage->waitInNanos += waitInNanos;
+	stage->waitOutNanos += waitOutNanos;
+	stage->finishedThreadCount++;
+	isLastThread = (stage->finishedThreadCount == stage->threadCount);
+	sem_post(&stage->semStatsMutex);
+
+	if (isLastThread && stage->output) {
+		// Nobody will produce into the next stage any more
+		protocolClose(stage->output, worker->threadName);
+	}
+
+	return 0;
+}
+
+/**
+ * Initialize an empty pipeline.
+ *
+ * @param pipeline Pipeline to initialize
+ * @param batchSize Max number of items handed over between stages at once
+ */
+void pipelineInit(Pipeline *pipeline, int batchSize)
+{
+	int i;
+
+	for (i = 0; i < PIPELINE_MAX_STAGES - 1; i++) {
+		pipeline->buffers[i] = NULL;
+	}
+
+	pipeline->stageCount = 0;
+	pipeline->batchSize = batchSize;
+	pipeline->startNanos = 0;
+	pipeline->endNanos = 0;
+}
+
+/**
+ * Append a stage to the pipeline.
+ *
+ * The first stage added is the source, the last one is the sink.
+ *
+ * @param pipeline Pipeline to append the stage to
+ * @param name Stage name, used for thread names and statistics
+ * @param threadCount Number of threads running the stage
+ * @param function Work done by the stage on each batch
+ * @param stageArg Argument passed to each call of function
+ * @return Index of new stage, or -1 if there's no room for more stages
+ */
+int pipelineAddStage(Pipeline *pipeline, const char *name, int threadCount,
+		StageFunction function, void *stageArg)
+{
+	PipelineStage *stage;
+
+	if (pipeline->stageCount == PIPELINE_MAX_STAGES) {
+		return -1;
+	}
+
+	stage = &pipeline->stages[pipeline->stageCount];
+	stage->name = name;
+	stage->threadCount = threadCount;
+	stage->function = function;
+	stage->stageArg = stageArg;
+	stage->batchSize = pipeline->batchSize;
+	stage->input = NULL;
+	stage->output = NULL;
+	stage->workers = NULL;
+	stage->threads = NULL;
+	stage->finishedThreadCount = 0;
+	stage->itemsIn = 0;
+	stage->itemsOut = 0;
+	stage->busyNanos = 0;
+	stage->waitInNanos = 0;
+	stage->waitOutNanos = 0;
+	sem_init(&stage->semStatsMutex, 0, 1);
+
+	return pipeline->stageCount++;
+}
+
+/**
+ * Release buffers, protocols and worker memory of a pipeline, whatever of them got allocated.
+ *
+ * @param pipeline Pipeline no thread runs in
+ */
+static void pipelineRelease(Pipeline *pipeline)
+{
+	int i;
+	int j;
+	PipelineStage *stage;
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		stage = &pipeline->stages[i];
+
+		for (j = 0; stage->workers && (j < stage->threadCount); j++) {
+			free(stage->workers[j].inItems);
+			free(stage->workers[j].outItems);
+		}
+		free(stage->workers);
+		free(stage->threads);
+		stage->workers = NULL;
+		stage->threads = NULL;
+	}
+
+	for (i = 0; i < pipeline->stageCount - 1; i++) {
+		if (pipeline->stages[i].output) {
+			protocolDestroy(pipeline->stages[i].output);
+			pipeline->stages[i].output = NULL;
+			pipeline->stages[i + 1].input = NULL;
+		}
+		if (pipeline->buffers[i]) {
+			bufferDestroy(pipeline->buffers[i]);
+			free(pipeline->buffers[i]);
+			pipeline->buffers[i] = NULL;
+		}
+	}
+}
+
+/**
+ * Create buffers between consecutive stages and allocate the memory of all stage threads.
+ *
+ * @param pipeline Pipeline with all stages added
+ * @return 1 on success, 0 on failure, leaving whatever got allocated to pipelineRelease()
+ */
+static int pipelineAllocate(Pipeline *pipeline)
+{
+	int i;
+	int j;
+	PipelineStage *stage;
+
+	// Wire stage i to stage i + 1 through a buffer of its own
+	for (i = 0; i < pipeline->stageCount - 1; i++) {
+		// A buffer whose storage could not be allocated is still safe to destroy
+		if (!(pipeline->buffers[i] = malloc(sizeof(Buffer))) || !bufferInit(pipeline->buffers[i])) {
+			return 0;
+		}
+
+		if (!(pipeline->stages[i].output = protocolCreate(pipeline->buffers[i]))) {
+			return 0;
+		}
+		pipeline->stages[i + 1].input = pipeline->stages[i].output;
+	}
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		stage = &pipeline->stages[i];
+		stage->workers = calloc(stage->threadCount, sizeof(PipelineWorker));
+		stage->threads = malloc(stage->threadCount * sizeof(pthread_t));
+		if (!stage->workers || !stage->threads) {
+			return 0;
+		}
+
+		for (j = 0; j < stage->threadCount; j++) {
+			stage->workers[j].inItems = malloc(stage->batchSize * sizeof(int));
+			stage->workers[j].outItems = malloc(stage->batchSize * sizeof(int));
+			if (!stage->workers[j].inItems || !stage->workers[j].outItems) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Create buffers between consecutive stages and fire up all stage threads.
+ *
+ * Everything is allocated before the first thread starts, so on failure whatever got allocated
+ * is released again and no thread is started.
+ *
+ * @param pipeline Pipeline with all stages added
+ * @return 1 on success, 0 if buffers, protocols or thread memory could not be allocated
+ */
+int pipelineStart(Pipeline *pipeline)
+{
+	int i;
+	int j;
+	PipelineStage *stage;
+
+	if (!pipelineAllocate(pipeline)) {
+		fprintf(stderr, "Could not start pipeline\n");
+		pipelineRelease(pipeline);
+		return 0;
+	}
+
+	pipeline->startNanos = clockNowNanos();
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		stage = &pipeline->stages[i];
+
+		for (j = 0; j < stage->threadCount; j++) {
+			stage->workers[j].stage = stage;
+			snprintf(stage->workers[j].threadName, sizeof(stage->workers[j].threadName),
+					"[%s %3d]", stage->name, j);
+
+			pthread_create(&stage->threads[j], NULL, pipelineWorkerTask, &stage->workers[j]);
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Wait until all stages have processed all items.
+ *
+ * @param pipeline Started pipeline
+ */
+void pipelineJoin(Pipeline *pipeline)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		for (j = 0; j < pipeline->stages[i].threadCount; j++) {
+			pthread_join(pipeline->stages[i].threads[j], NULL);
+		}
+	}
+
+	pipeline->endNanos = clockNowNanos();
+}
+
+/**
+ * Print end-to-end throughput and per stage utilization.
+ *
+ * Items per second count the items entering each stage (generated ones for the source).
+ * Busy is the share of thread time spent in the stage function, wait-in the share spent
+ * waiting for input and wait-out the share spent blocked by the next stage (backpressure).
+ * The stage with the highest busy share is the bottleneck.
+ *
+ * @param pipeline Joined pipeline
+ * @param out Stream to print to
+ */
+void pipelinePrintStats(Pipeline *pipeline, FILE *out)
+{
+	int i;
+	int bottleneckId = 0;
+	double busy;
+	double maxBusy = -1;
+	double threadNanos;
+	double elapsedSeconds = (pipeline->endNanos - pipeline->startNanos) / 1e9;
+	PipelineStage *stage;
+	PipelineStage *source = &pipeline->stages[0];
+
+	fprintf(out, "Elapsed %.3f s, %lld source items went through (%.0f items/s end to end), batch size %d\n",
+			elapsedSeconds, source->itemsOut, source->itemsOut / elapsedSeconds, pipeline->batchSize);
+
+	fprintf(out, "%-12s %7s %12s %12s %12s %7s %8s %9s\n",
+			"stage", "threads", "items in", "items out", "in items/s", "busy", "wait-in", "wait-out");
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		stage = &pipeline->stages[i];
+		threadNanos = (double) stage->threadCount * (pipeline->endNanos - pipeline->startNanos);
+		busy = stage->busyNanos / threadNanos;
+
+		if (busy > maxBusy) {
+			maxBusy = busy;
+			bottleneckId = i;
+		}
+
+		fprintf(out, "%-12s %7d %12lld %12lld %12.0f %6.1f%% %7.1f%% %8.1f%%\n",
+				stage->name, stage->threadCount, stage->itemsIn, stage->itemsOut,
+				(stage->input ? stage->itemsIn : stage->itemsOut) / elapsedSeconds, 100 * busy,
+				100 * stage->waitInNanos / threadNanos, 100 * stage->waitOutNanos / threadNanos);
+	}
+
+	fprintf(out, "Bottleneck stage: %s\n", pipeline->stages[bottleneckId].name);
+}
+
+/**
+ * Release all pipeline resources.
+ *
+ * @param pipeline Joined pipeline, or one that never started
+ */
+void pipelineDestroy(Pipeline *pipeline)
+{
+	int i;
+
+	pipelineRelease(pipeline);
+
+	for (i = 0; i < pipeline->stageCount; i++) {
+		sem_destroy(&pipeline->stages[i].semStatsMutex);
+	}
+
+	pipeline->stageCount = 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * pipeline_bench.c
+ *
+ * Benchmark of a 4-stage pipeline: parse -> transform -> aggregate -> sink.
+ *
+ * Every stage burns a configurable amount of CPU per item, so changing the per stage work or
+ * thread count moves the bottleneck around. Prints end-to-end throughput and per stage
+ * utilization.
+ *
+ * Usage: pipeline_bench [itemCount] [parseThreads] [transformThreads] [aggregateThreads] [sinkThreads] [protocol]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include "main.h"
+
+// Work rounds per item spent by each stage
+#ifndef PARSE_WORK
+#define PARSE_WORK 20
+#endif
+
+#ifndef TRANSFORM_WORK
+#define TRANSFORM_WORK 80
+#endif
+
+#ifndef AGGREGATE_WORK
+#define AGGREGATE_WORK 10
+#endif
+
+#ifndef SINK_WORK
+#define SINK_WORK 5
+#endif
+
+// Number of consecutive items the aggregate stage folds into one
+#define AGGREGATE_WINDOW 8
+
+// Items handed over between stages at once
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 64
+#endif
+
+//
+// Global (shared) variables
+//
+
+// Number of items the source has generated so far, and the total it has to generate
+static long sharedGeneratedCount;
+static long sharedItemCount;
+
+// Sum of all values reaching the sink, just to keep the compiler from optimizing work away
+static long sharedSinkChecksum;
+
+/**
+ * Simulate some CPU work on an item.
+ *
+ * @param value Item value
+ * @param rounds Amount of work
+ * @return New item value in [0, MAX_ITEM_VALUE]
+ */
+static int stageWork(int value, int rounds)
+{
+	unsigned int x = (unsigned int) value;
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		x = x * 1103515245u + 12345u;
+	}
+
+	return (int) (x % (MAX_ITEM_VALUE + 1));
+}
+
+/**
+ * Source stage: "parses" items until sharedItemCount items have been generated.
+ */
+static int parseStage(void *stageArg, const int *inItems, int inCount, int *outItems)
+{
+	long first = __sync_fetch_and_add(&sharedGeneratedCount, inCount);
+	int i;
+
+	for (i = 0; (i < inCount) && (first + i < sharedItemCount); i++) {
+		outItems[i] = stageWork((int) (first + i), PARSE_WORK);
+	}
+
+	return i;
+}
+
+/**
+ * Transform stage: maps each item to a new one.
+ */
+static int transformStage(void *stageArg, const int *inItems, int inCount, int *outItems)
+{
+	int i;
+
+	for (i = 0; i < inCount; i++) {
+		outItems[i] = stageWork(inItems[i], TRANSFORM_WORK);
+	}
+
+	return inCount;
+}
+
+/**
+ * Aggregate stage: folds every AGGREGATE_WINDOW items of a batch into their average.
+ */
+static int aggregateStage(void *stageArg, const int *inItems, int inCount, int *outItems)
+{
+	int i;
+	int outCount = 0;
+	int windowCount = 0;
+	long windowSum = 0;
+
+	for (i = 0; i < inCount; i++) {
+		windowSum += stageWork(inItems[i], AGGREGATE_WORK);
+		windowCount++;
+
+		if ((windowCount == AGGREGATE_WINDOW) || (i == inCount - 1)) {
+			outItems[outCount++] = (int) (windowSum / windowCount);
+			windowSum = 0;
+			windowCount = 0;
+		}
+	}
+
+	return outCount;
+}
+
+/**
+ * Sink stage: swallows items.
+ */
+static int sinkStage(void *stageArg, const int *inItems, int inCount, int *outItems)
+{
+	long sum = 0;
+	int i;
+
+	for (i = 0; i < inCount; i++) {
+		sum += stageWork(inItems[i], SINK_WORK);
+	}
+
+	__sync_fetch_and_add(&sharedSinkChecksum, sum);
+
+	return 0;
+}
+
+/**
+ * Runs the pipeline and checks no item got lost between stages.
+ */
+int main(int argc, char *argv[])
+{
+	Pipeline pipeline;
+	int parseThreads = (argc > 2) ? atoi(argv[2]) : 1;
+	int transformThreads = (argc > 3) ? atoi(argv[3]) : 2;
+	int aggregateThreads = (argc > 4) ? atoi(argv[4]) : 1;
+	int sinkThreads = (argc > 5) ? atoi(argv[5]) : 1;
+
+	sharedItemCount = (argc > 1) ? atol(argv[1]) : 2000000;
+	sharedGeneratedCount = 0;
+
+	// Buffers between stages are protected by the protocol implementation given, if any
+	if ((argc > 6) && !protocolSetDefault(argv[6])) {
+		fprintf(stderr, "Unknown protocol '%s'\n", argv[6]);
+		return 1;
+	}
+	sharedSinkChecksum = 0;
+
+	printf("Pipeline of %ld items, buffer size %d, threads parse/transform/aggregate/sink = %d/%d/%d/%d\n",
+			sharedItemCount, BUFFER_SIZE, parseThreads, transformThreads, aggregateThreads, sinkThreads);
+
+	pipelineInit(&pipeline, BATCH_SIZE);
+	pipelineAddStage(&pipeline, "parse", parseThreads, parseStage, NULL);
+	pipelineAddStage(&pipeline, "transform", transformThreads, transformStage, NULL);
+	pipelineAddStage(&pipeline, "aggregate", aggregateThreads, aggregateStage, NULL);
+	pipelineAddStage(&pipeline, "sink", sinkThreads, sinkStage, NULL);
+
+	if (!pipelineStart(&pipeline)) {
+		pipelineDestroy(&pipeline);
+		return 1;
+	}
+	pipelineJoin(&pipeline);
+	pipelinePrintStats(&pipeline, stdout);
+
+	// Every item parsed must have gone through transform and aggregate
+	if ((pipeline.stages[0].itemsOut != sharedItemCount)
+			|| (pipeline.stages[1].itemsIn != sharedItemCount)
+			|| (pipeline.stages[2].itemsIn != sharedItemCount)
+			|| (pipeline.stages[3].itemsIn != pipeline.stages[2].itemsOut)) {
+		printf("***** FAIL ***** items were lost between stages\n");
+		return 1;
+	}
+
+	printf("Checksum %ld\n", sharedSinkChecksum);
+
+	pipelineDestroy(&pipeline);
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/**
+ * protocol.c
+ *
+ * Runtime selection of protocol implementations.
+ *
+ * Every implementation compiled into the program is listed in protocolOpsTable, so a program
+ * may pick one by name (e.g. from its command line) and benchmarks may run them all back to
+ * back. Protocol functions forward each call to the implementation of the given instance.
+ *
+ * If you ever add your own protocol implementation, add its ProtocolOps to protocolOpsTable.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <string.h>
+#include "main.h"
+
+//
+// Global (shared) variables
+//
+
+// All protocol implementations, NULL terminated
+const ProtocolOps *protocolOpsTable[] = {
+	&threeSemProtocolOps,
+	&mutexCondProtocolOps,
+	&eventFdProtocolOps,
+	&coroutineProtocolOps,
+	NULL
+};
+
+// Implementation used by protocolCreate()
+static const ProtocolOps *sharedDefaultProtocolOps;
+
+/**
+ * Find a protocol implementation by name.
+ *
+ * @param name Name of implementation, e.g. "three_sem"
+ * @return Implementation, NULL if there's no such implementation
+ */
+const ProtocolOps *protocolFind(const char *name)
+{
+	int i;
+
+	for (i = 0; protocolOpsTable[i]; i++) {
+		if (strcmp(protocolOpsTable[i]->name, name) == 0) {
+			return protocolOpsTable[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Set the implementation used by protocolCreate().
+ *
+ * @param name Name of implementation
+ * @return 1 on success, 0 if there's no such implementation
+ */
+int protocolSetDefault(const char *name)
+{
+	const ProtocolOps *ops = protocolFind(name);
+
+	if (!ops) {
+		return 0;
+	}
+
+	sharedDefaultProtocolOps = ops;
+
+	return 1;
+}
+
+/**
+ * Safely consume up to maxCount data items from the consume buffer.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed
+ */
+int protocolConsumeBatch(Protocol *protocol, const char *threadName, int *items, int maxCount)
+{
+	return protocol->ops->consumeBatch(protocol, threadName, items, maxCount);
+}
+
+/**
+ * Safely produce a batch of data items into the produce buffer.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param items Data produced
+ * @param count Number of items
+ */
+void protocolProduceBatch(Protocol *protocol, const char *threadName, const int *items, int count)
+{
+	protocol->ops->produceBatch(protocol, threadName, items, count);
+}
+
+/**
+ * Consume up to maxCount data items without blocking, for event loops.
+ *
+ * Only supported by implementations signaling readiness on file descriptors (see event_fd.c).
+ * Wait for protocolGetConsumeFd() to become readable before trying again.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed,
+ *         PROTOCOL_WOULD_BLOCK if there's nothing to consume yet or the protocol can't tell
+ */
+int protocolTryConsumeBatch(Protocol *protocol, const char *threadName, int *items, int maxCount)
+{
+	if (!protocol->ops->tryConsumeBatch) {
+		return PROTOCOL_WOULD_BLOCK;
+	}
+
+	return protocol->ops->tryConsumeBatch(protocol, threadName, items, maxCount);
+}
+
+/**
+ * Produce up to count data items without blocking, for event loops.
+ *
+ * Only supported by implementations signaling readiness on file descriptors (see event_fd.c).
+ * If not all items fit, wait for protocolGetProduceFd() to become readable before trying again.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param items Data produced
+ * @param count Number of items
+ * @return Number of items produced, 0 if the protocol can't tell
+ */
+int protocolTryProduceBatch(Protocol *protocol, const char *threadName, const int *items, int count)
+{
+	if (!protocol->ops->tryProduceBatch) {
+		return 0;
+	}
+
+	return protocol->ops->tryProduceBatch(protocol, threadName, items, count);
+}
+
+/**
+ * @param protocol Protocol instance
+ * @return Descriptor becoming readable once consumers may proceed, -1 if not supported
+ */
+int protocolGetConsumeFd(Protocol *protocol)
+{
+	return protocol->ops->getConsumeFd ? protocol->ops->getConsumeFd(protocol) : -1;
+}
+
+/**
+ * @param protocol Protocol instance
+ * @return Descriptor becoming readable once producers may proceed, -1 if not supported
+ */
+int protocolGetProduceFd(Protocol *protocol)
+{
+	return protocol->ops->getProduceFd ? protocol->ops->getProduceFd(protocol) : -1;
+}
+
+/**
+ * Safely consume a data item from the consume buffer.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread consuming data.
+ * @return Consumed data, or END_OF_STREAM if the protocol is closed and all items have been consumed
+ */
+int protocolConsumeData(Protocol *protocol, const char *threadName)
+{
+	int data;
+
+	if (protocol->ops->consumeBatch(protocol, threadName, &data, 1) == 0) {
+		return END_OF_STREAM;
+	}
+
+	return data;
+}
+
+/**
+ * Safely produce a new data item into the produce buffer.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread producing data
+ * @param data Data produced
+ */
+void protocolProduceData(Protocol *protocol, const char *threadName, int data)
+{
+	protocol->ops->produceBatch(protocol, threadName, &data, 1);
+}
+
+/**
+ * Tell consumers no more data will be produced.
+ *
+ * Must be called once, after all producers are done producing. Consumers will consume whatever
+ * is left in the buffer and then receive end of stream.
+ *
+ * @param protocol Protocol instance
+ * @param threadName Name of thread closing the protocol
+ */
+void protocolClose(Protocol *protocol, const char *threadName)
+{
+	protocol->ops->close(protocol, threadName);
+}
+
+/**
+ * Create a protocol instance of the default implementation (PROTOCOL_DEFAULT, unless changed
+ * with protocolSetDefault()).
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @return New protocol instance, NULL if it could not be created
+ */
+Protocol *protocolCreate(Buffer *buffer)
+{
+	if (!sharedDefaultProtocolOps && !protocolSetDefault(PROTOCOL_DEFAULT)) {
+		fprintf(stderr, "Unknown protocol implementation '%s'\n", PROTOCOL_DEFAULT);
+		return NULL;
+	}
+
+	return sharedDefaultProtocolOps->create(buffer);
+}
+
+/**
+ * Destroys a protocol instance.
+ *
+ * @param protocol Protocol instance no longer used by any thread
+ */
+void protocolDestroy(Protocol *protocol)
+{
+	protocol->ops->destroy(protocol);
+}
@@ -0,0 +1,274 @@
+/**
+ * protocol_bench.c
+ *
+ * Throughput benchmark of the producers/consumers protocols.
+ *
+ * Producers push a fixed number of items through a single buffer as fast as the protocol lets
+ * them, while consumers drain it. The run is repeated with stats counting off and on, alternately,
+ * reporting the overhead of the instrumentation as the difference of the median rates. A single
+ * run is easily off by 20% or more, so the spread of the runs is reported too: an overhead
+ * within it is noise.
+ *
+ * All protocol implementations compiled in (see protocol.c) are run back to back under the same
+ * conditions, unless a single one is picked by name.
+ *
+ * Usage: protocol_bench [itemCount] [producers] [consumers] [batchSize] [repeats] [protocol]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+//
+// Global (shared) variables
+//
+
+// Protocol instance under test
+static Protocol *sharedProtocol;
+
+// Run parameters
+static long sharedItemCount;
+static int sharedProducerCount;
+static int sharedBatchSize;
+
+// Number of producers done producing, the last one closes the protocol
+static int sharedFinishedProducerCount;
+
+// Number of items consumed during the run
+static long sharedConsumedCount;
+
+/**
+ * Producer thread task.
+ *
+ * Produces its share of sharedItemCount items in batches.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	char threadName[64];
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long itemCount = sharedItemCount / sharedProducerCount;
+	long produced = 0;
+	int batchCount;
+	int i;
+
+	sprintf(threadName, "[prod %3ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	// First producer also takes the remainder
+	if ((long) threadId == 0) {
+		itemCount += sharedItemCount % sharedProducerCount;
+	}
+
+	while (produced < itemCount) {
+		batchCount = (itemCount - produced < sharedBatchSize) ? (int) (itemCount - produced) : sharedBatchSize;
+		for (i = 0; i < batchCount; i++) {
+			items[i] = (int) ((produced + i) % (MAX_ITEM_VALUE + 1));
+		}
+
+		protocolProduceBatch(sharedProtocol, threadName, items, batchCount);
+		produced += batchCount;
+	}
+
+	free(items);
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		protocolClose(sharedProtocol, threadName);
+	}
+
+	return 0;
+}
+
+/**
+ * Consumer thread task.
+ *
+ * Consumes batches until end of stream.
+ *
+ * @param threadId Id assigned to thread. Used to create a unique name for it
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	char threadName[64];
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long consumed = 0;
+	int count;
+
+	sprintf(threadName, "[cons %3ld]", (long) threadId);
+	statsRegisterThread(threadName);
+
+	while ((count = protocolConsumeBatch(sharedProtocol, threadName, items, sharedBatchSize)) > 0) {
+		consumed += count;
+	}
+
+	free(items);
+
+	__sync_fetch_and_add(&sharedConsumedCount, consumed);
+
+	return 0;
+}
+
+/**
+ * Push sharedItemCount items through a fresh buffer.
+ *
+ * @param ops Protocol implementation
+ * @param consumerCount Number of consumer threads
+ * @return Items per second
+ */
+static double benchRun(const ProtocolOps *ops, int consumerCount)
+{
+	long i;
+	long long startNanos;
+	long long elapsedNanos;
+	Buffer buffer;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	pthread_t *consumerThreads = malloc(consumerCount * sizeof(pthread_t));
+
+	if (!bufferInit(&buffer)) {
+		exit(1);
+	}
+	if (!(sharedProtocol = ops->create(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+	sharedFinishedProducerCount = 0;
+	sharedConsumedCount = 0;
+
+	startNanos = clockNowNanos();
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+	for (i = 0; i < consumerCount; i++) {
+		pthread_create(&consumerThreads[i], NULL, benchConsumerThreadTask, (void *) i);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	for (i = 0; i < consumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	if (sharedConsumedCount != sharedItemCount) {
+		fprintf(stderr, "***** FAIL ***** consumed %ld out of %ld items\n", sharedConsumedCount, sharedItemCount);
+		exit(1);
+	}
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return sharedItemCount / (elapsedNanos / 1e9);
+}
+
+/**
+ * qsort() comparator of rates.
+ */
+static int benchCompareRates(const void *a, const void *b)
+{
+	double rateA = *(const double *) a;
+	double rateB = *(const double *) b;
+
+	return (rateA > rateB) - (rateA < rateB);
+}
+
+/**
+ * Sort rates and find their median.
+ *
+ * @param rates Rates, sorted on return
+ * @param count Number of rates
+ * @return Median rate
+ */
+static double benchMedianRate(double *rates, int count)
+{
+	qsort(rates, count, sizeof(double), benchCompareRates);
+
+	return (count % 2) ? rates[count / 2] : (rates[count / 2 - 1] + rates[count / 2]) / 2;
+}
+
+/**
+ * Runs the benchmark with stats off and on, alternately, reporting the median of each.
+ *
+ * @param ops Protocol implementation
+ * @param consumerCount Number of consumer threads
+ * @param repeats Number of runs with stats off and on
+ */
+static void benchProtocol(const ProtocolOps *ops, int consumerCount, int repeats)
+{
+	int i;
+	double medianRateOff;
+	double medianRateOn;
+	double *ratesOff = malloc(repeats * sizeof(double));
+	double *ratesOn = malloc(repeats * sizeof(double));
+
+	for (i = 0; i < repeats; i++) {
+		statsSetEnabled(0);
+		ratesOff[i] = benchRun(ops, consumerCount);
+		printf("%-12s stats off: %12.0f items/s\n", ops->name, ratesOff[i]);
+
+		statsSetEnabled(1);
+		ratesOn[i] = benchRun(ops, consumerCount);
+		printf("%-12s stats on:  %12.0f items/s\n", ops->name, ratesOn[i]);
+	}
+
+	medianRateOff = benchMedianRate(ratesOff, repeats);
+	medianRateOn = benchMedianRate(ratesOn, repeats);
+
+	printf("%-12s median of %d: stats off %.0f items/s (%.0f-%.0f), stats on %.0f items/s (%.0f-%.0f), overhead %.1f%%\n",
+			ops->name, repeats, medianRateOff, ratesOff[0], ratesOff[repeats - 1],
+			medianRateOn, ratesOn[0], ratesOn[repeats - 1],
+			100 * (medianRateOff - medianRateOn) / medianRateOff);
+
+	free(ratesOff);
+	free(ratesOn);
+}
+
+/**
+ * Runs the benchmark for every protocol implementation, or the one given.
+ */
+int main(int argc, char *argv[])
+{
+	int consumerCount;
+	int repeats;
+	int i;
+	const char *protocolName;
+	const ProtocolOps *ops = NULL;
+
+	sharedItemCount = (argc > 1) ? atol(argv[1]) : 2000000;
+	sharedProducerCount = (argc > 2) ? atoi(argv[2]) : PRODUCERS_COUNT;
+	consumerCount = (argc > 3) ? atoi(argv[3]) : CONSUMERS_COUNT;
+	sharedBatchSize = (argc > 4) ? atoi(argv[4]) : 1;
+	repeats = (argc > 5) ? atoi(argv[5]) : 9;
+	protocolName = (argc > 6) ? argv[6] : "all";
+
+	if ((strcmp(protocolName, "all") != 0) && !(ops = protocolFind(protocolName))) {
+		fprintf(stderr, "Unknown protocol '%s'\n", protocolName);
+		return 1;
+	}
+
+	printf("%ld items, %d producers, %d consumers, batch size %d, buffer size %d\n",
+			sharedItemCount, sharedProducerCount, consumerCount, sharedBatchSize, BUFFER_SIZE);
+
+	statsInitDefault("protocol_bench");
+
+	if (strcmp(protocolName, "all") != 0) {
+		benchProtocol(ops, consumerCount, repeats);
+	} else {
+		for (i = 0; protocolOpsTable[i]; i++) {
+			benchProtocol(protocolOpsTable[i], consumerCount, repeats);
+		}
+	}
+
+	statsDump(stdout);
+	statsDestroy();
+
+	return 0;
+}
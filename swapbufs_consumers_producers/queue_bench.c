@@ -0,0 +1,289 @@
+/**
+ * queue_bench.c
+ *
+ * Benchmark of many buffers (queues) drained by a single event-loop thread vs. a consumer
+ * thread per queue.
+ *
+ * A few producer threads push items into queueCount queues, each producer taking care of every
+ * producerCount-th queue, a batch at a time per queue, round-robin. Queues are drained:
+ *
+ * 1. epoll: by one thread waiting on the consume descriptors of all queues (see event_fd.c)
+ *    with epoll and consuming from each ready queue until it would block.
+ * 2. threads: by one consumer thread per queue, blocked in protocolConsumeBatch() of the three
+ *    semaphore protocol.
+ *
+ * Usage: queue_bench [queueCount] [itemsPerQueue] [producers] [batchSize] [epoll|threads|all]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "main.h"
+
+// Stack size of consumer threads, kept small so thousands of them fit in memory
+#define BENCH_STACK_SIZE (64 * 1024)
+
+// Max number of events handled per epoll_wait()
+#define BENCH_MAX_EVENTS 256
+
+//
+// Global (shared) variables
+//
+
+// Run parameters
+static int sharedQueueCount;
+static long sharedItemsPerQueue;
+static int sharedProducerCount;
+static int sharedBatchSize;
+
+// Queues of the current run
+static Buffer *sharedBuffers;
+static Protocol **sharedProtocols;
+
+// Number of items consumed during the run
+static long sharedConsumedCount;
+
+/**
+ * Producer thread task.
+ *
+ * Produces itemsPerQueue items into each of its queues, a batch at a time per queue.
+ *
+ * @param threadId Id assigned to thread. Used to pick its queues
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	long producerId = (long) threadId;
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long produced;
+	int batchCount;
+	int queueId;
+	int i;
+	char threadName[64];
+
+	sprintf(threadName, "[prod %3ld]", producerId);
+	statsRegisterThread(threadName);
+
+	for (produced = 0; produced < sharedItemsPerQueue; produced += batchCount) {
+		batchCount = (sharedItemsPerQueue - produced < sharedBatchSize)
+				? (int) (sharedItemsPerQueue - produced) : sharedBatchSize;
+		for (i = 0; i < batchCount; i++) {
+			items[i] = (int) ((produced + i) % (MAX_ITEM_VALUE + 1));
+		}
+
+		for (queueId = producerId; queueId < sharedQueueCount; queueId += sharedProducerCount) {
+			protocolProduceBatch(sharedProtocols[queueId], threadName, items, batchCount);
+		}
+	}
+
+	for (queueId = producerId; queueId < sharedQueueCount; queueId += sharedProducerCount) {
+		protocolClose(sharedProtocols[queueId], threadName);
+	}
+
+	free(items);
+
+	return 0;
+}
+
+/**
+ * Consumer thread task, for the thread per queue mode.
+ *
+ * @param threadId Id assigned to thread, i.e. the queue it drains
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	long consumed = 0;
+	int count;
+
+	while ((count = protocolConsumeBatch(sharedProtocols[(long) threadId], "[cons]", items, sharedBatchSize)) > 0) {
+		consumed += count;
+	}
+
+	free(items);
+
+	__sync_fetch_and_add(&sharedConsumedCount, consumed);
+
+	return 0;
+}
+
+/**
+ * Drain all queues from the calling thread, using epoll.
+ *
+ * @param waitCount Receives the number of epoll_wait() calls
+ * @param eventCount Receives the number of ready queues handled
+ * @return 0 on success, 1 on epoll failure
+ */
+static int benchEventLoop(long *waitCount, long *eventCount)
+{
+	int i;
+	int count;
+	int readyCount;
+	int openQueueCount = sharedQueueCount;
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	int *items = malloc(sharedBatchSize * sizeof(int));
+	struct epoll_event event;
+	struct epoll_event events[BENCH_MAX_EVENTS];
+
+	statsRegisterThread("[event loop]");
+
+	for (i = 0; i < sharedQueueCount; i++) {
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, protocolGetConsumeFd(sharedProtocols[i]), &event) != 0) {
+			perror("epoll_ctl");
+			return 1;
+		}
+	}
+
+	while (openQueueCount > 0) {
+		readyCount = epoll_wait(epollFd, events, BENCH_MAX_EVENTS, -1);
+		if (readyCount < 0) {
+			// Interrupted by signal
+			continue;
+		}
+
+		(*waitCount)++;
+		*eventCount += readyCount;
+
+		for (i = 0; i < readyCount; i++) {
+			Protocol *protocol = sharedProtocols[events[i].data.u32];
+
+			// Consume until the queue would block, which also clears its descriptor
+			while ((count = protocolTryConsumeBatch(protocol, "[event loop]", items, sharedBatchSize)) > 0) {
+				sharedConsumedCount += count;
+			}
+
+			if (count == 0) {
+				// End of stream, stop watching the queue
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, protocolGetConsumeFd(protocol), NULL);
+				openQueueCount--;
+			}
+		}
+	}
+
+	close(epollFd);
+	free(items);
+
+	return 0;
+}
+
+/**
+ * Push all items through fresh queues.
+ *
+ * @param useEventLoop 1 to drain queues with a single event loop, 0 for a thread per queue
+ * @return 0 on success, 1 if items got lost
+ */
+static int benchRun(int useEventLoop)
+{
+	long i;
+	long waitCount = 0;
+	long eventCount = 0;
+	long long startNanos;
+	long long elapsedNanos;
+	const ProtocolOps *ops = protocolFind(useEventLoop ? "eventfd" : "three_sem");
+	pthread_attr_t attr;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	pthread_t *consumerThreads = NULL;
+
+	sharedBuffers = malloc(sharedQueueCount * sizeof(Buffer));
+	sharedProtocols = malloc(sharedQueueCount * sizeof(Protocol *));
+	sharedConsumedCount = 0;
+
+	for (i = 0; i < sharedQueueCount; i++) {
+		if (!bufferInit(&sharedBuffers[i]) || !(sharedProtocols[i] = ops->create(&sharedBuffers[i]))) {
+			fprintf(stderr, "Could not create queue %ld\n", i);
+			exit(1);
+		}
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+
+	startNanos = clockNowNanos();
+
+	if (!useEventLoop) {
+		consumerThreads = malloc(sharedQueueCount * sizeof(pthread_t));
+		for (i = 0; i < sharedQueueCount; i++) {
+			if (pthread_create(&consumerThreads[i], &attr, benchConsumerThreadTask, (void *) i) != 0) {
+				fprintf(stderr, "Could not create consumer %ld\n", i);
+				exit(1);
+			}
+		}
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+
+	if (useEventLoop && benchEventLoop(&waitCount, &eventCount)) {
+		exit(1);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	if (!useEventLoop) {
+		for (i = 0; i < sharedQueueCount; i++) {
+			pthread_join(consumerThreads[i], NULL);
+		}
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+
+	printf("%-8s %12.0f items/s", useEventLoop ? "epoll" : "threads", sharedConsumedCount / (elapsedNanos / 1e9));
+	if (useEventLoop) {
+		printf(", %ld epoll waits, %.1f ready queues per wait, %.1f items per ready queue",
+				waitCount, (double) eventCount / waitCount, (double) sharedConsumedCount / eventCount);
+	}
+	printf("%s\n", (sharedConsumedCount != sharedQueueCount * sharedItemsPerQueue) ? " ***** FAIL *****" : "");
+
+	for (i = 0; i < sharedQueueCount; i++) {
+		protocolDestroy(sharedProtocols[i]);
+		bufferDestroy(&sharedBuffers[i]);
+	}
+
+	pthread_attr_destroy(&attr);
+	free(sharedProtocols);
+	free(sharedBuffers);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return sharedConsumedCount != sharedQueueCount * sharedItemsPerQueue;
+}
+
+/**
+ * Runs the benchmark in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	const char *mode;
+	int failedRunCount = 0;
+
+	sharedQueueCount = (argc > 1) ? atoi(argv[1]) : 1000;
+	sharedItemsPerQueue = (argc > 2) ? atol(argv[2]) : 10000;
+	sharedProducerCount = (argc > 3) ? atoi(argv[3]) : 4;
+	sharedBatchSize = (argc > 4) ? atoi(argv[4]) : 64;
+	mode = (argc > 5) ? argv[5] : "all";
+
+	printf("%d queues, %ld items per queue, %d producers, batch size %d, buffer size %d\n",
+			sharedQueueCount, sharedItemsPerQueue, sharedProducerCount, sharedBatchSize, BUFFER_SIZE);
+
+	statsInitDefault("queue_bench");
+	statsSetEnabled(0);
+
+	if ((strcmp(mode, "epoll") == 0) || (strcmp(mode, "all") == 0)) {
+		failedRunCount += benchRun(1);
+	}
+	if ((strcmp(mode, "threads") == 0) || (strcmp(mode, "all") == 0)) {
+		failedRunCount += benchRun(0);
+	}
+
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
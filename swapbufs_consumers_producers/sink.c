@@ -0,0 +1,567 @@
+/**
+ * sink.c
+ *
+ * Batched file sink for consumed items.
+ *
+ * Writing every item with its own write() costs a system call per item. A sink copies items
+ * into blocks of SINK_BLOCK_SIZE bytes instead, and writes a block only once it's full, so the
+ * cost of a system call is paid once per block. Blocks are aligned, so the file may be opened
+ * with O_DIRECT (SINK_DIRECT), bypassing the page cache.
+ *
+ * Full blocks are submitted to io_uring, and the sink goes on filling the next block while up
+ * to SINK_QUEUE_DEPTH - 1 blocks are being written, so the consumer calling sinkWrite() rarely
+ * waits for the disk. io_uring is driven with raw system calls, no liburing needed. Blocks are
+ * registered with the kernel up front where possible, sparing it mapping them on every write.
+ *
+ * Where io_uring is not available (older kernels, disabled by seccomp or io_uring_disabled), or
+ * with SINK_PWRITEV, the sink falls back to filling all SINK_QUEUE_DEPTH blocks and writing them
+ * with a single pwritev(), waiting for it.
+ *
+ * A sink is not thread-safe, so every consumer thread should have a sink of its own.
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "main.h"
+
+// Alignment of O_DIRECT offsets and lengths, covering all common logical block sizes
+#define SINK_DIRECT_ALIGNMENT 4096
+
+// A block of items
+typedef struct SinkBlock {
+	char *data;
+
+	// Bytes filled, and bytes of it written so far while it's in flight
+	size_t length;
+	size_t writtenLength;
+
+	// File offset the block is written at
+	off_t offset;
+
+	// Next free block
+	int nextFree;
+} SinkBlock;
+
+struct Sink {
+	int fd;
+	int mode;
+	int isDirect;
+	int isFailed;
+
+	// All blocks, in a single allocation
+	char *memory;
+	SinkBlock blocks[SINK_QUEUE_DEPTH];
+
+	// Block being filled, and stack of free blocks
+	int currentBlock;
+	int freeBlock;
+
+	// Number of blocks being written
+	int inFlightCount;
+
+	// File offset of the next block
+	off_t nextOffset;
+
+	// io_uring file descriptor, rings and submission queue entries
+	int ringFd;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	// Set if blocks are registered, so they're written with IORING_OP_WRITE_FIXED
+	int isRegistered;
+};
+
+/**
+ * Set up an io_uring instance for a sink, registering its blocks.
+ *
+ * @param sink Sink with blocks allocated
+ * @return 1 on success, 0 if io_uring is not available
+ */
+static int sinkRingSetup(Sink *sink)
+{
+	struct io_uring_params params;
+	struct iovec iovecs[SINK_QUEUE_DEPTH];
+	int i;
+
+	memset(&params, 0, sizeof(params));
+
+	sink->ringFd = (int) syscall(__NR_io_uring_setup, SINK_QUEUE_DEPTH, &params);
+	if (sink->ringFd < 0) {
+		return 0;
+	}
+
+	sink->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	sink->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		// Both rings share a single mapping
+		if (sink->cqRingSize > sink->sqRingSize) {
+			sink->sqRingSize = sink->cqRingSize;
+		}
+		sink->cqRingSize = 0;
+	}
+
+	sink->sqRing = mmap(NULL, sink->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			sink->ringFd, IORING_OFF_SQ_RING);
+	sink->cqRing = sink->cqRingSize
+			? mmap(NULL, sink->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					sink->ringFd, IORING_OFF_CQ_RING)
+			: sink->sqRing;
+	sink->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sink->sqes = mmap(NULL, sink->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			sink->ringFd, IORING_OFF_SQES);
+
+	if ((sink->sqRing == MAP_FAILED) || (sink->cqRing == MAP_FAILED) || (sink->sqes == MAP_FAILED)) {
+		// Unmap whatever did get mapped
+		if (sink->sqes != MAP_FAILED) {
+			munmap(sink->sqes, sink->sqesSize);
+		}
+		if ((sink->cqRing != MAP_FAILED) && (sink->cqRing != sink->sqRing)) {
+			munmap(sink->cqRing, sink->cqRingSize);
+		}
+		if (sink->sqRing != MAP_FAILED) {
+			munmap(sink->sqRing, sink->sqRingSize);
+		}
+		close(sink->ringFd);
+		return 0;
+	}
+
+	sink->sqTail = (unsigned *) ((char *) sink->sqRing + params.sq_off.tail);
+	sink->sqMask = (unsigned *) ((char *) sink->sqRing + params.sq_off.ring_mask);
+	sink->sqArray = (unsigned *) ((char *) sink->sqRing + params.sq_off.array);
+	sink->cqHead = (unsigned *) ((char *) sink->cqRing + params.cq_off.head);
+	sink->cqTail = (unsigned *) ((char *) sink->cqRing + params.cq_off.tail);
+	sink->cqMask = (unsigned *) ((char *) sink->cqRing + params.cq_off.ring_mask);
+	sink->cqes = (struct io_uring_cqe *) ((char *) sink->cqRing + params.cq_off.cqes);
+
+	// Registering blocks is an optimization only, plain writes do without it
+	for (i = 0; i < SINK_QUEUE_DEPTH; i++) {
+		iovecs[i].iov_base = sink->blocks[i].data;
+		iovecs[i].iov_len = SINK_BLOCK_SIZE;
+	}
+	sink->isRegistered = (syscall(__NR_io_uring_register, sink->ringFd, IORING_REGISTER_BUFFERS,
+			iovecs, SINK_QUEUE_DEPTH) == 0);
+
+	return 1;
+}
+
+/**
+ * Release the io_uring instance of a sink.
+ *
+ * @param sink Sink using io_uring
+ */
+static void sinkRingDestroy(Sink *sink)
+{
+	munmap(sink->sqes, sink->sqesSize);
+	if (sink->cqRing != sink->sqRing) {
+		munmap(sink->cqRing, sink->cqRingSize);
+	}
+	munmap(sink->sqRing, sink->sqRingSize);
+	close(sink->ringFd);
+}
+
+/**
+ * Queue the (rest of the) write of a block to io_uring and submit it.
+ *
+ * If the kernel doesn't take the write, the sink is marked failed and the block is pushed back
+ * to the free stack, as if written.
+ *
+ * @param sink Sink using io_uring
+ * @param blockId Block to write, counted in inFlightCount
+ */
+static void sinkRingSubmit(Sink *sink, int blockId)
+{
+	SinkBlock *block = &sink->blocks[blockId];
+	unsigned tail = *sink->sqTail;
+	unsigned index = tail & *sink->sqMask;
+	struct io_uring_sqe *sqe = &sink->sqes[index];
+	long submitted;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = sink->isRegistered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = sink->fd;
+	sqe->addr = (unsigned long) (block->data + block->writtenLength);
+	sqe->len = (unsigned) (block->length - block->writtenLength);
+	sqe->off = block->offset + block->writtenLength;
+	sqe->buf_index = (unsigned short) blockId;
+	sqe->user_data = blockId;
+
+	sink->sqArray[index] = index;
+
+	// Make the entry visible to the kernel before the new tail
+	__atomic_store_n(sink->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	while (((submitted = syscall(__NR_io_uring_enter, sink->ringFd, 1, 0, 0, NULL, 0)) < 0) && (errno == EINTR)) {
+		// Interrupted by signal, try again
+	}
+
+	if (submitted != 1) {
+		fprintf(stderr, "Sink submit failed: %s\n", (submitted < 0) ? strerror(errno) : "entry not taken");
+
+		// The kernel didn't consume the entry, take it back so it's never submitted later
+		__atomic_store_n(sink->sqTail, tail, __ATOMIC_RELEASE);
+
+		sink->isFailed = 1;
+		block->nextFree = sink->freeBlock;
+		sink->freeBlock = blockId;
+		sink->inFlightCount--;
+	}
+}
+
+/**
+ * Handle completed writes, waiting for at least one if asked to.
+ *
+ * Blocks fully written are pushed back to the free stack, partially written ones are submitted
+ * again for the rest.
+ *
+ * If waiting fails, the sink is marked failed, as completions may never come.
+ *
+ * @param sink Sink using io_uring
+ * @param isWaiting 1 to wait for at least one completion
+ * @return 1 on success, 0 if waiting failed
+ */
+static int sinkRingReap(Sink *sink, int isWaiting)
+{
+	unsigned head = *sink->cqHead;
+	struct io_uring_cqe *cqe;
+	SinkBlock *block;
+	int blockId;
+	long result;
+
+	if (isWaiting && (head == __atomic_load_n(sink->cqTail, __ATOMIC_ACQUIRE))) {
+		while (((result = syscall(__NR_io_uring_enter, sink->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0)
+				&& (errno == EINTR)) {
+			// Interrupted by signal, try again
+		}
+
+		if (result < 0) {
+			perror("Sink io_uring_enter");
+			sink->isFailed = 1;
+			return 0;
+		}
+	}
+
+	while (head != __atomic_load_n(sink->cqTail, __ATOMIC_ACQUIRE)) {
+		cqe = &sink->cqes[head & *sink->cqMask];
+		blockId = (int) cqe->user_data;
+		block = &sink->blocks[blockId];
+
+		if (cqe->res < 0) {
+			fprintf(stderr, "Sink write failed: %s\n", strerror(-cqe->res));
+			sink->isFailed = 1;
+			block->writtenLength = block->length;
+		} else {
+			block->writtenLength += cqe->res;
+		}
+
+		if ((block->writtenLength < block->length) && (cqe->res > 0)) {
+			// Short write, go on with the rest of the block
+			sinkRingSubmit(sink, blockId);
+		} else {
+			if (block->writtenLength < block->length) {
+				fprintf(stderr, "Sink write made no progress\n");
+				sink->isFailed = 1;
+			}
+
+			block->nextFree = sink->freeBlock;
+			sink->freeBlock = blockId;
+			sink->inFlightCount--;
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(sink->cqHead, head, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/**
+ * Write all filled blocks with a single pwritev(), for the fallback mode.
+ *
+ * Blocks are filled in order at consecutive offsets, so they're contiguous in the file.
+ *
+ * @param sink Sink using pwritev()
+ */
+static void sinkPwritevFlush(Sink *sink)
+{
+	struct iovec iovecs[SINK_QUEUE_DEPTH];
+	ssize_t written;
+	size_t totalLength = 0;
+	off_t offset = sink->blocks[0].offset;
+	int iovecCount = 0;
+	int i;
+
+	for (i = 0; i < SINK_QUEUE_DEPTH; i++) {
+		if (sink->blocks[i].length > 0) {
+			iovecs[iovecCount].iov_base = sink->blocks[i].data;
+			iovecs[iovecCount].iov_len = sink->blocks[i].length;
+			totalLength += sink->blocks[i].length;
+			iovecCount++;
+		}
+	}
+
+	while (totalLength > 0) {
+		written = pwritev(sink->fd, iovecs, iovecCount, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("Sink pwritev");
+			sink->isFailed = 1;
+			break;
+		}
+
+		// Short write, skip what's been written
+		offset += written;
+		totalLength -= written;
+		for (i = 0; (i < iovecCount) && (written > 0); i++) {
+			if ((size_t) written >= iovecs[i].iov_len) {
+				written -= iovecs[i].iov_len;
+				iovecs[i].iov_len = 0;
+			} else {
+				iovecs[i].iov_base = (char *) iovecs[i].iov_base + written;
+				iovecs[i].iov_len -= written;
+				written = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < SINK_QUEUE_DEPTH; i++) {
+		sink->blocks[i].length = 0;
+	}
+}
+
+/**
+ * Hand the current block over for writing and move on to the next one.
+ *
+ * @param sink Sink
+ */
+static void sinkSubmitCurrent(Sink *sink)
+{
+	SinkBlock *block;
+	size_t paddedLength;
+
+	if (sink->currentBlock < 0) {
+		// Failed with every block stuck in flight
+		return;
+	}
+
+	block = &sink->blocks[sink->currentBlock];
+	paddedLength = block->length;
+
+	if (block->length == 0) {
+		return;
+	}
+
+	if (sink->isDirect) {
+		// Direct writes must cover whole blocks, the padding is truncated away on close
+		paddedLength = (block->length + SINK_DIRECT_ALIGNMENT - 1) / SINK_DIRECT_ALIGNMENT * SINK_DIRECT_ALIGNMENT;
+		memset(block->data + block->length, 0, paddedLength - block->length);
+	}
+
+	block->offset = sink->nextOffset;
+	block->writtenLength = 0;
+	sink->nextOffset += block->length;
+
+	if (sink->mode == SINK_MODE_PWRITEV) {
+		block->length = paddedLength;
+
+		if (++sink->currentBlock == SINK_QUEUE_DEPTH) {
+			sinkPwritevFlush(sink);
+			sink->currentBlock = 0;
+		}
+		return;
+	}
+
+	block->length = paddedLength;
+	sink->inFlightCount++;
+	sinkRingSubmit(sink, sink->currentBlock);
+
+	// Pick up finished writes without waiting, and wait only if no block is free
+	sinkRingReap(sink, 0);
+	while (sink->freeBlock < 0) {
+		if (!sinkRingReap(sink, 1)) {
+			// No block will ever be free again, drop whatever else is written
+			sink->currentBlock = -1;
+			return;
+		}
+	}
+
+	sink->currentBlock = sink->freeBlock;
+	sink->freeBlock = sink->blocks[sink->currentBlock].nextFree;
+	sink->blocks[sink->currentBlock].length = 0;
+}
+
+/**
+ * Create a file sink.
+ *
+ * @param path File to write, created or truncated
+ * @param flags Any combination of SINK_DIRECT and SINK_PWRITEV
+ * @return New sink, NULL if the file could not be opened or memory allocated
+ */
+Sink *sinkCreate(const char *path, int flags)
+{
+	Sink *sink = calloc(1, sizeof(Sink));
+	int i;
+
+	if (!sink) {
+		return NULL;
+	}
+
+	sink->isDirect = (flags & SINK_DIRECT) != 0;
+	sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (sink->isDirect ? O_DIRECT : 0), 0644);
+	if ((sink->fd < 0) && sink->isDirect) {
+		// E.g. tmpfs doesn't do direct I/O
+		fprintf(stderr, "Warning: could not open %s for direct I/O (%s), using the page cache\n",
+				path, strerror(errno));
+		sink->isDirect = 0;
+		sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (sink->fd < 0) {
+		perror(path);
+		free(sink);
+		return NULL;
+	}
+
+	// Memory is page aligned, which covers direct I/O alignment as well
+	if (!(sink->memory = memoryAlloc("sink", (size_t) SINK_QUEUE_DEPTH * SINK_BLOCK_SIZE))) {
+		close(sink->fd);
+		free(sink);
+		return NULL;
+	}
+
+	sink->freeBlock = -1;
+	for (i = SINK_QUEUE_DEPTH - 1; i >= 0; i--) {
+		sink->blocks[i].data = sink->memory + (size_t) i * SINK_BLOCK_SIZE;
+		sink->blocks[i].nextFree = sink->freeBlock;
+		sink->freeBlock = i;
+	}
+
+	if (!(flags & SINK_PWRITEV) && sinkRingSetup(sink)) {
+		sink->mode = SINK_MODE_IO_URING;
+	} else {
+		sink->mode = SINK_MODE_PWRITEV;
+	}
+
+	sink->currentBlock = sink->freeBlock;
+	sink->freeBlock = sink->blocks[sink->currentBlock].nextFree;
+
+	return sink;
+}
+
+/**
+ * Append items to the file, writing blocks as they fill up.
+ *
+ * Once the sink has failed with no block left to fill, items are dropped; sinkClose() reports
+ * the failure.
+ *
+ * @param sink Sink
+ * @param items Items to append
+ * @param count Number of items
+ */
+void sinkWrite(Sink *sink, const int *items, int count)
+{
+	SinkBlock *block;
+	size_t length;
+	size_t bytes = count * sizeof(int);
+	const char *data = (const char *) items;
+
+	while ((bytes > 0) && (sink->currentBlock >= 0)) {
+		block = &sink->blocks[sink->currentBlock];
+
+		length = SINK_BLOCK_SIZE - block->length;
+		if (length > bytes) {
+			length = bytes;
+		}
+
+		memcpy(block->data + block->length, data, length);
+		block->length += length;
+		data += length;
+		bytes -= length;
+
+		if (block->length == SINK_BLOCK_SIZE) {
+			sinkSubmitCurrent(sink);
+		}
+	}
+}
+
+/**
+ * Write whatever is left, wait for all writes, sync the file to disk and release the sink.
+ *
+ * @param sink Sink
+ * @return 1 on success, 0 if any write failed
+ */
+int sinkClose(Sink *sink)
+{
+	int isSucceeded;
+
+	sinkSubmitCurrent(sink);
+
+	if (sink->mode == SINK_MODE_PWRITEV) {
+		sinkPwritevFlush(sink);
+	} else {
+		while ((sink->inFlightCount > 0) && sinkRingReap(sink, 1)) {
+			// Wait for all writes
+		}
+		sinkRingDestroy(sink);
+	}
+
+	// Drop the padding of the last direct write
+	if (sink->isDirect && (ftruncate(sink->fd, sink->nextOffset) != 0)) {
+		perror("Sink ftruncate");
+		sink->isFailed = 1;
+	}
+
+	if (fdatasync(sink->fd) != 0) {
+		perror("Sink fdatasync");
+		sink->isFailed = 1;
+	}
+
+	close(sink->fd);
+	memoryFree(sink->memory);
+
+	isSucceeded = !sink->isFailed;
+	free(sink);
+
+	return isSucceeded;
+}
+
+/**
+ * @param sink Sink
+ * @return SINK_MODE_IO_URING or SINK_MODE_PWRITEV
+ */
+int sinkGetMode(Sink *sink)
+{
+	return sink->mode;
+}
+
+/**
+ * @param mode Sink mode
+ * @return Readable name of mode
+ */
+const char *sinkModeName(int mode)
+{
+	return (mode == SINK_MODE_IO_URING) ? "io_uring" : "pwritev";
+}
@@ -0,0 +1,299 @@
+/**
+ * sink_bench.c
+ *
+ * Benchmark of consumers persisting items to files: one write() per item vs. batched sinks
+ * (see sink.c).
+ *
+ * Producers push itemCount items through the buffer as fast as they can, and each consumer
+ * writes everything it consumes to a file of its own (path.0, path.1, ...), syncing it at the
+ * end. Consumers write:
+ *
+ * 1. write: one write() per item, as naive consumers do
+ * 2. pwritev: in blocks, SINK_QUEUE_DEPTH blocks per pwritev()
+ * 3. io_uring: in blocks, several of them written while the consumer goes on consuming
+ * 4. io_uring+direct: the same, bypassing the page cache with O_DIRECT
+ *
+ * Files are read back and checked against what's been produced.
+ *
+ * Usage: sink_bench [itemCount] [producers] [consumers] [path] [write|pwritev|io_uring|direct|all]
+ *
+ * @author Konstantinos Filios <konfilios@gmail.com>
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+
+// Max number of items consumed at once
+#define BENCH_BATCH_SIZE 256
+
+// A way of writing to benchmark
+typedef struct BenchMode {
+	const char *name;
+
+	// Sink flags, or -1 for a write() per item
+	int sinkFlags;
+} BenchMode;
+
+// Ways of writing to benchmark, in order
+static const BenchMode benchModes[] = {
+	{ "write", -1 },
+	{ "pwritev", SINK_PWRITEV },
+	{ "io_uring", 0 },
+	{ "direct", SINK_DIRECT },
+};
+
+//
+// Global (shared) variables
+//
+
+// Protocol instance under test
+static Protocol *sharedProtocol;
+
+// Run parameters
+static long sharedItemCount;
+static int sharedProducerCount;
+static const char *sharedPath;
+static const BenchMode *sharedMode;
+
+// Number of producers done producing, the last one closes the protocol
+static int sharedFinishedProducerCount;
+
+// Sink mode actually used by consumers, and number of consumers failing to write
+static int sharedSinkMode;
+static int sharedFailedCount;
+
+/**
+ * Producer thread task.
+ *
+ * Produces its share of sharedItemCount items in batches.
+ *
+ * @param threadId Id assigned to thread
+ * @return
+ */
+static void *benchProducerThreadTask(void *threadId)
+{
+	int items[BENCH_BATCH_SIZE];
+	long itemCount = sharedItemCount / sharedProducerCount;
+	long produced = 0;
+	int batchCount;
+	int i;
+
+	// First producer also takes the remainder
+	if ((long) threadId == 0) {
+		itemCount += sharedItemCount % sharedProducerCount;
+	}
+
+	while (produced < itemCount) {
+		batchCount = (itemCount - produced < BENCH_BATCH_SIZE) ? (int) (itemCount - produced) : BENCH_BATCH_SIZE;
+		for (i = 0; i < batchCount; i++) {
+			items[i] = (int) ((produced + i) % (MAX_ITEM_VALUE + 1));
+		}
+
+		protocolProduceBatch(sharedProtocol, "[prod]", items, batchCount);
+		produced += batchCount;
+	}
+
+	if (__sync_add_and_fetch(&sharedFinishedProducerCount, 1) == sharedProducerCount) {
+		protocolClose(sharedProtocol, "[prod]");
+	}
+
+	return 0;
+}
+
+/**
+ * Consumer thread task.
+ *
+ * Writes every item consumed to its own file, the way the current mode says.
+ *
+ * @param threadId Id assigned to thread. Used to name its file
+ * @return
+ */
+static void *benchConsumerThreadTask(void *threadId)
+{
+	int items[BENCH_BATCH_SIZE];
+	char path[4096];
+	Sink *sink = NULL;
+	int fd = -1;
+	int count;
+	int i;
+
+	snprintf(path, sizeof(path), "%s.%ld", sharedPath, (long) threadId);
+
+	if (sharedMode->sinkFlags >= 0) {
+		if (!(sink = sinkCreate(path, sharedMode->sinkFlags))) {
+			exit(1);
+		}
+		sharedSinkMode = sinkGetMode(sink);
+	} else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	while ((count = protocolConsumeBatch(sharedProtocol, "[cons]", items, BENCH_BATCH_SIZE)) > 0) {
+		if (sink) {
+			sinkWrite(sink, items, count);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (write(fd, &items[i], sizeof(int)) != sizeof(int)) {
+				perror("write");
+				__sync_fetch_and_add(&sharedFailedCount, 1);
+				break;
+			}
+		}
+	}
+
+	if (sink) {
+		if (!sinkClose(sink)) {
+			__sync_fetch_and_add(&sharedFailedCount, 1);
+		}
+	} else {
+		fdatasync(fd);
+		close(fd);
+	}
+
+	return 0;
+}
+
+/**
+ * Read back the files written and remove them.
+ *
+ * @param consumerCount Number of consumers, i.e. files
+ * @return 1 if files hold exactly what's been produced, 0 otherwise
+ */
+static int benchVerify(int consumerCount)
+{
+	int items[BENCH_BATCH_SIZE];
+	char path[4096];
+	long itemCount = 0;
+	long long sum = 0;
+	long long expectedSum = 0;
+	ssize_t bytes;
+	long i;
+	int fd;
+
+	for (i = 0; i < consumerCount; i++) {
+		snprintf(path, sizeof(path), "%s.%ld", sharedPath, i);
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			perror(path);
+			return 0;
+		}
+
+		while ((bytes = read(fd, items, sizeof(items))) > 0) {
+			itemCount += bytes / sizeof(int);
+			while (bytes > 0) {
+				bytes -= sizeof(int);
+				sum += items[bytes / sizeof(int)];
+			}
+		}
+
+		close(fd);
+		unlink(path);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		long producerItemCount = sharedItemCount / sharedProducerCount + ((i == 0) ? sharedItemCount % sharedProducerCount : 0);
+		long j;
+
+		for (j = 0; j < producerItemCount; j++) {
+			expectedSum += j % (MAX_ITEM_VALUE + 1);
+		}
+	}
+
+	return (itemCount == sharedItemCount) && (sum == expectedSum);
+}
+
+/**
+ * Push all items through a fresh buffer into files.
+ *
+ * @param mode Way of writing
+ * @param consumerCount Number of consumers
+ * @return 0 on success, 1 if files don't hold what's been produced
+ */
+static int benchRun(const BenchMode *mode, int consumerCount)
+{
+	Buffer buffer;
+	long i;
+	long long startNanos;
+	long long elapsedNanos;
+	int isVerified;
+	pthread_t *producerThreads = malloc(sharedProducerCount * sizeof(pthread_t));
+	pthread_t *consumerThreads = malloc(consumerCount * sizeof(pthread_t));
+
+	if (!bufferInit(&buffer)) {
+		return 1;
+	}
+	if (!(sharedProtocol = protocolCreate(&buffer))) {
+		fprintf(stderr, "Could not create protocol\n");
+		exit(1);
+	}
+	sharedMode = mode;
+	sharedFinishedProducerCount = 0;
+	sharedFailedCount = 0;
+
+	startNanos = clockNowNanos();
+
+	for (i = 0; i < consumerCount; i++) {
+		pthread_create(&consumerThreads[i], NULL, benchConsumerThreadTask, (void *) i);
+	}
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_create(&producerThreads[i], NULL, benchProducerThreadTask, (void *) i);
+	}
+
+	for (i = 0; i < sharedProducerCount; i++) {
+		pthread_join(producerThreads[i], NULL);
+	}
+	for (i = 0; i < consumerCount; i++) {
+		pthread_join(consumerThreads[i], NULL);
+	}
+
+	elapsedNanos = clockNowNanos() - startNanos;
+	isVerified = !sharedFailedCount && benchVerify(consumerCount);
+
+	printf("%-10s %-10s %12.0f items/s, %8.1f ms%s\n", mode->name,
+			(mode->sinkFlags >= 0) ? sinkModeName(sharedSinkMode) : "",
+			sharedItemCount / (elapsedNanos / 1e9), elapsedNanos / 1e6,
+			isVerified ? "" : " ***** FAIL *****");
+
+	protocolDestroy(sharedProtocol);
+	bufferDestroy(&buffer);
+	free(producerThreads);
+	free(consumerThreads);
+
+	return !isVerified;
+}
+
+/**
+ * Runs the benchmark in the modes asked for.
+ */
+int main(int argc, char *argv[])
+{
+	int consumerCount = (argc > 3) ? atoi(argv[3]) : 1;
+	const char *modeName = (argc > 5) ? argv[5] : "all";
+	int failedRunCount = 0;
+	int i;
+
+	sharedItemCount = (argc > 1) ? atol(argv[1]) : 4000000;
+	sharedProducerCount = (argc > 2) ? atoi(argv[2]) : 2;
+	sharedPath = (argc > 4) ? argv[4] : "sink_bench.dat";
+
+	printf("%ld items, %d producers, %d consumers, buffer size %d, sink blocks %d x %d bytes\n",
+			sharedItemCount, sharedProducerCount, consumerCount, BUFFER_SIZE, SINK_QUEUE_DEPTH, SINK_BLOCK_SIZE);
+
+	statsInitDefault("sink_bench");
+	statsSetEnabled(0);
+
+	for (i = 0; i < (int) (sizeof(benchModes) / sizeof(benchModes[0])); i++) {
+		if ((strcmp(modeName, benchModes[i].name) == 0) || (strcmp(modeName, "all") == 0)) {
+			failedRunCount += benchRun(&benchModes[i], consumerCount);
+		}
+	}
+
+	statsDestroy();
+
+	return failedRunCount ? 1 : 0;
+}
@@ -5,148 +5,411 @@
  * 1. mutex: Protects critical section (buffer manipulation)
  * 2. mayProduce: Signals producers to proceed
  * 3. mayConsume: Signals consumers to proceed
- * 
+ *
+ * Each Protocol instance wraps its own buffer with its own set of semaphores. Picked by name
+ * "three_sem" (see protocol.c).
+ *
+ * The same protocol also runs on coroutine semaphores (see coroutine.c), picked by name
+ * "coroutine": a producer or consumer coroutine that may not proceed is suspended rather than
+ * blocking its thread, and whoever posts the semaphore (e.g. the coroutine swapping the buffers)
+ * puts it back on the run queue. So thousands of producers and consumers may share a few
+ * scheduler threads. Plain threads may use it too, blocking as usual. The two only differ in the
+ * kind of semaphores waited on and posted, picked by a flag checked inline (threeSemWait(),
+ * threeSemPost()), so the POSIX path makes direct calls only.
+ *
+ * Semaphore waits and produced/consumed items are counted in stats.c. Waits on coroutine
+ * semaphores aren't, as suspensions are cheap.
+ *
  * @author Konstantinos Filios <konfilios@gmail.com>
  */
 
 #include <semaphore.h>
-#include "main.h"
+#include <stdlib.h>
+#include "buffer.h"
+
+// A semaphore of either kind
+typedef union ThreeSemSemaphore {
+	sem_t posix;
+	CoroutineSem coroutine;
+} ThreeSemSemaphore;
+
+typedef struct ThreeSemProtocol {
+	// Common protocol state, including the buffer protected by this protocol instance
+	Protocol base;
+
+	// Set if the semaphores below are coroutine semaphores, POSIX ones otherwise
+	int isCoroutine;
 
-//
-// Global (shared) variables
-//
+	// Mutex regulating exclusive access to buffer manipulation sections (critical sections)
+	ThreeSemSemaphore sharedSemMutex;
 
-// Mutex regulating exclusive access to buffer manipulation sections (critical sections)
-static sem_t sharedSemMutex;
+	// Signaling semaphore telling producers if they can proceed with producing items
+	ThreeSemSemaphore sharedSemMayProduce;
 
-// Signaling semaphore telling consumers if they can proceed with consuming items
-static sem_t sharedSemMayProduce;
+	// Signaling semaphore telling consumers if they can proceed with consuming items
+	ThreeSemSemaphore sharedSemMayConsume;
+
+	// Set once producers are done, so consumers may drain a partially filled produce buffer
+	int sharedClosed;
+} ThreeSemProtocol;
+
+/**
+ * Wait on a semaphore of a protocol instance.
+ *
+ * POSIX semaphores are busy-polled if the calling thread is in low latency mode (see latency.c),
+ * waiting coroutines are suspended.
+ *
+ * @param protocol Protocol instance
+ * @param sem Semaphore of protocol to wait on
+ * @param semId Id of semaphore in stats, waits on coroutine semaphores aren't counted
+ */
+static inline void threeSemWait(ThreeSemProtocol *protocol, ThreeSemSemaphore *sem, int semId)
+{
+	if (protocol->isCoroutine) {
+		coroutineSemWait(&sem->coroutine);
+	} else {
+		latencySemWait(&sem->posix, semId);
+	}
+}
 
-// Signaling semaphore telling producers if they can proceed with producing items
-static sem_t sharedSemMayConsume;
+/**
+ * Post a semaphore of a protocol instance.
+ *
+ * @param protocol Protocol instance
+ * @param sem Semaphore of protocol to post
+ */
+static inline void threeSemPost(ThreeSemProtocol *protocol, ThreeSemSemaphore *sem)
+{
+	if (protocol->isCoroutine) {
+		coroutineSemPost(&sem->coroutine);
+	} else {
+		sem_post(&sem->posix);
+	}
+}
 
 /**
- * Safely produce a new data item into the produce buffer.
+ * Initialize a semaphore of a protocol instance.
  *
+ * @param protocol Protocol instance
+ * @param sem Semaphore of protocol to initialize
+ * @param value Initial value
+ */
+static void threeSemInit(ThreeSemProtocol *protocol, ThreeSemSemaphore *sem, int value)
+{
+	if (protocol->isCoroutine) {
+		coroutineSemInit(&sem->coroutine, value);
+	} else {
+		sem_init(&sem->posix, 0, value);
+	}
+}
+
+/**
+ * Destroy a semaphore of a protocol instance.
+ *
+ * @param protocol Protocol instance
+ * @param sem Semaphore of protocol to destroy
+ */
+static void threeSemSemDestroy(ThreeSemProtocol *protocol, ThreeSemSemaphore *sem)
+{
+	if (protocol->isCoroutine) {
+		coroutineSemDestroy(&sem->coroutine);
+	} else {
+		sem_destroy(&sem->posix);
+	}
+}
+
+/**
+ * Safely produce a batch of data items into the produce buffer.
+ *
+ * Items are pushed as long as there's room in the produce buffer, so a batch may be split
+ * across several buffer swaps.
+ *
+ * @param baseProtocol Protocol instance
  * @param threadName Name of thread producing data
- * @param data Data produced
+ * @param items Data produced
+ * @param count Number of items
  */
-void protocolProduceData(const char *threadName, int data)
+static void threeSemProduceBatch(Protocol *baseProtocol, const char *threadName, const int *items, int count)
 {
-	fprintf(stderr, "%s Waiting on produce semaphore\n", threadName);
+	ThreeSemProtocol *protocol = (ThreeSemProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int produced = 0;
+	int batchStart;
+
+	while (produced < count) {
+		TRACE("%s Waiting on produce semaphore\n", threadName);
 
-	// Wait until there's room for producing
-	sem_wait(&sharedSemMayProduce);
+		// Wait until there's room for producing
+		threeSemWait(protocol, &protocol->sharedSemMayProduce, STATS_SEM_MAY_PRODUCE);
 
-	fprintf(stderr, "%s Waiting on mutex\n", threadName);
+		TRACE("%s Waiting on mutex\n", threadName);
 
-	// Found some room, get exclusive access to shared buffer variables
-	sem_wait(&sharedSemMutex);
+		// Found some room, get exclusive access to shared buffer variables
+		threeSemWait(protocol, &protocol->sharedSemMutex, STATS_SEM_MUTEX);
 
-	fprintf(stderr, "%s Acquired mutex\n", threadName);
+		TRACE("%s Acquired mutex\n", threadName);
 
-	// Push data to buffer
-	bufferProduceData(threadName, data);
+		// Push as much data as fits to buffer
+		batchStart = produced;
+		while ((produced < count) && !bufferProduceIsExhausted(buffer)) {
+			bufferProduceData(buffer, threadName, items[produced++]);
+		}
 
-	// Check if produce buffer got full
-	if (bufferProduceIsExhausted()) {
-		fprintf(stderr, "\t%s Produce buffer exhausted\n", threadName);
+		STATS_COUNT(STATS_COUNTER_PRODUCED_ITEMS, produced - batchStart);
 
-		// Produce buffer is indeed full, check what's the deal with the consume buffer
-		if (bufferConsumeIsExhausted()) {
-			fprintf(stderr, "\t%s Consume buffer also exhausted\n", threadName);
+		// Check if produce buffer got full
+		if (bufferProduceIsExhausted(buffer)) {
+			TRACE("\t%s Produce buffer exhausted\n", threadName);
 
-			// Consume buffer is also exhausted, time for swap
-			bufferSwap(threadName);
+			// Produce buffer is indeed full, check what's the deal with the consume buffer
+			if (bufferConsumeIsExhausted(buffer)) {
+				TRACE("\t%s Consume buffer also exhausted\n", threadName);
 
-			fprintf(stderr, "\t%s Signaling consumers and producers\n", threadName);
+				// Consume buffer is also exhausted, time for swap
+				bufferSwap(buffer, threadName);
 
-			// Signal both consumers and producers
-			sem_post(&sharedSemMayConsume);
-			sem_post(&sharedSemMayProduce);
+				TRACE("\t%s Signaling consumers and producers\n", threadName);
+
+				// Signal both consumers and producers
+				threeSemPost(protocol, &protocol->sharedSemMayConsume);
+				threeSemPost(protocol, &protocol->sharedSemMayProduce);
+			} else {
+				TRACE("\t%s Consume buffer still active, producers will have to wait\n", threadName);
+			}
 		} else {
-			fprintf(stderr, "\t%s Consume buffer still active, producers will have to wait\n", threadName);
-		}
-	} else {
-		fprintf(stderr, "\t%s Still room for producing, signaling producers\n", threadName);
+			TRACE("\t%s Still room for producing, signaling producers\n", threadName);
 
-		// There's still room for producing, allow other producers to proceed
-		sem_post(&sharedSemMayProduce);
-	}
+			// There's still room for producing, allow other producers to proceed
+			threeSemPost(protocol, &protocol->sharedSemMayProduce);
+		}
 
-	// Release mutex
-	sem_post(&sharedSemMutex);
+		// Release mutex
+		threeSemPost(protocol, &protocol->sharedSemMutex);
 
-	fprintf(stderr, "%s Released mutex\n", threadName);
+		TRACE("%s Released mutex\n", threadName);
+	}
 }
 
 /**
- * Safely consume a data item from the consume buffer.
+ * Safely consume up to maxCount data items from the consume buffer.
  *
+ * Never waits for more items once at least one has been consumed, so it may return less than
+ * maxCount items even before the end of the stream.
+ *
+ * @param baseProtocol Protocol instance
  * @param threadName Name of thread consuming data.
- * @return
+ * @param items Array receiving consumed data
+ * @param maxCount Max number of items to consume
+ * @return Number of items consumed, 0 if the protocol is closed and all items have been consumed
  */
-int protocolConsumeData(const char *threadName)
+static int threeSemConsumeBatch(Protocol *baseProtocol, const char *threadName, int *items, int maxCount)
 {
-	int data;
+	ThreeSemProtocol *protocol = (ThreeSemProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+	int count = 0;
 
-	fprintf(stderr, "%s Waiting on consume semaphore\n", threadName);
+	TRACE("%s Waiting on consume semaphore\n", threadName);
 
 	// Wait until there's room for consuming
-	sem_wait(&sharedSemMayConsume);
+	threeSemWait(protocol, &protocol->sharedSemMayConsume, STATS_SEM_MAY_CONSUME);
+
+	TRACE("%s Waiting on mutex\n", threadName);
+
+	// Found some room, get exclusive access to shared buffer variables. Busy-polling consumers
+	// (see latency.c) spin on both POSIX semaphores, so they never sleep on the way to the items
+	threeSemWait(protocol, &protocol->sharedSemMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Acquired mutex\n", threadName);
 
-	fprintf(stderr, "%s Waiting on mutex\n", threadName);
+	if (bufferConsumeIsExhausted(buffer)) {
+		// We've only been let through to find out nothing will ever be produced again
+		TRACE("\t%s End of stream, signaling consumers\n", threadName);
 
-	// Found some room, get exclusive access to shared buffer variables
-	sem_wait(&sharedSemMutex);
+		// Let the next consumer find out as well
+		threeSemPost(protocol, &protocol->sharedSemMayConsume);
+		threeSemPost(protocol, &protocol->sharedSemMutex);
 
-	fprintf(stderr, "%s Acquired mutex\n", threadName);
+		TRACE("%s Released mutex\n", threadName);
+
+		return 0;
+	}
 
 	// Pop data from buffer
-	data = bufferConsumeData(threadName);
+	while ((count < maxCount) && !bufferConsumeIsExhausted(buffer)) {
+		items[count++] = bufferConsumeData(buffer, threadName);
+	}
+
+	STATS_COUNT(STATS_COUNTER_CONSUMED_ITEMS, count);
 
 	// Check if consume buffer got exhausted
-	if (bufferConsumeIsExhausted()) {
-		fprintf(stderr, "\t%s Consume buffer exhausted\n", threadName);
+	if (bufferConsumeIsExhausted(buffer)) {
+		TRACE("\t%s Consume buffer exhausted\n", threadName);
 
 		// Consume buffer is indeed exhausted, check what's the deal with the produce buffer
-		if (bufferProduceIsExhausted()) {
-			fprintf(stderr, "\t%s Produce buffer also exhausted\n", threadName);
+		if (bufferProduceIsExhausted(buffer)) {
+			TRACE("\t%s Produce buffer also exhausted\n", threadName);
 
 			// Consume buffer is also full, time for swap
-			bufferSwap(threadName);
+			bufferSwap(buffer, threadName);
 
-			fprintf(stderr, "\t%s Signaling consumers and producers\n", threadName);
+			TRACE("\t%s Signaling consumers and producers\n", threadName);
 
 			// Signal both consumers and producers
-			sem_post(&sharedSemMayConsume);
-			sem_post(&sharedSemMayProduce);
+			threeSemPost(protocol, &protocol->sharedSemMayConsume);
+			threeSemPost(protocol, &protocol->sharedSemMayProduce);
+		} else if (protocol->sharedClosed) {
+			TRACE("\t%s Produce buffer closed, flushing it to consumers\n", threadName);
+
+			// Producers are done, so the produce buffer won't get any fuller. Hand whatever is in
+			// there to consumers or, if it's empty, let them know the stream has ended
+			if (!bufferProduceIsEmpty(buffer)) {
+				bufferSwap(buffer, threadName);
+			}
+
+			threeSemPost(protocol, &protocol->sharedSemMayConsume);
 		} else {
-			fprintf(stderr, "\t%s Produce buffer still active, consumers will have to wait\n", threadName);
+			TRACE("\t%s Produce buffer still active, consumers will have to wait\n", threadName);
 		}
 
 	} else {
-		fprintf(stderr, "\t%s Still room for consuming, signaling consumers\n", threadName);
+		TRACE("\t%s Still room for consuming, signaling consumers\n", threadName);
 
 		// There's still room for consuming, allow other consumers to proceed
-		sem_post(&sharedSemMayConsume);
+		threeSemPost(protocol, &protocol->sharedSemMayConsume);
 	}
 
 	// Release mutex
-	sem_post(&sharedSemMutex);
+	threeSemPost(protocol, &protocol->sharedSemMutex);
 
-	fprintf(stderr, "%s Released mutex\n", threadName);
+	TRACE("%s Released mutex\n", threadName);
 
-	return data;
+	return count;
+}
+
+/**
+ * Tell consumers no more data will be produced.
+ *
+ * Must be called once, after all producers are done producing. Consumers will consume whatever
+ * is left in the buffer and then receive end of stream.
+ *
+ * @param baseProtocol Protocol instance
+ * @param threadName Name of thread closing the protocol
+ */
+static void threeSemClose(Protocol *baseProtocol, const char *threadName)
+{
+	ThreeSemProtocol *protocol = (ThreeSemProtocol *) baseProtocol;
+	Buffer *buffer = baseProtocol->buffer;
+
+	threeSemWait(protocol, &protocol->sharedSemMutex, STATS_SEM_MUTEX);
+
+	TRACE("%s Closing produce buffer\n", threadName);
+
+	protocol->sharedClosed = 1;
+
+	// If consumers are still busy with the consume buffer, the last one of them will take care
+	// of the produce buffer. Otherwise they're all waiting, so we have to wake them up ourselves.
+	if (bufferConsumeIsExhausted(buffer)) {
+		if (!bufferProduceIsEmpty(buffer)) {
+			bufferSwap(buffer, threadName);
+		}
+
+		threeSemPost(protocol, &protocol->sharedSemMayConsume);
+	}
+
+	threeSemPost(protocol, &protocol->sharedSemMutex);
 }
 
 /**
  * Initializes shared variables and semaphores.
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @param ops Protocol implementation being created
+ * @param isCoroutine 1 for coroutine semaphores, 0 for POSIX ones
+ * @return New protocol instance, NULL if out of memory
  */
-void protocolInit()
+static Protocol *threeSemCreateOn(Buffer *buffer, const ProtocolOps *ops, int isCoroutine)
 {
+	ThreeSemProtocol *protocol = malloc(sizeof(ThreeSemProtocol));
+
+	if (!protocol) {
+		return NULL;
+	}
+
+	protocol->base.ops = ops;
+	protocol->base.buffer = buffer;
+	protocol->isCoroutine = isCoroutine;
+	protocol->sharedClosed = 0;
+
 	// Initialize semaphores for consumers and producers
-	sem_init(&sharedSemMutex, 0, 1);		// Nobody holds the mutex at the beginning
-	sem_init(&sharedSemMayProduce, 0, 1);	// Since produce buffer is empty, a producer should freely produce
-	sem_init(&sharedSemMayConsume, 0, 0);	// Consumers should hold until the consume buffer becomes empty
+	threeSemInit(protocol, &protocol->sharedSemMutex, 1);		// Nobody holds the mutex at the beginning
+	threeSemInit(protocol, &protocol->sharedSemMayProduce, 1);	// Since produce buffer is empty, a producer should freely produce
+	threeSemInit(protocol, &protocol->sharedSemMayConsume, 0);	// Consumers should hold until the consume buffer becomes empty
+
+	return &protocol->base;
 }
+
+/**
+ * Creates a protocol instance on POSIX semaphores.
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @return New protocol instance, NULL if out of memory
+ */
+static Protocol *threeSemCreate(Buffer *buffer)
+{
+	return threeSemCreateOn(buffer, &threeSemProtocolOps, 0);
+}
+
+/**
+ * Creates a protocol instance on coroutine semaphores.
+ *
+ * @param buffer Initialized buffer to be protected by the protocol
+ * @return New protocol instance, NULL if out of memory
+ */
+static Protocol *threeSemCoroutineCreate(Buffer *buffer)
+{
+	return threeSemCreateOn(buffer, &coroutineProtocolOps, 1);
+}
+
+/**
+ * Destroys semaphores and releases protocol memory.
+ *
+ * @param baseProtocol Protocol instance no longer used by any thread
+ */
+static void threeSemDestroy(Protocol *baseProtocol)
+{
+	ThreeSemProtocol *protocol = (ThreeSemProtocol *) baseProtocol;
+
+	threeSemSemDestroy(protocol, &protocol->sharedSemMutex);
+	threeSemSemDestroy(protocol, &protocol->sharedSemMayProduce);
+	threeSemSemDestroy(protocol, &protocol->sharedSemMayConsume);
+
+	free(protocol);
+}
+
+// Three semaphore protocol implementation
+const ProtocolOps threeSemProtocolOps = {
+	"three_sem",
+	threeSemCreate,
+	threeSemDestroy,
+	threeSemConsumeBatch,
+	threeSemProduceBatch,
+	threeSemClose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+// Three semaphore protocol implementation on coroutine semaphores
+const ProtocolOps coroutineProtocolOps = {
+	"coroutine",
+	threeSemCoroutineCreate,
+	threeSemDestroy,
+	threeSemConsumeBatch,
+	threeSemProduceBatch,
+	threeSemClose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};